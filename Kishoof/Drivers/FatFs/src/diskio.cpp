@@ -26,8 +26,7 @@ uint8_t disk_read(uint8_t pdrv, uint8_t* writeAddress, uint32_t readSector, uint
 
 uint8_t disk_write(uint8_t pdrv, const uint8_t* readBuff, uint32_t writeSector, uint32_t sectorCount)
 {
-	fatTools.Write(readBuff, writeSector, sectorCount);
-	return RES_OK;
+	return fatTools.Write(readBuff, writeSector, sectorCount) ? RES_OK : RES_NOTRDY;	// Refused during a queued flush
 }
 
 
@@ -0,0 +1,39 @@
+#pragma once
+
+/* Force-included in host builds in place of cmsis_gcc.h, which implements the core intrinsics with Arm assembly.
+Barriers and interrupt masking have no effect; byte reversal uses the compiler builtins. Peripheral registers are backed by
+memory mapped at their target addresses (see HostStubs.cpp) so register accesses compile and run unchanged.
+*/
+
+#define __CMSIS_GCC_H
+
+#include <stdint.h>
+
+#define __ASM                     __asm
+#define __INLINE                  inline
+#define __STATIC_INLINE           static inline
+#define __STATIC_FORCEINLINE      __attribute__((always_inline)) static inline
+#define __NO_RETURN               __attribute__((__noreturn__))
+#define __USED                    __attribute__((used))
+#define __WEAK                    __attribute__((weak))
+#define __PACKED                  __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT           struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION            union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)              __attribute__((aligned(x)))
+#define __RESTRICT                __restrict
+#define __COMPILER_BARRIER()      __ASM volatile("":::"memory")
+
+#define __NOP()                   __COMPILER_BARRIER()
+#define __WFI()                   __COMPILER_BARRIER()
+
+__STATIC_FORCEINLINE void __ISB(void) { __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __DSB(void) { __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __DMB(void) { __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __enable_irq(void) {}
+__STATIC_FORCEINLINE void __disable_irq(void) {}
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void) { return 0; }
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t priMask) { (void)priMask; }
+__STATIC_FORCEINLINE uint32_t __REV(uint32_t value) { return __builtin_bswap32(value); }
+__STATIC_FORCEINLINE uint32_t __REV16(uint32_t value) { return (value >> 8 & 0x00FF00FF) | (value << 8 & 0xFF00FF00); }
+__STATIC_FORCEINLINE int16_t __REVSH(int16_t value) { return (int16_t)__builtin_bswap16((uint16_t)value); }
+__STATIC_FORCEINLINE uint8_t __CLZ(uint32_t value) { return value ? (uint8_t)__builtin_clz(value) : 32; }
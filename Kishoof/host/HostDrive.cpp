@@ -0,0 +1,178 @@
+#include "HostDrive.h"
+#include "FatTools.h"
+#include "WaveTable.h"
+#include "Filter.h"
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <unistd.h>
+
+
+bool HostDrive::Create(const char* imagePath)
+{
+	unlink(imagePath);
+	if (!flash.Open(imagePath)) {
+		printf("Unable to create image %s\r\n", imagePath);
+		return false;
+	}
+	flashDevice = &flash;
+	fatTools.InitFatFS();								// Loads header cache from the erased device
+	return fatTools.Format();
+}
+
+
+bool HostDrive::Open(const char* imagePath)
+{
+	if (!flash.Open(imagePath)) {
+		printf("Unable to open image %s\r\n", imagePath);
+		return false;
+	}
+	flashDevice = &flash;
+	return fatTools.InitFatFS();
+}
+
+
+void HostDrive::Close()
+{
+	Flush();
+	flash.Close();
+}
+
+
+bool HostDrive::CopyIn(const char* hostPath, const char* drivePath)
+{
+	FILE* src = fopen(hostPath, "rb");
+	if (src == nullptr) {
+		printf("Unable to open %s\r\n", hostPath);
+		return false;
+	}
+	const std::string name = drivePath ? drivePath : ShortName(hostPath);
+
+	FIL file;
+	if (f_open(&file, name.c_str(), FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+		printf("Unable to create %s on drive\r\n", name.c_str());
+		fclose(src);
+		return false;
+	}
+
+	bool ok = true;
+	uint8_t buffer[4096];
+	size_t bytes;
+	while (ok && (bytes = fread(buffer, 1, sizeof(buffer), src)) > 0) {
+		UINT written;
+		ok = (f_write(&file, buffer, bytes, &written) == FR_OK && written == bytes);
+	}
+	ok = (f_close(&file) == FR_OK) && ok;
+	fclose(src);
+	if (!ok) {
+		printf("Error writing %s to drive\r\n", name.c_str());
+	}
+	return ok;
+}
+
+
+bool HostDrive::CopyOut(const char* drivePath, const char* hostPath)
+{
+	FIL file;
+	if (f_open(&file, drivePath, FA_READ) != FR_OK) {
+		printf("Unable to open %s on drive\r\n", drivePath);
+		return false;
+	}
+	FILE* dest = fopen(hostPath, "wb");
+	if (dest == nullptr) {
+		printf("Unable to create %s\r\n", hostPath);
+		f_close(&file);
+		return false;
+	}
+
+	bool ok = true;
+	uint8_t buffer[4096];
+	UINT bytes;
+	do {
+		ok = (f_read(&file, buffer, sizeof(buffer), &bytes) == FR_OK) && fwrite(buffer, 1, bytes, dest) == bytes;
+	} while (ok && bytes == sizeof(buffer));
+	f_close(&file);
+	fclose(dest);
+	if (!ok) {
+		printf("Error reading %s from drive\r\n", drivePath);
+	}
+	return ok;
+}
+
+
+bool HostDrive::MakeDir(const char* drivePath)
+{
+	if (f_mkdir(drivePath) != FR_OK) {
+		printf("Unable to create folder %s on drive\r\n", drivePath);
+		return false;
+	}
+	return true;
+}
+
+
+void HostDrive::Flush()
+{
+	WaitIdle();
+	fatTools.FlushCache();
+}
+
+
+void HostDrive::WaitIdle()
+{
+	// Stand in for the main loop and flash interrupt: deliver queued write completions until the drive can be read
+	do {
+		flash.Poll();
+		fatTools.CheckCache();
+	} while (fatTools.Busy() || !flash.QueueIdle());
+}
+
+
+bool HostDrive::StartEngine(const char* activeWavetable)
+{
+	// The wavetable list is built as at boot; the active wavetable is selected by short name as when restored from config
+	Flush();
+	filter.Init();
+	memcpy(wavetable.cfg.wavetable, "Default ", sizeof(wavetable.cfg.wavetable));		// Name of built-in wavetable
+	if (activeWavetable != nullptr) {
+		const std::string name = ShortName(activeWavetable);
+		memset(wavetable.cfg.wavetable, ' ', sizeof(wavetable.cfg.wavetable));
+		memcpy(wavetable.cfg.wavetable, name.c_str(), std::min(name.find('.'), sizeof(wavetable.cfg.wavetable)));
+	}
+	const auto start = std::chrono::steady_clock::now();
+	wavetable.Init();
+	listBuildMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	WaitIdle();
+	wavetable.UpdateCache();
+	wavetable.UpdateMipMaps();
+
+	for (uint32_t i = 0; i < Catalogue::capacity; ++i) {
+		if (strncmp(catalogue.name[i], wavetable.cfg.wavetable, 8) == 0) {
+			if (catalogue.invalid[i] != Catalogue::OK) {
+				printf("Wavetable %.8s is invalid: %s\r\n", catalogue.name[i], Catalogue::InvalidText[catalogue.invalid[i]]);
+				return false;
+			}
+			printf("Playing %.8s: %s, %u frames of %u samples\r\n", catalogue.name[i],
+					catalogue.Type(i) == SampleType::PCM16 ? "PCM16" : "Float32", catalogue.tableCount[i], catalogue.FrameLength(i));
+			return true;
+		}
+	}
+	printf("Wavetable %.8s not found\r\n", wavetable.cfg.wavetable);
+	return false;
+}
+
+
+std::string HostDrive::ShortName(const char* hostPath)
+{
+	// Base name truncated to 8.3 and upper cased (the module is built without long file name support)
+	std::string base = hostPath;
+	base = base.substr(base.find_last_of('/') + 1);
+	const size_t dot = base.find_last_of('.');
+	std::string name = base.substr(0, std::min(dot, (size_t)8));
+	if (dot != std::string::npos) {
+		name += base.substr(dot, 4);
+	}
+	for (auto& c : name) {
+		c = toupper(c);
+	}
+	return name;
+}
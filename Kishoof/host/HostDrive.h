@@ -0,0 +1,28 @@
+#pragma once
+
+#include "FlashEmulator.h"
+#include <string>
+
+/* Host side access to the emulated flash drive: image files are formatted and loaded through FatTools and FatFs exactly as
+the module does over USB, and the wavetable engine is started against them. With no program or erase time the emulator runs
+at full speed; tests of flash timing pass their own times.
+*/
+
+class HostDrive {
+public:
+	HostDrive(const uint32_t programMicros = 0, const uint32_t eraseMicros = 0) : flash(programMicros, eraseMicros) {}
+
+	bool Create(const char* imagePath);					// Create a new formatted image, replacing any existing file
+	bool Open(const char* imagePath);					// Mount an existing image
+	void Close();
+	bool CopyIn(const char* hostPath, const char* drivePath = nullptr);	// Drive path defaults to 8.3 name of host file in root
+	bool CopyOut(const char* drivePath, const char* hostPath);
+	bool MakeDir(const char* drivePath);
+	void Flush();										// Write header and write caches to flash synchronously
+	void WaitIdle();									// Run main loop tasks until queued writes and read/write holds have finished
+	bool StartEngine(const char* activeWavetable = nullptr);	// Initialise filter and wavetable list, decode cache and mip levels
+	static std::string ShortName(const char* hostPath);	// 8.3 upper case name of host file
+
+	FlashEmulator flash;
+	float listBuildMs = 0.0f;							// Host time of the wavetable list build in the last StartEngine
+};
@@ -0,0 +1,94 @@
+#include "HostDrive.h"
+#include "Renderer.h"
+#include "HostTests.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <filesystem>
+
+/* Host build of the wavetable engine: runs the module's DSP, file system and flash code against an emulated flash image.
+
+kishoof-host render <script> <output.wav> [wavetable.wav] [image]
+	Plays a control script (see Renderer.h for the format) through the engine using the given wavetable, or the built-in
+	wavetable if none or empty, and writes the output to a stereo float wav file, reporting render time per sample
+
+kishoof-host test [name]
+	Runs all host tests or the named test (see HostTests.cpp)
+
+kishoof-host regress <folder> [image] [record]
+	Runs the golden render regression suite (see Renderer.h) with the wavetables in folder copied to the drive's REGRESS
+	folder, comparing with folder/GOLDEN.BIN, or recording it if 'record' is given
+*/
+
+static int Render(int argc, char* argv[])
+{
+	if (argc < 2) {
+		printf("Usage: kishoof-host render <script> <output.wav> [wavetable.wav] [image]\r\n");
+		return 2;
+	}
+	const char* wavetableFile = (argc > 2 && *argv[2]) ? argv[2] : nullptr;	// Empty name for built-in wavetable
+
+	HostDrive drive;
+	if (!drive.Create((argc > 3) ? argv[3] : "render.img") || !drive.CopyIn(argv[0], "RENDER.TXT") ||
+			(wavetableFile && !drive.CopyIn(wavetableFile))) {
+		return 1;
+	}
+	if (!drive.StartEngine(wavetableFile)) {
+		return 1;
+	}
+
+	const bool ok = renderer.Render();
+	drive.Flush();
+	return (ok && drive.CopyOut("RENDER.WAV", argv[1])) ? 0 : 1;
+}
+
+
+static int Regress(int argc, char* argv[])
+{
+	if (argc < 1) {
+		printf("Usage: kishoof-host regress <folder> [image] [record]\r\n");
+		return 2;
+	}
+	const std::filesystem::path folder = argv[0];
+	const std::string golden = (folder / "GOLDEN.BIN").string();
+	const bool record = (argc > 2 && strcmp(argv[2], "record") == 0);
+
+	HostDrive drive;
+	if (!drive.Create((argc > 1) ? argv[1] : "regress.img") || !drive.MakeDir("REGRESS") || (!record && !drive.CopyIn(golden.c_str()))) {
+		return 1;
+	}
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(folder, error)) {
+		const std::string path = entry.path().string();
+		if (entry.path().extension() == ".WAV" && !drive.CopyIn(path.c_str(), ("REGRESS/" + HostDrive::ShortName(path.c_str())).c_str())) {
+			return 1;
+		}
+	}
+	if (error || !drive.StartEngine()) {
+		printf("Unable to read %s\r\n", argv[0]);
+		return 1;
+	}
+
+	const bool ok = renderer.Regress(record, Renderer::defaultMinSNR, Renderer::defaultMaxError);
+	drive.Flush();
+	return (ok && (!record || drive.CopyOut("GOLDEN.BIN", golden.c_str()))) ? 0 : 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "render") == 0) {
+		return Render(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "regress") == 0) {
+		return Regress(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "test") == 0) {
+		HostTests tests;
+		return tests.Run((argc > 2) ? argv[2] : nullptr) ? 0 : 1;
+	}
+	printf("Usage: kishoof-host render <script> <output.wav> [wavetable.wav] [image]\r\n"
+			"       kishoof-host test [name]\r\n"
+			"       kishoof-host regress <folder> [image] [record]\r\n");
+	return 2;
+}
@@ -0,0 +1,92 @@
+#include "initialisation.h"
+#include "configManager.h"
+#include "WaveTable.h"
+#include "Calib.h"
+#include "USB.h"
+#include "ui.h"
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <sys/mman.h>
+
+/* Hardware stand-ins for the host build: globals normally defined in main.cpp and the drivers that are not compiled for
+the host (USB, display, UI, internal flash config) are replaced by stubs. Peripheral and Cortex system registers are
+backed by anonymous memory mapped at their target addresses before static constructors run (GpioPin members write to GPIO
+and RCC registers), so register accesses compile unchanged and simply store values. The system tick is advanced by a thread.
+*/
+
+__attribute__((constructor(101))) static void MapPeripherals()
+{
+	const struct { uintptr_t base; size_t size; } regions[] = {
+		{PERIPH_BASE, 0x20000000},						// APB, AHB peripherals (including GPIO and RCC)
+		{SCS_BASE & ~0xFFFFF, 0x100000},				// Cortex-M7 private peripheral bus: SysTick, NVIC, SCB, DWT
+	};
+	for (auto& r : regions) {
+		if (mmap((void*)r.base, r.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE,
+				-1, 0) != (void*)r.base) {
+			perror("Unable to map peripheral registers");
+			exit(1);
+		}
+	}
+}
+
+volatile uint32_t SysTickVal;
+bool SafeMode = false;
+uint32_t SystemCoreClock = 280000000;
+bool vcaConnected = false;
+
+volatile ADCValues adc;
+int32_t audioBuffer[audioBufferLength];
+GpioPin debugPin1{GPIOD, 5, GpioPin::Type::Output};
+GpioPin debugPin2{GPIOD, 6, GpioPin::Type::Output};
+
+USB usb;
+UI ui;
+Config config{&wavetable.configSaver, &calib.configSaver};
+
+static std::chrono::steady_clock::time_point debugTimerStart;
+
+static const bool sysTickRunning = [] {
+	std::thread([] {
+		while (true) {
+			std::this_thread::sleep_for(std::chrono::microseconds(sysTickInterval));
+			SysTickVal = SysTickVal + 1;
+		}
+	}).detach();
+	return true;
+}();
+
+
+void StartDebugTimer()
+{
+	debugTimerStart = std::chrono::steady_clock::now();
+}
+
+
+float StopDebugTimer()
+{
+	// Return time running in microseconds
+	return std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - debugTimerStart).count();
+}
+
+
+void DelayMS(uint32_t ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+
+void USB::PauseEndpoint(USBHandler& handler) {}
+void USB::ResumeEndpoint(USBHandler& handler) {}
+void USB::ActivateEndpoint(uint8_t endpoint, const Direction direction, const EndPointType eptype) {}
+void USB::EP0In(const uint8_t* buff, const uint32_t size) {}
+void USB::EPStartXfer(const Direction direction, uint8_t endpoint, uint32_t xfer_len) {}
+void UI::SetWavetable(const int32_t index) {}
+void Config::ScheduleSave() {}
+bool Config::SaveConfig(const bool forceSave) { return true; }
+void CDCHandler::DataIn() {}
+void CDCHandler::DataOut() {}
+void CDCHandler::ActivateEP() {}
+void CDCHandler::ClassSetup(usbRequest& req) {}
+void CDCHandler::ClassSetupData(usbRequest& req, const uint8_t* data) {}
+uint32_t CDCHandler::GetInterfaceDescriptor(const uint8_t** buffer) { return 0; }
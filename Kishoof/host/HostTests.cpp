@@ -0,0 +1,1448 @@
+#include "HostTests.h"
+#include "HostDrive.h"
+#include "WaveTable.h"
+#include "Calib.h"
+#include "FatTools.h"
+#include "Filter.h"
+#include "USB.h"
+#include <cstdio>
+#include <cstring>
+#include <numbers>
+#include <random>
+#include <chrono>
+
+const HostTests::Test HostTests::tests[] = {
+	{"mipaliasing", &HostTests::MipAliasing},
+	{"fragmented", &HostTests::Fragmented},
+	{"cacheload", &HostTests::CacheLoad},
+	{"filter2d", &HostTests::Filter2D},
+	{"tiers", &HostTests::Tiers},
+	{"pitchtracking", &HostTests::PitchTracking},
+	{"fastmath", &HostTests::FastMath},
+	{"polyphase", &HostTests::Polyphase},
+	{"polyphaseq15", &HostTests::PolyphaseQ15},
+	{"additive", &HostTests::Additive},
+	{"floatframes", &HostTests::FloatFrames},
+	{"oversampling", &HostTests::Oversampling},
+	{"writecache", &HostTests::WriteCache},
+	{"writespeed", &HostTests::WriteSpeed},
+	{"mscwrite", &HostTests::MSCWrite},
+	{"indexsave", &HostTests::IndexSave},
+	{"emulator", &HostTests::Emulator},
+	{"queuedflush", &HostTests::QueuedFlush},
+	{"flushpause", &HostTests::FlushPause},
+	{"suspendread", &HostTests::SuspendRead},
+};
+
+
+bool HostTests::Run(const char* name)
+{
+	uint32_t passed = 0, failed = 0;
+	for (auto& test : tests) {
+		if (name == nullptr || strcmp(name, test.name) == 0) {
+			printf("== %s\r\n", test.name);
+			const bool pass = (this->*test.run)();
+			printf("%s: %s\r\n\r\n", test.name, pass ? "Pass" : "FAIL");
+			pass ? ++passed : ++failed;
+		}
+	}
+	if (passed + failed == 0) {
+		printf("No test named %s\r\n", name);
+		return false;
+	}
+	printf("%u passed, %u failed\r\n", passed, failed);
+	return failed == 0;
+}
+
+
+bool HostTests::MipAliasing()
+{
+	// Play the built-in saw frame from its mip levels at fixed pitches and measure the level of harmonics that would fold back
+	// below nyquist relative to the fundamental. Residual aliasing comes from images of the cubic interpolation of each level, so
+	// rises with pitch as the highest harmonics kept are louder (selecting the mip level below the pitch gave -33 dB at 47)
+	constexpr float maxAliasDb = -50.0f;
+	constexpr uint32_t settle = 8192;					// Samples for control smoothing and warp crossfade to settle
+	constexpr uint32_t analyse = 16384;
+	constexpr float pitchIncs[] = {1.5f, 2.7f, 5.3f, 11.1f, 23.5f, 47.0f};
+
+	HostDrive drive;
+	if (!drive.Create("test.img") || !drive.StartEngine()) {
+		return false;
+	}
+
+	bool pass = true;
+	std::vector<float> out(settle + analyse);
+	for (const float target : pitchIncs) {
+		// Pitch increment actually played after conversion to a 16 bit pitch CV
+		const uint16_t pitchCV = std::clamp(std::round(std::log2(target / calib.cfg.pitchBase) / calib.cfg.pitchMult), 0.0f, 65535.0f);
+		const float inc = calib.cfg.pitchBase * std::exp2(pitchCV * calib.cfg.pitchMult);
+		controls.Pitch_CV = pitchCV;
+		RenderChannelA(out.data(), out.size(), inc, 0.5f);			// Position 0.5 plays the second (saw) frame
+
+		const float* samples = out.data() + settle;
+		const float fundamental = AmplitudeAt(samples, analyse, inc / defaultFrameSize);
+		const float nyquistHarmonic = defaultFrameSize / (2.0f * inc);
+		float maxAlias = 0.0f;
+		for (uint32_t h = std::ceil(nyquistHarmonic); h < defaultFrameSize / 2; ++h) {
+			float freq = std::fmod(h * inc / defaultFrameSize, 1.0f);
+			freq = std::min(freq, 1.0f - freq);
+			const float harmonicDist = std::abs(freq * defaultFrameSize / inc - std::round(freq * defaultFrameSize / inc)) * inc / defaultFrameSize;
+			if (harmonicDist * analyse > 4.0f) {						// Ignore aliases falling on the main lobe of a played harmonic
+				maxAlias = std::max(maxAlias, AmplitudeAt(samples, analyse, freq));
+			}
+		}
+		const float aliasDb = 20.0f * std::log10(maxAlias / fundamental);
+		printf("Pitch increment %6.2f: worst alias %6.1f dB\r\n", inc, aliasDb);
+		pass &= (aliasDb < maxAliasDb);
+	}
+	return pass;
+}
+
+
+void HostTests::RenderChannelA(float* out, const uint32_t samples, const float pitchInc, const float posA, const uint16_t warpTypePot, const uint16_t warpAmtPot)
+{
+	// Render channel A from fixed control values (CV inputs at maximum so only pot values are used)
+	controls.WarpCV = 65535;
+	controls.WavetablePosA_CV = 65535;
+	controls.WavetablePosB_CV = 65535;
+	controls.Warp_Amt_Trm = 0;
+	controls.Wavetable_Pos_A_Trm = 0;
+	controls.Warp_Amt_Pot = warpAmtPot;
+	controls.Warp_Type_Pot = warpTypePot;
+	controls.Wavetable_Pos_A_Pot = (uint16_t)(posA * 65535.0f);
+	controls.Wavetable_Pos_B_Pot = 0;
+	wavetable.ResetPlayback(&controls);
+
+	float outB[audioBlockSize];
+	for (uint32_t s = 0; s + audioBlockSize <= samples; s += audioBlockSize) {
+		wavetable.RenderBlock(out + s, outB, audioBlockSize);
+	}
+}
+
+
+float HostTests::AmplitudeAt(const float* samples, const uint32_t count, const float freq)
+{
+	// Amplitude of a sinusoid at freq (cycles per sample) using a Blackman-Harris window to suppress leakage
+	static std::vector<double> window;
+	if (window.size() != count) {
+		window.resize(count);
+		for (uint32_t i = 0; i < count; ++i) {
+			const double x = 2.0 * std::numbers::pi * i / count;
+			window[i] = 0.35875 - 0.48829 * std::cos(x) + 0.14128 * std::cos(2.0 * x) - 0.01168 * std::cos(3.0 * x);
+		}
+	}
+
+	std::complex<double> sum = 0.0;
+	std::complex<double> phasor = 1.0;
+	const std::complex<double> rotate = std::polar(1.0, -2.0 * std::numbers::pi * freq);
+	double windowSum = 0.0;
+	for (uint32_t i = 0; i < count; ++i) {
+		sum += samples[i] * window[i] * phasor;
+		phasor *= rotate;
+		windowSum += window[i];
+	}
+	return 2.0 * std::abs(sum) / windowSum;
+}
+
+
+bool HostTests::Fragmented()
+{
+	// Fragment a wavetable on the drive by writing it over a hole left by a deleted file: it should be assembled in the cache
+	// in order from the cluster chain. Then cut the chain short: the wavetable should be marked corrupt and muted
+	HostDrive drive;
+	if (!drive.Create("test.img") || WriteWav("HOLE.WAV", 1, 256, SampleType::PCM16).empty() || !drive.CopyIn("HOLE.WAV") ||
+			WriteWav("BLOCK.WAV", 1, 256, SampleType::PCM16).empty() || !drive.CopyIn("BLOCK.WAV") || f_unlink("HOLE.WAV") != FR_OK) {
+		return false;
+	}
+	drive.Close();											// Remount so FatFs allocates from the start of the drive
+	if (!drive.Open("test.img")) {
+		return false;
+	}
+	const std::vector<float> source = WriteWav("FRAG.WAV", 8, 2048, SampleType::Float32);
+	if (source.empty() || !drive.CopyIn("FRAG.WAV") || !drive.StartEngine("FRAG.WAV")) {
+		return false;
+	}
+
+	const uint32_t index = wavetable.activeWaveTable;
+	const uint32_t slot = wavetable.cacheSlot;
+	if (wavetable.cacheWaveTable[slot] != index) {
+		printf("Wavetable not decoded to cache\r\n");
+		return false;
+	}
+	uint32_t clusters = 1;
+	for (uint32_t c = catalogue.cluster[index]; fatTools.clusterChain[c] != 0xFFFF; c = fatTools.clusterChain[c]) {
+		clusters += (fatTools.clusterChain[c] != c + 1) ? 1 : 0;		// Count contiguous runs
+	}
+	uint32_t errors = 0;
+	for (uint32_t i = 0; i < source.size(); ++i) {
+		const int16_t expected = std::clamp(std::round(source[i] * 32768.0f), -32768.0f, 32767.0f);
+		errors += (wavetable.cacheBuffer[slot][i] != expected) ? 1 : 0;
+	}
+	printf("Decoded %zu samples from %u cluster runs: %u errors\r\n", source.size(), clusters, errors);
+	bool pass = (clusters > 1 && errors == 0);
+
+	// Break the chain after the first cluster and decode again from flash
+	const uint32_t first = catalogue.cluster[index];
+	const uint16_t next = fatTools.clusterChain[first];
+	fatTools.clusterChain[first] = 0;
+	wavetable.cacheWaveTable[0] = wavetable.cacheWaveTable[1] = WaveTable::noCache;
+	wavetable.cacheRequest = WaveTable::noCache;
+	wavetable.UpdateCache();
+	fatTools.clusterChain[first] = next;
+
+	wavetable.ResetPlayback(&controls);
+	float outA[audioBlockSize], outB[audioBlockSize];
+	float peak = 0.0f;
+	for (uint32_t b = 0; b < 16; ++b) {
+		wavetable.RenderBlock(outA, outB, audioBlockSize);
+		for (uint32_t i = 0; i < audioBlockSize; ++i) {
+			peak = std::max(peak, std::abs(outA[i]));			// Channel B plays additive waves in smooth mode
+		}
+	}
+	printf("Broken chain: %s, channel A peak %.3f\r\n", Catalogue::InvalidText[catalogue.invalid[index]], peak);
+	pass &= (catalogue.invalid[index] == Catalogue::HeaderCorrupt && peak == 0.0f);
+	return pass;
+}
+
+
+bool HostTests::CacheLoad()
+{
+	// Time decoding a float wavetable that fills a cache slot (64 frames of 1024 samples) from the cluster chain to PCM16, checking
+	// every sample. Times are of the host build so only show the relative cost of the decode, not the time on the target
+	constexpr uint32_t frames = 64;
+	constexpr uint32_t frameSize = 1024;
+	constexpr uint32_t loads = 20;
+
+	HostDrive drive;
+	const std::vector<float> source = WriteWav("LOAD.WAV", frames, frameSize, SampleType::Float32);
+	if (source.empty() || !drive.Create("test.img") || !drive.CopyIn("LOAD.WAV") || !drive.StartEngine("LOAD.WAV")) {
+		return false;
+	}
+
+	float loadTime = 0.0f;								// Total decode time in ms
+	for (uint32_t i = 0; i < loads; ++i) {
+		wavetable.cacheWaveTable[0] = wavetable.cacheWaveTable[1] = WaveTable::noCache;
+		wavetable.cacheRequest = WaveTable::noCache;
+		const auto start = std::chrono::steady_clock::now();
+		wavetable.UpdateCache();
+		loadTime += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	const uint32_t slot = wavetable.cacheSlot;
+	if (wavetable.cacheWaveTable[slot] != wavetable.activeWaveTable) {
+		printf("Wavetable not decoded to cache\r\n");
+		return false;
+	}
+	uint32_t errors = 0;
+	for (uint32_t i = 0; i < source.size(); ++i) {
+		const int16_t expected = std::clamp(std::round(source[i] * 32768.0f), -32768.0f, 32767.0f);
+		errors += (wavetable.cacheBuffer[slot][i] != expected) ? 1 : 0;
+	}
+
+	const float ms = loadTime / loads;
+	printf("%u frames of %u float samples: decoded in %.3f ms on the host (%.0f MB/s of float data), %u errors; cache %zu bytes\r\n",
+			frames, frameSize, ms, source.size() * sizeof(float) / (ms * 1000.0f), errors, sizeof(wavetable.cacheBuffer));
+	return errors == 0;
+}
+
+
+bool HostTests::FloatFrames()
+{
+	// Float wavetables of each frame length too large for the cache are played directly from flash: output should match the same
+	// wavetable stored as PCM16 to within its quantisation
+	constexpr float maxErrorDb = -80.0f;
+	constexpr uint32_t settle = 4096;
+	constexpr uint32_t analyse = 8192;
+
+	bool pass = true;
+	std::vector<float> outFloat(settle + analyse), outPCM(settle + analyse);
+	for (uint32_t frameSize = WaveTable::minFrameSize; frameSize <= WaveTable::maxFrameSize; frameSize <<= 1) {
+		const uint32_t frames = WaveTable::cacheSamples / frameSize + 1;
+		bool cached = false;
+		auto render = [&](const char* name, const SampleType type, std::vector<float>& out) {
+			HostDrive drive;									// New drive for each so the engine finds the wavetable by name
+			if (!drive.Create("test.img") || WriteWav(name, frames, frameSize, type).empty() || !drive.CopyIn(name) || !drive.StartEngine(name)) {
+				return false;
+			}
+			cached |= (wavetable.cacheWaveTable[wavetable.cacheSlot] == wavetable.activeWaveTable);
+			RenderChannelA(out.data(), out.size(), 0.0f, 0.5f);
+			return true;
+		};
+		controls.Pitch_CV = 20000;
+		if (!render("FLOAT.WAV", SampleType::Float32, outFloat) || !render("PCM.WAV", SampleType::PCM16, outPCM)) {
+			return false;
+		}
+
+		float peak = 0.0f, maxError = 0.0f;
+		for (uint32_t i = settle; i < outFloat.size(); ++i) {
+			peak = std::max(peak, std::abs(outPCM[i]));
+			maxError = std::max(maxError, std::abs(outFloat[i] - outPCM[i]));
+		}
+		const float errorDb = 20.0f * std::log10(std::max(maxError, 1e-10f) / peak);
+		printf("Frame length %4u, %3u frames: peak %.3f, float against PCM16 %6.1f dB%s\r\n", frameSize, frames, peak, errorDb, cached ? " (cached)" : "");
+		pass &= (!cached && peak > 0.1f && errorDb < maxErrorDb);
+	}
+	return pass;
+}
+
+
+bool HostTests::WriteCache()
+{
+	// Copy files into a new folder with typical flash timings and read them back through FatFs before the write cache is flushed:
+	// folder entries and file data held in the write cache must be returned in place of the stale flash contents
+	constexpr uint32_t files = 24;
+	constexpr uint32_t frames = 4;							// 16KB PCM16 files
+
+	HostDrive drive(150, 25000);
+	if (!drive.Create("test.img") || WriteWav("COPY.WAV", frames, defaultFrameSize, SampleType::PCM16).empty() || !drive.MakeDir("COPIES")) {
+		return false;
+	}
+	for (uint32_t i = 0; i < files; ++i) {
+		if (!drive.CopyIn("COPY.WAV", ("COPIES/COPY" + std::to_string(i) + ".WAV").c_str())) {
+			return false;
+		}
+	}
+
+	DIR dir;
+	FILINFO info;
+	uint32_t found = 0;
+	if (f_opendir(&dir, "COPIES") == FR_OK) {
+		while (f_readdir(&dir, &info) == FR_OK && info.fname[0] != 0) {
+			found += (info.fsize > 0) ? 1 : 0;
+		}
+		f_closedir(&dir);
+	}
+
+	FILE* source = fopen("COPY.WAV", "rb");
+	std::vector<uint8_t> expected(frames * defaultFrameSize * 2 + 1024);
+	expected.resize(source ? fread(expected.data(), 1, expected.size(), source) : 0);
+	if (source) {
+		fclose(source);
+	}
+	uint32_t matching = 0;
+	for (uint32_t i = 0; i < files; ++i) {
+		FIL file;
+		std::vector<uint8_t> data(expected.size() + 1);
+		UINT bytes = 0;
+		if (f_open(&file, ("COPIES/COPY" + std::to_string(i) + ".WAV").c_str(), FA_READ) == FR_OK) {
+			f_read(&file, data.data(), data.size(), &bytes);
+			f_close(&file);
+		}
+		data.resize(bytes);
+		matching += (!expected.empty() && data == expected) ? 1 : 0;
+	}
+	drive.Flush();
+	printf("Before flush: %u of %u files listed, %u read back intact\r\n", found, files, matching);
+	return found == files && matching == files;
+}
+
+
+bool HostTests::WriteSpeed()
+{
+	// Copy small files over existing files of the same size with typical flash timings, counting erases and timing the copy and
+	// final flush. With the folder entries held in the write cache each block of file data is erased once, so erases are bounded
+	// by the data blocks plus the header cache, and throughput must be within 10% of one erase and program per bounded erase
+	constexpr uint32_t files = 24;
+	constexpr uint32_t frames = 4;							// 16KB PCM16 files
+
+	HostDrive drive(BlockDevice::typicalProgramMicros, BlockDevice::typicalEraseMicros);
+	if (!drive.Create("test.img") || WriteWav("OLD.WAV", frames, defaultFrameSize, SampleType::PCM16).empty() ||
+			WriteWav("COPY.WAV", frames * 2, defaultFrameSize / 2, SampleType::PCM16).empty() || !drive.MakeDir("COPIES")) {
+		return false;
+	}
+	FILE* source = fopen("COPY.WAV", "rb");
+	if (source == nullptr) {
+		return false;
+	}
+	fseek(source, 0, SEEK_END);
+	const uint32_t fileBytes = ftell(source);
+	fclose(source);
+
+	auto copyFiles = [&](const char* hostPath) {
+		for (uint32_t i = 0; i < files; ++i) {
+			if (!drive.CopyIn(hostPath, ("COPIES/COPY" + std::to_string(i) + ".WAV").c_str())) {
+				return false;
+			}
+		}
+		drive.Flush();
+		return true;
+	};
+	if (!copyFiles("OLD.WAV")) {
+		return false;
+	}
+	const uint32_t oldErased = drive.flash.blocksErased;
+	const uint32_t oldEvictions = fatTools.writeCacheEvictions;
+	const auto start = std::chrono::steady_clock::now();
+	if (!copyFiles("COPY.WAV")) {
+		return false;
+	}
+	const float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+	const uint32_t erases = drive.flash.blocksErased - oldErased;
+	const uint32_t dataBlocks = files * ((fileBytes + fatClusterSize - 1) / fatClusterSize);
+	const uint32_t maxErases = dataBlocks + fatCacheSectors / fatEraseSectors;
+	const float mbPerSec = files * fileBytes / (seconds * 1048576.0f);
+	const float minMbPerSec = 0.9f * files * fileBytes / (maxErases * BlockDevice::typicalBlockMicros * 1.048576f);
+	printf("Copied %u files of %u bytes: %u erases (limit %u) for %u data blocks, %u evictions, %.3f MB/s (limit %.3f MB/s)\r\n",
+			files, fileBytes, erases, maxErases, dataBlocks, fatTools.writeCacheEvictions - oldEvictions, mbPerSec, minMbPerSec);
+	return erases <= maxErases && mbPerSec >= minMbPerSec && drive.flash.violations == 0;
+}
+
+
+bool HostTests::MSCWrite()
+{
+	// Write through the MSC handler one 512 byte packet per call, as from the USB interrupt, while a queued flash write is running.
+	// A packet needing a dirty write cache block written to flash is held (the endpoint is not prepared so the host is NAKed) and
+	// written from the main loop: the interrupt must never write flash, as it would wait on a queue that cannot advance
+	constexpr uint32_t blocks = fatWriteCacheBlocks + 4;
+	constexpr uint32_t sectors = blocks * fatEraseSectors;
+	constexpr uint32_t firstSector = fatSectorCount - sectors;
+	constexpr uint32_t queuedSector = firstSector - fatEraseSectors;
+	constexpr uint32_t blockWords = BlockDevice::eraseSize / 4;
+
+	HostDrive drive(BlockDevice::typicalProgramMicros, BlockDevice::typicalEraseMicros);
+	if (!drive.Create("test.img")) {
+		return false;
+	}
+	drive.Flush();
+
+	std::mt19937 random(31);
+	std::vector<uint32_t> data(sectors * fatSectorSize / 4);
+	for (auto& word : data) {
+		word = random();
+	}
+	std::vector<uint32_t> queued(blockWords);
+	for (auto& word : queued) {
+		word = random();
+	}
+	const std::vector<uint32_t> zeros(blockWords);
+	drive.flash.WriteData(queuedSector * fatSectorSize, zeros.data(), blockWords);	// Queued write needs an erase
+
+	MSCHandler& msc = usb.msc;
+	float maxInterruptMicros = 0.0f;
+	uint32_t interruptErases = 0;
+	auto packet = [&](const void* buff, const uint32_t bytes) {
+		memcpy(msc.xfer_buff, buff, bytes);
+		msc.outBuffCount = bytes;
+		const uint32_t erased = drive.flash.blocksErased;
+		const auto start = std::chrono::steady_clock::now();
+		msc.DataOut();
+		maxInterruptMicros = std::max(maxInterruptMicros, std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count());
+		interruptErases += drive.flash.blocksErased - erased;
+	};
+
+	uint8_t cbw[31] = {};										// Command block wrapper for WRITE10
+	*(uint32_t*)&cbw[0] = USBD_BOT_CBW_SIGNATURE;
+	*(uint32_t*)&cbw[8] = sectors * fatSectorSize;			// Data length
+	cbw[14] = 10;											// Command block length
+	cbw[15] = SCSI_WRITE10;
+	*(uint32_t*)&cbw[17] = __REV(firstSector);
+	*(uint16_t*)&cbw[22] = __REVSH(sectors);
+	packet(cbw, sizeof(cbw));
+
+	uint32_t deferred = 0, deferredWhileQueued = 0;
+	for (uint32_t s = 0; s < sectors; ++s) {
+		if (s == fatWriteCacheBlocks * fatEraseSectors) {	// Write cache full of dirty blocks: queue a write before evictions
+			drive.flash.QueueWrite(queuedSector * fatSectorSize, queued.data(), blockWords, nullptr);
+		}
+		packet(&data[s * fatSectorSize / 4], fatSectorSize);
+		if (msc.writeDeferred) {
+			++deferred;
+			deferredWhileQueued += drive.flash.QueueIdle() ? 0 : 1;
+			msc.ProcessDeferredWrite();						// Main loop: waits for the queue then evicts a block
+		}
+	}
+	const bool statusSent = msc.bot_state == MSCHandler::BotState::Idle && msc.writeDeferred == false && msc.csw.dDataResidue == 0 &&
+			msc.csw.bStatus == MSCHandler::CSWCmdPassed;
+	drive.Flush();
+
+	const bool intact = memcmp(drive.flash.ReadMapped(firstSector * fatSectorSize), data.data(), data.size() * 4) == 0 &&
+			memcmp(drive.flash.ReadMapped(queuedSector * fatSectorSize), queued.data(), BlockDevice::eraseSize) == 0;
+	printf("MSC write of %u blocks: %u packets deferred to the main loop (%u during a queued write), interrupt %u erases, "
+			"max %.0f us; status %s, data %s\r\n", blocks, deferred, deferredWhileQueued, interruptErases, maxInterruptMicros,
+			statusSent ? "sent" : "NOT SENT", intact ? "intact" : "CORRUPT");
+	return statusSent && intact && deferred == blocks - fatWriteCacheBlocks && deferredWhileQueued > 0 && interruptErases == 0 &&
+			drive.flash.violations == 0;
+}
+
+
+bool HostTests::IndexSave()
+{
+	// Boot a drive of many wavetables with typical flash timings: the first boot scans the file system, then the index is saved
+	// through the flash queue while audio plays at the block rate (calling OutputBlock as the audio interrupt would). Playing a
+	// wavetable that fits the cache, the save must wait until it has been decoded so no blocks are muted. Playing one too large
+	// for the cache from flash, reads suspend the queued write (each costing the suspend latency) but are refused and muted while
+	// a page program has run for less than the policy's minimum time (a third of a program). The cached save pauses MSC and CDC
+	// and must finish within WaveTable::maxIndexSaveMicros (10% allowed for the host). The next boot loads the index
+	constexpr uint32_t folders = 4;
+	constexpr uint32_t filesPerFolder = 50;
+	constexpr uint32_t maxFlashMutedPercent = 10;				// Mostly erases, which reads can suspend
+	constexpr auto blockPeriod = std::chrono::microseconds(1000000 * audioBlockSize / sampleRate);
+
+	HostDrive drive(BlockDevice::typicalProgramMicros, BlockDevice::typicalEraseMicros);
+	if (!drive.Create("test.img") || WriteWav("SMALL.WAV", 1, 256, SampleType::PCM16).empty() ||
+			WriteWav("LARGE.WAV", WaveTable::cacheSamples / defaultFrameSize + 1, defaultFrameSize, SampleType::PCM16).empty() ||
+			!drive.CopyIn("LARGE.WAV")) {
+		return false;
+	}
+	for (uint32_t f = 0; f < folders; ++f) {
+		const std::string folder = "FOLDER" + std::to_string(f);
+		if (!drive.MakeDir(folder.c_str())) {
+			return false;
+		}
+		for (uint32_t i = 0; i < filesPerFolder; ++i) {
+			if (!drive.CopyIn("SMALL.WAV", (folder + "/WAVE" + std::to_string(i) + ".WAV").c_str())) {
+				return false;
+			}
+		}
+	}
+
+	auto boot = [&](const char* name) {
+		drive.Close();
+		wavetable.listScanned = false;
+		if (!drive.Open("test.img") || !drive.StartEngine("LARGE.WAV")) {
+			return false;
+		}
+		printf("%s boot: %s, %u wavetables; list built in %.1f ms on the host\r\n", name,
+				WaveTable::listUpdateNames[(uint32_t)wavetable.bootListUpdate].data(), wavetable.wavetableCount, drive.listBuildMs);
+		return true;
+	};
+	if (!boot("First") || wavetable.bootListUpdate != WaveTable::ListUpdate::rescan) {
+		return false;
+	}
+	const uint32_t large = wavetable.activeWaveTable;
+	uint32_t small = 0;
+	while (small < wavetable.wavetableCount && strncmp(catalogue.name[small], "WAVE0   ", 8) != 0) {
+		++small;
+	}
+
+	// Save index while rendering audio at the block rate, returning the number of blocks muted
+	RenderChannelA(nullptr, 0, 0.0f, 0.5f);					// Sets controls and resets playback
+	float saveMs = 0.0f;
+	auto saveIndex = [&](const char* playing) -> int32_t {
+		extern uint32_t flashBusy;
+		const uint32_t oldFlashBusy = flashBusy;
+		const uint32_t oldSuspends = drive.flash.suspendCount;
+		const uint32_t oldSuspendWait = drive.flash.suspendWaitMicros;
+		const uint32_t oldGeneration = wavetable.indexGeneration;
+		wavetable.indexDirty = true;
+		wavetable.indexSaveBooked = SysTickVal - WaveTable::indexSaveDelay;
+		wavetable.SaveIndex();
+		if (!fatTools.indexQueued) {
+			printf("Index save not started\r\n");
+			return -1;
+		}
+
+		int32_t outBuffer[audioBlockSize * 2];
+		uint32_t blocks = 0;
+		const auto start = std::chrono::steady_clock::now();
+		auto nextBlock = start;
+		while (fatTools.indexQueued) {
+			drive.flash.Poll();
+			wavetable.SaveIndex();
+			if (std::chrono::steady_clock::now() >= nextBlock) {
+				wavetable.OutputBlock(outBuffer);
+				nextBlock += blockPeriod;
+				++blocks;
+			}
+		}
+		saveMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		const uint32_t muted = (flashBusy - oldFlashBusy) / audioBlockSize;
+		printf("Index saved playing %s in %.1f ms: %u of %u audio blocks muted, %u reads suspended a write (%u us waiting)\r\n",
+				playing, saveMs, muted, blocks, drive.flash.suspendCount - oldSuspends, drive.flash.suspendWaitMicros - oldSuspendWait);
+		if (wavetable.indexGeneration != oldGeneration + 1 || blocks == 0) {
+			return -1;
+		}
+		return muted * 100 / blocks;
+	};
+
+	// Save held until the small wavetable is in the cache; the stored catalogue is overwritten so each save rewrites every block
+	std::vector<uint32_t> zeros(sizeof(Catalogue) / 4);
+	drive.flash.WriteData(WaveTable::indexCatalogueAddress, zeros.data(), zeros.size());
+	wavetable.activeWaveTable = small;
+	wavetable.indexDirty = true;
+	wavetable.indexSaveBooked = SysTickVal - WaveTable::indexSaveDelay;
+	wavetable.SaveIndex();
+	const bool held = !fatTools.indexQueued;
+	wavetable.UpdateCache();
+	const int32_t cachedMuted = saveIndex("from cache");
+	const float cachedSaveMs = saveMs;
+	const float maxSaveMs = WaveTable::maxIndexSaveMicros / 1000.0f;
+
+	drive.flash.WriteData(WaveTable::indexCatalogueAddress, zeros.data(), zeros.size());
+	wavetable.activeWaveTable = large;
+	const int32_t flashMuted = saveIndex("from flash");
+	printf("Save %s until the wavetable was cached; cached save %.1f ms (limit %.1f ms)\r\n", held ? "held" : "not held",
+			cachedSaveMs, maxSaveMs);
+
+	bool pass = held && cachedMuted == 0 && cachedSaveMs <= maxSaveMs * 1.1f && flashMuted >= 0 && flashMuted <= (int32_t)maxFlashMutedPercent;
+	pass &= boot("Second") && wavetable.bootListUpdate == WaveTable::ListUpdate::indexed;
+	return pass;
+}
+
+
+std::vector<float> HostTests::WriteWav(const char* path, const uint32_t frames, const uint32_t frameSize, const SampleType type)
+{
+	// Write a mono wavetable of frames with increasing harmonic content to a host file, returning the samples written
+	std::vector<float> samples(frames * frameSize);
+	for (uint32_t f = 0; f < frames; ++f) {
+		for (uint32_t i = 0; i < frameSize; ++i) {
+			float sample = 0.0f;
+			for (uint32_t h = 1; h <= 1 + f * 4; ++h) {
+				sample += std::sin(2.0f * std::numbers::pi_v<float> * h * i / frameSize + f * 0.3f * h) / h;
+			}
+			samples[f * frameSize + i] = std::clamp(sample * 0.5f, -1.0f, 1.0f);
+		}
+	}
+
+	const uint16_t format = (type == SampleType::PCM16) ? 1 : 3;
+	const uint16_t byteDepth = (type == SampleType::PCM16) ? 2 : 4;
+	const uint32_t dataSize = samples.size() * byteDepth;
+	char clm[17];
+	snprintf(clm, sizeof(clm), "<!>%-4u 10000000", frameSize);		// Serum frame length metadata (16 characters)
+	std::vector<uint8_t> wav;
+	auto put = [&](const void* data, const size_t bytes) {
+		wav.insert(wav.end(), (const uint8_t*)data, (const uint8_t*)data + bytes);
+	};
+	auto put32 = [&](const uint32_t v) { put(&v, 4); };
+	auto put16 = [&](const uint16_t v) { put(&v, 2); };
+	put("RIFF", 4); put32(4 + 24 + 8 + 16 + 8 + dataSize); put("WAVE", 4);
+	put("fmt ", 4); put32(16); put16(format); put16(1); put32(sampleRate); put32(sampleRate * byteDepth); put16(byteDepth); put16(byteDepth * 8);
+	put("clm ", 4); put32(16); put(clm, 16);
+	put("data", 4); put32(dataSize);
+	for (const float sample : samples) {
+		if (type == SampleType::PCM16) {
+			put16((int16_t)std::round(sample * 32767.0f));
+		} else {
+			put(&sample, 4);
+		}
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (file == nullptr || fwrite(wav.data(), 1, wav.size(), file) != wav.size()) {
+		printf("Unable to write %s\r\n", path);
+		samples.clear();
+	}
+	if (file != nullptr) {
+		fclose(file);
+	}
+	return samples;
+}
+
+
+bool HostTests::Filter2D()
+{
+	// Kernel blending two frames in one pass over the coefficients against filtering each frame separately and blending the results,
+	// for PCM16 white noise and float saw and noisy sine frames. Both are linear so should match to float rounding; host timings are
+	// only indicative of the target
+	constexpr float maxError = 1.0e-5f;							// Relative to full scale (about 1/3 of a 16 bit LSB)
+	constexpr uint32_t points = 100000;
+	filter.Init();
+
+	std::vector<int16_t> pcmFrames(2 * defaultFrameSize);
+	std::vector<float> floatFrames(2 * defaultFrameSize);
+	std::mt19937 random(1);
+	std::uniform_int_distribution<int32_t> sampleDist(-32768, 32767);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (auto& sample : pcmFrames) {
+		sample = sampleDist(random);							// White noise: all harmonics present at every filter cutoff
+	}
+	for (uint32_t i = 0; i < defaultFrameSize; ++i) {
+		floatFrames[i] = 1.0f - (2.0f * i / defaultFrameSize);	// Saw
+		floatFrames[i + defaultFrameSize] = 0.8f * std::sin(i * 2.0f * std::numbers::pi_v<float> / defaultFrameSize) + 0.2f * (unit(random) - 0.5f);
+	}
+	struct Point { int32_t pos; float ratio; float wtRatio; float inc; };
+	std::vector<Point> tests(points);
+	for (auto& p : tests) {
+		p = {(int32_t)(unit(random) * defaultFrameSize), unit(random), unit(random), std::exp2(unit(random) * 7.0f)};
+	}
+
+	auto test = [&]<typename sampleType>(const sampleType* frame1, const sampleType* frame2, const float fullScale, const char* name) {
+		float error = 0.0f, sum = 0.0f;
+		auto start = std::chrono::steady_clock::now();
+		for (auto& p : tests) {
+			sum += filter.CalcInterpolatedFilter2D(p.pos, frame1, frame2, p.ratio, p.wtRatio, p.inc);
+		}
+		const double fusedTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / points;
+		start = std::chrono::steady_clock::now();
+		for (auto& p : tests) {
+			sum += std::lerp(filter.CalcInterpolatedFilter(p.pos, frame1, p.ratio, p.inc), filter.CalcInterpolatedFilter(p.pos, frame2, p.ratio, p.inc), p.wtRatio);
+		}
+		const double twoPassTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / points;
+
+		for (auto& p : tests) {
+			const float fused = filter.CalcInterpolatedFilter2D(p.pos, frame1, frame2, p.ratio, p.wtRatio, p.inc);
+			const float twoPass = std::lerp(filter.CalcInterpolatedFilter(p.pos, frame1, p.ratio, p.inc),
+					filter.CalcInterpolatedFilter(p.pos, frame2, p.ratio, p.inc), p.wtRatio);
+			error = std::max(error, std::abs(fused - twoPass) / fullScale);
+		}
+		printf("%s fused blend: max error %.2e of full scale; %.1f ns per sample against %.1f ns for two passes (checksum %.0f)\r\n",
+				name, error, fusedTime, twoPassTime, sum);
+		return error < maxError;
+	};
+
+	const bool pcmPass = test(pcmFrames.data(), pcmFrames.data() + defaultFrameSize, 32768.0f, "PCM16");
+	const bool floatPass = test(floatFrames.data(), floatFrames.data() + defaultFrameSize, 1.0f, "Float32");
+	return pcmPass && floatPass;
+}
+
+
+bool HostTests::Tiers()
+{
+	// Alias to signal ratio of each interpolation tier at every filter LUT position: a sawtooth frame is split into the harmonics below
+	// nyquist at the LUT's pitch increment and those above, so any output from the upper harmonics is aliasing. The tier selected at each
+	// position must be within 3dB of the full FIR (the rule the tier boundaries were chosen by, with 0.2dB allowed for position 2 which
+	// is kept short to fit the full FIR banks in DTCM), measured with the float kernels
+	constexpr float maxShortFirLossDb = 3.2f;
+	constexpr uint32_t samples = 16384;
+	filter.Init();
+
+	std::vector<float> lowHarmonics(defaultFrameSize), highHarmonics(defaultFrameSize);
+	std::vector<std::complex<float>> spectrum(defaultFrameSize);
+	auto buildTable = [&](std::vector<float>& table, const uint32_t firstHarmonic, const uint32_t lastHarmonic) {
+		std::fill(spectrum.begin(), spectrum.end(), 0.0f);
+		for (uint32_t h = firstHarmonic; h < lastHarmonic; ++h) {
+			spectrum[h] = {0.0f, -0.25f / h};
+			spectrum[defaultFrameSize - h] = {0.0f, 0.25f / h};
+		}
+		filter.FFT(spectrum.data(), defaultFrameSize, true);
+		for (uint32_t i = 0; i < defaultFrameSize; ++i) {
+			table[i] = spectrum[i].real();
+		}
+	};
+	auto runTier = [&](const Filter::Tier t, const float* table, const uint32_t lutPos, const int32_t pos, const float ratio) {
+		if (t == Filter::Tier::hermite) {
+			return filter.CalcHermite<false, defaultFrameSize>(pos, table, table, ratio, 0.0f);
+		} else if (t == Filter::Tier::shortFIR) {
+			return filter.Convolve<Filter::shortFirTaps, false>(pos, table, table, ratio, 0.0f, filter.shortFilterLUT[lutPos].coeff);
+		}
+		return filter.Convolve<Filter::firTaps, false>(pos, table, table, ratio, 0.0f, filter.filterLUT[lutPos].coeff);
+	};
+
+	bool pass = true;
+	printf("LUT     Inc  Hermite  Short FIR  Full FIR  Selected   [Alias to signal ratio dB]\r\n");
+	for (uint32_t lutPos = 0; lutPos < Filter::lutSize; ++lutPos) {
+		const float inc = filter.filterLUT[lutPos].inc;
+		const uint32_t nyquistHarmonic = std::min((uint32_t)std::ceil(defaultFrameSize / (2.0f * inc)), defaultFrameSize / 2);
+		buildTable(lowHarmonics, 1, nyquistHarmonic);
+		buildTable(highHarmonics, nyquistHarmonic, defaultFrameSize / 2);
+
+		float aliasRatio[3];
+		for (uint32_t t = 0; t < 3; ++t) {
+			float signal = 0.0f, alias = 0.0f, readPos = 0.0f;
+			for (uint32_t s = 0; s < samples; ++s) {
+				readPos = std::fmod(readPos + inc, (float)defaultFrameSize);
+				const float low = runTier((Filter::Tier)t, lowHarmonics.data(), lutPos, (int32_t)readPos, readPos - (int32_t)readPos);
+				const float high = runTier((Filter::Tier)t, highHarmonics.data(), lutPos, (int32_t)readPos, readPos - (int32_t)readPos);
+				signal += low * low;
+				alias += high * high;
+			}
+			aliasRatio[t] = (alias > 0.0f) ? 10.0f * std::log10(signal / alias) : 999.9f;
+		}
+
+		const Filter::Tier selected = filter.filterLUT[lutPos].tier;
+		const bool ok = aliasRatio[(uint32_t)selected] >= aliasRatio[(uint32_t)Filter::Tier::fullFIR] - maxShortFirLossDb;
+		printf("%3u %7.2f %8.1f %10.1f %9.1f  %s%s\r\n", lutPos, inc, aliasRatio[0], aliasRatio[1], aliasRatio[2],
+				Filter::tierNames[(uint32_t)selected].data(), ok ? "" : "  FAIL");
+		pass &= ok;
+	}
+	return pass;
+}
+
+
+bool HostTests::PitchTracking()
+{
+	// Step the pitch CV and compare the pitch increments the engine ramps to per sample from its block rate control stage with the
+	// original per sample smoothing filter of the exact pitch. Block end values are n iterations of the same filter so settle to the
+	// same pitch; in the first block after a jump the linear ramp departs from the filter's exponential curve by about 1% of the jump
+	constexpr float maxSettledCents = 0.01f;
+	constexpr float maxJumpCents = 50.0f;				// Transient on jumps of up to 3.6 octaves
+	constexpr float maxSemitoneCents = 1.5f;			// Transient on semitone steps
+	constexpr uint32_t stepBlocks = 150;				// 100ms per step
+	const uint16_t semitone = std::round(-1.0f / (12.0f * calib.cfg.pitchMult));
+
+	auto pitchTarget = [](const uint16_t pitchCV) {
+		return calib.cfg.pitchBase * std::exp2((double)pitchCV * calib.cfg.pitchMult);
+	};
+
+	float maxSettled = 0.0f;							// Largest deviation in cents at the end of each step
+	auto sweep = [&](auto stepCV) {
+		controls.Pitch_CV = stepCV(0);
+		wavetable.ResetPlayback(&controls);
+		double perSample = pitchTarget(controls.Pitch_CV);
+		wavetable.smoothedInc = {(float)perSample, (float)perSample, 0.0f};
+		float maxTransient = 0.0f;						// Largest deviation in cents while settling
+
+		for (uint32_t step = 1; step <= 64; ++step) {
+			controls.Pitch_CV = stepCV(step);
+			const double target = pitchTarget(controls.Pitch_CV);
+			for (uint32_t b = 0; b < stepBlocks; ++b) {
+				wavetable.UpdateControls(audioBlockSize);
+				for (uint32_t s = 0; s < audioBlockSize; ++s) {
+					perSample = WaveTable::controlSmoothing * perSample + (1.0 - WaveTable::controlSmoothing) * target;
+					maxTransient = std::max(maxTransient, (float)(1200.0 * std::abs(std::log2(wavetable.smoothedInc.Next() / perSample))));
+				}
+			}
+			maxSettled = std::max(maxSettled, (float)(1200.0 * std::abs(std::log2(wavetable.smoothedInc.val / perSample))));
+		}
+		return maxTransient;
+	};
+
+	const float jumpCents = sweep([](const uint32_t step) { return (uint16_t)(step * 40503); });	// Spread over full ADC range
+	const float semitoneCents = sweep([&](const uint32_t step) { return (uint16_t)(32768 + (step % 2) * semitone); });
+
+	printf("Max deviation while settling: large jumps %.3f cents, semitone steps %.4f cents; max settled deviation %.4f cents\r\n",
+			jumpCents, semitoneCents, maxSettled);
+	return maxSettled < maxSettledCents && jumpCents < maxJumpCents && semitoneCents < maxSemitoneCents;
+}
+
+
+bool HostTests::FastMath()
+{
+	// Sweep the full pitch ADC range with the current and default calibration values, comparing FastExp2 with exp2 in cents and
+	// FastLog2 (and the filter LUT position derived from it) with log2 at the pitch increments of each octave switch setting
+	constexpr float maxExp2Cents = 0.1f;				// V/Oct tracking budget
+	constexpr float maxLog2Error = 4.0e-6f;				// Includes rounding of the float result (ulp 9.5e-7 above 8)
+	float exp2Cents = 0.0f;
+	float log2Error = 0.0f;
+	uint32_t lutMismatches = 0;
+	const struct { float base; float mult; } calibs[] = {{calib.cfg.pitchBase, calib.cfg.pitchMult}, {Calib::pitchBaseDef, Calib::pitchMultDef}};
+
+	for (auto& c : calibs) {
+		for (uint32_t adc = 0; adc < 65536; ++adc) {
+			const double exact = c.base * std::exp2((double)adc * c.mult);
+			const float fast = c.base * FastExp2((float)adc * c.mult);
+			exp2Cents = std::max(exp2Cents, (float)(1200.0 * std::abs(std::log2(fast / exact))));
+
+			for (const float octave : {0.5f, 1.0f, 2.0f}) {
+				const float inc = exact * octave;
+				log2Error = std::max(log2Error, (float)std::abs(FastLog2(inc) - std::log2((double)inc)));
+				const uint32_t lutPos = std::min(uint32_t(std::max(std::round(std::log2(inc) * Filter::lutLookupMult), 0.0f)), Filter::lutSize - 1);
+				const uint32_t fastLutPos = std::clamp((int32_t)(FastLog2(inc) * Filter::lutLookupMult + 0.5f), (int32_t)0, (int32_t)Filter::lutSize - 1);
+				lutMismatches += (lutPos != fastLutPos);
+			}
+		}
+	}
+
+	printf("FastExp2: max error %.4f cents; FastLog2: max error %.3e octaves; filter LUT mismatches %u of %u\r\n",
+			exp2Cents, log2Error, lutMismatches, 2 * 65536 * 3);
+	return exp2Cents < maxExp2Cents && log2Error < maxLog2Error && lutMismatches == 0;
+}
+
+
+bool HostTests::Polyphase()
+{
+	// Error of the polyphase kernel for PCM16 and float sources at random fractional read positions of sines, measured against the
+	// exact sine after removing the filter's gain at that frequency. Error from interpolating linearly between adjacent phases falls
+	// by 12dB for each doubling of the phase count until limited by the variation in gain of the prototype with fractional delay
+	constexpr float maxErrorDb = -60.0f;						// Worst harmonic up to 3/8 of the sample rate (-42dB with 8 phases)
+	constexpr uint32_t points = 20000;
+	filter.Init();
+	const float pitchInc = std::exp2(7.0f / 90.0f);			// First full FIR LUT position
+
+	std::vector<float> floatFrame(defaultFrameSize);
+	std::vector<int16_t> pcmFrame(defaultFrameSize);
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	float worstError = -200.0f;
+	printf("Harmonic  Float dB  PCM16 dB\r\n");
+	for (const uint32_t harmonic : {64, 256, 512, 768}) {
+		const double omega = 2.0 * std::numbers::pi * harmonic / defaultFrameSize;
+		for (uint32_t i = 0; i < defaultFrameSize; ++i) {
+			floatFrame[i] = 0.5f * std::sin(omega * i);
+			pcmFrame[i] = (int16_t)std::round(floatFrame[i] * 32767.0f);
+		}
+
+		// Gain and phase at this frequency from integer positions, where both kernels use the same prototype phase
+		auto expected = [&](const int32_t pos, const float ratio) {
+			return 0.5 * std::sin(omega * (pos + (double)ratio - Filter::firDelay));
+		};
+		double gain[2] = {}, norm = 0.0;
+		for (uint32_t i = 0; i < defaultFrameSize; ++i) {
+			const double e = expected(i, 0.0f);
+			gain[0] += filter.CalcInterpolatedFilter(i, floatFrame.data(), 0.0f, pitchInc) * e;
+			gain[1] += filter.CalcInterpolatedFilter(i, pcmFrame.data(), 0.0f, pitchInc) * (1.0 / 32767.0) * e;
+			norm += e * e;
+		}
+
+		double error[2] = {}, signal = 0.0;
+		for (uint32_t i = 0; i < points; ++i) {
+			const int32_t pos = unit(random) * defaultFrameSize;
+			const float ratio = unit(random);
+			const double e = expected(pos, ratio);
+			const double diff0 = filter.CalcInterpolatedFilter(pos, floatFrame.data(), ratio, pitchInc) - e * gain[0] / norm;
+			const double diff1 = filter.CalcInterpolatedFilter(pos, pcmFrame.data(), ratio, pitchInc) * (1.0 / 32767.0) - e * gain[1] / norm;
+			error[0] += diff0 * diff0;
+			error[1] += diff1 * diff1;
+			signal += e * e;
+		}
+		const float errorDb[2] = {(float)(10.0 * std::log10(error[0] / signal)), (float)(10.0 * std::log10(error[1] / signal))};
+		printf("%8u %9.1f %9.1f\r\n", harmonic, errorDb[0], errorDb[1]);
+		worstError = std::max({worstError, errorDb[0], errorDb[1]});
+	}
+
+	// Only phases up to half a sample are stored: reading the time reversed frame at the mirrored position uses the mirrored phases,
+	// so should give the same output at every LUT position
+	std::vector<int16_t> reversed(defaultFrameSize);
+	for (uint32_t i = 0; i < defaultFrameSize; ++i) {
+		pcmFrame[i] = (int16_t)((unit(random) - 0.5f) * 65535.0f);
+	}
+	for (uint32_t i = 0; i < defaultFrameSize; ++i) {
+		reversed[i] = pcmFrame[(defaultFrameSize - i) & (defaultFrameSize - 1)];
+	}
+	float mirrorError = 0.0f;
+	for (uint32_t lutPos = Filter::hermiteLUTLimit; lutPos < Filter::lutSize; ++lutPos) {
+		const float inc = filter.filterLUT[lutPos].inc;
+		for (uint32_t i = 0; i < points / 10; ++i) {
+			const int32_t pos = unit(random) * defaultFrameSize;
+			const float ratio = (i == 0) ? 0.0f : unit(random);			// Ratio 0 reads phase 0 forwards and phase 32 mirrored
+			const int32_t mirrorPos = 2 * Filter::firDelay - pos - 1;
+			const float forwards = filter.CalcInterpolatedFilter(pos, pcmFrame.data(), ratio, inc);
+			const float backwards = filter.CalcInterpolatedFilter(mirrorPos & (defaultFrameSize - 1), reversed.data(), 1.0f - ratio, inc);
+			mirrorError = std::max(mirrorError, std::abs(forwards - backwards) / 32768.0f);
+		}
+	}
+	printf("Mirrored phases: max difference %.2e of full scale; %u of %u phases stored, %u bytes\r\n", mirrorError,
+			Filter::storedPhases, Filter::polyphases + 1, Filter::polyphaseBytes);
+	return worstError < maxErrorDb && mirrorError < 1.0e-6f;
+}
+
+
+bool HostTests::PolyphaseQ15()
+{
+	// Fixed point polyphase banks against the float path at every FIR LUT position, for white noise PCM16 and float sources: at random
+	// fractional positions against the same polyphase filter evaluated in double precision from the unquantised prototype (so every
+	// phase, including those mirrored from the stored half, is checked), and at integer positions against the float Convolve kernel
+	constexpr float maxErrorDb = -100.0f;
+	constexpr uint32_t points = 2000;
+	filter.Init();
+
+	std::mt19937 random(11);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<int16_t> pcmFrame(defaultFrameSize);
+	std::vector<float> floatFrame(defaultFrameSize);
+	for (uint32_t i = 0; i < defaultFrameSize; ++i) {
+		pcmFrame[i] = std::clamp((int32_t)std::round((unit(random) - 0.5f) * 65535.0f), -32768, 32767);
+		floatFrame[i] = unit(random) - 0.5f;
+	}
+	struct Point { int32_t pos; float ratio; };
+	std::vector<Point> tests(points);
+	for (auto& p : tests) {
+		p = {(int32_t)(unit(random) * defaultFrameSize), unit(random)};
+	}
+
+	float worst[2][2] = {{-200.0f, -200.0f}, {-200.0f, -200.0f}};		// [fractional, integer][PCM16, float]
+	auto check = [&]<uint32_t taps>(const uint32_t lutPos, const Filter::FilterLUT<taps>& lut, const Filter::FilterQ15<taps>& bank) {
+		// Unquantised phases normalised to the DC gain of phase 0 as in BuildLUT
+		const float omega = 1.0f / lut.inc;
+		double coeff[Filter::polyphases + 1][taps + 1];
+		double dcGain0 = 0.0;
+		for (uint32_t p = 0; p <= Filter::polyphases; ++p) {
+			double dcGain = 0.0;
+			for (uint32_t k = 0; k < taps + 1; ++k) {
+				coeff[p][k] = filter.PrototypeCoeff(omega, k - (float)p / Filter::polyphases, taps);
+				dcGain += coeff[p][k];
+			}
+			dcGain0 = (p == 0) ? dcGain : dcGain0;
+			for (auto& c : coeff[p]) {
+				c *= dcGain0 / dcGain;
+			}
+		}
+
+		auto measure = [&]<typename sampleType>(const sampleType* frame, const uint32_t source) {
+			double error[2] = {}, signal[2] = {};
+			for (auto& p : tests) {
+				const int32_t start = p.pos - Filter::firDelay - (taps - 1) / 2;
+				const float phasePos = p.ratio * Filter::polyphases;
+				const uint32_t phase = std::min((uint32_t)phasePos, Filter::polyphases - 1);
+				double sample0 = 0.0, sample1 = 0.0;
+				for (uint32_t k = 0; k < taps + 1; ++k) {
+					const double x = frame[(start + k) & (defaultFrameSize - 1)];
+					sample0 += coeff[phase][k] * x;
+					sample1 += coeff[phase + 1][k] * x;
+				}
+				const double ref = sample0 + (phasePos - phase) * (sample1 - sample0);
+				const double diff = ref - filter.ConvolvePolyphase<defaultFrameSize, false>(p.pos, frame, frame, p.ratio, 0.0f, bank);
+				error[0] += diff * diff;
+				signal[0] += ref * ref;
+
+				const double floatRef = filter.Convolve<taps, false>(p.pos, frame, frame, 0.0f, 0.0f, lut.coeff);
+				const double intDiff = floatRef - filter.ConvolvePolyphase<defaultFrameSize, false>(p.pos, frame, frame, 0.0f, 0.0f, bank);
+				error[1] += intDiff * intDiff;
+				signal[1] += floatRef * floatRef;
+			}
+			for (uint32_t i = 0; i < 2; ++i) {
+				worst[i][source] = std::max(worst[i][source], (float)(10.0 * std::log10(error[i] / signal[i])));
+			}
+		};
+		measure(pcmFrame.data(), 0);
+		measure(floatFrame.data(), 1);
+	};
+
+	for (uint32_t lutPos = 0; lutPos < Filter::lutSize; ++lutPos) {
+		const uint8_t slot = Filter::polyphaseSlot[lutPos];
+		if (Filter::lutTiers[lutPos] == Filter::Tier::fullFIR) {
+			check(lutPos, filter.filterLUT[lutPos], filter.q15LUT[slot]);
+		} else if (Filter::lutTiers[lutPos] == Filter::Tier::shortFIR) {
+			check(lutPos, filter.shortFilterLUT[lutPos], filter.shortQ15LUT[slot]);
+		}
+	}
+	printf("Worst error against float: fractional positions PCM16 %.1f dB, float %.1f dB; integer positions PCM16 %.1f dB, float %.1f dB\r\n",
+			worst[0][0], worst[0][1], worst[1][0], worst[1][1]);
+	return std::max({worst[0][0], worst[0][1], worst[1][0], worst[1][1]}) < maxErrorDb;
+}
+
+
+bool HostTests::Additive()
+{
+	// Chebyshev recurrence of the additive engine against sinf: each harmonic alone at full level, then a 64 harmonic saw, at
+	// read positions with fractional parts (where the rotated LUT sine and cosine are used). Then check the block rate update
+	// culls harmonics at or above nyquist. Error grows with harmonic number as 2cos(4x) is held to float precision: the recurrence
+	// is least well conditioned near x = 0 where it amplifies that rounding the most (-76dB for harmonic 64 alone, -87dB for a saw)
+	constexpr float maxHarmonicErrorDb = -70.0f;
+	constexpr float maxSawErrorDb = -85.0f;
+	constexpr uint32_t positions = 20480;
+	constexpr float posStep = 2048.0f / positions + 0.0001f;	// Avoid landing on whole LUT entries
+	constexpr float radians = 2.0f * std::numbers::pi_v<float> / 2048.0f;
+	auto harmonic = [&](const uint32_t h, const float pos) {
+		return sinf(std::fmod((double)h * pos, 2048.0) * radians);	// Reduce phase exactly so reference error is not scaled by h
+	};
+
+	auto maxError = [&](auto reference) {
+		float error = 0.0f;
+		for (uint32_t i = 0; i < positions; ++i) {
+			const float pos = std::fmod(i * posStep, 2048.0f);
+			error = std::max(error, std::abs(wavetable.AdditiveWave(pos) - reference(pos)));
+		}
+		return 20.0f * std::log10(std::max(error, 1.0e-12f));
+	};
+
+	std::fill(std::begin(wavetable.harmonicDelta), std::end(wavetable.harmonicDelta), 0.0f);
+	wavetable.activeHarmonics = WaveTable::harmonicCount;
+	wavetable.additiveRamp = 0.0f;
+	wavetable.additiveRampInc = 0.0f;
+
+	float worstHarmonic = -200.0f;
+	uint32_t worstH = 0;
+	for (uint32_t h = 1; h <= WaveTable::harmonicCount; ++h) {
+		std::fill(std::begin(wavetable.harmonicLevel), std::end(wavetable.harmonicLevel), 0.0f);
+		wavetable.harmonicLevel[h - 1] = 1.0f;
+		const float error = maxError([&](const float pos) { return harmonic(h, pos); });
+		if (error > worstHarmonic) {
+			worstHarmonic = error;
+			worstH = h;
+		}
+	}
+	printf("Single harmonics: worst error %.1f dB at harmonic %u\r\n", worstHarmonic, worstH);
+
+	for (uint32_t h = 0; h < WaveTable::harmonicCount; ++h) {
+		wavetable.harmonicLevel[h] = 0.6f / (h + 1);
+	}
+	const float sawError = maxError([&](const float pos) {
+		float sum = 0.0f;
+		for (uint32_t h = 0; h < WaveTable::harmonicCount; ++h) {
+			sum += wavetable.harmonicLevel[h] * harmonic(h + 1, pos);
+		}
+		return sum;
+	});
+	printf("Saw (%u harmonics): max error %.1f dB\r\n", WaveTable::harmonicCount, sawError);
+
+	// Culling: all harmonic sets at full level, pitch increment of 50 (nyquist between harmonics 20 and 21)
+	for (auto& set : wavetable.additiveHarmonics) {
+		std::fill(std::begin(set), std::end(set), 1.0f);
+	}
+	const uint32_t oldSets = wavetable.harmonicSets;
+	wavetable.harmonicSets = 1;
+	wavetable.smoothedInc = {50.0f, 50.0f, 0.0f};
+	wavetable.UpdateAdditive(audioBlockSize);
+	wavetable.UpdateAdditive(audioBlockSize);
+	uint32_t aboveNyquist = 0;
+	for (uint32_t h = 0; h < WaveTable::harmonicCount; ++h) {
+		const float level = wavetable.harmonicLevel[h] + wavetable.harmonicDelta[h];
+		aboveNyquist += ((h + 1) * 50.0f >= 1024.0f && level != 0.0f) ? 1 : 0;
+	}
+	printf("Culling at increment 50: %u harmonics active, %u above nyquist\r\n", wavetable.activeHarmonics, aboveNyquist);
+	wavetable.harmonicSets = oldSets;
+	wavetable.CalcAdditive();									// Restore harmonic sets from config
+
+	return worstHarmonic < maxHarmonicErrorDb && sawError < maxSawErrorDb && aboveNyquist == 0;
+}
+
+
+bool HostTests::Oversampling()
+{
+	// Render channel A through the engine with mirror and TZFM warps (TZFM modulated by channel B's additive wave) at each forced
+	// oversampling factor and the automatic one, measuring energy between harmonics (aliasing) and above 20kHz relative to the
+	// harmonics. The pitch is set so a whole number of cycles fits the FFT and aliases fall between harmonics. Where the automatic
+	// mode oversamples, aliasing must drop by at least 6dB compared with playing at 1x, and must not rise from 2x to 4x. The
+	// automatic mode must match the forced factor it selects (if it switches factor while playing, crossfades add aliasing)
+	constexpr float minAliasDropDb = 6.0f;
+	constexpr uint32_t settle = 8192;					// Samples for control smoothing, warp crossfade and decimators to settle
+	constexpr uint32_t fftSize = 16384;
+	constexpr uint32_t highBin = 20000 * fftSize / sampleRate;
+	constexpr uint32_t cycleBins = fftSize / defaultFrameSize;		// FFT bins per harmonic at a pitch increment of 1
+	constexpr uint16_t warpPot[] = {0, 0, 0, 3 * 13107 + 6553, 4 * 13107 + 6553};	// Warp type pot at centre of each warp's range
+	struct { WaveTable::Warp warp; uint16_t amount; } tests[] = {
+		{WaveTable::Warp::mirror, 16384}, {WaveTable::Warp::mirror, 6554}, {WaveTable::Warp::tzfm, 49152}, {WaveTable::Warp::tzfm, 65535}
+	};
+
+	HostDrive drive;
+	if (!drive.Create("test.img") || !drive.StartEngine()) {
+		return false;
+	}
+
+	const float oldPitchBase = calib.cfg.pitchBase;
+	const uint32_t oldOversampleMode = wavetable.oversampleMode;
+	std::vector<float> out(settle + fftSize);
+	std::vector<std::complex<float>> spectrum(fftSize);
+	bool pass = true;
+
+	printf("Warp    Amount  Pitch Hz  Oversample  Alias dB  >20kHz dB  Host us per block\r\n");
+	for (auto& test : tests) {
+		for (const float inc : {7.0f, 31.0f, 131.0f}) {
+			calib.cfg.pitchBase = inc;					// Pitch CV of 0 plays the base increment exactly
+			controls.Pitch_CV = 0;
+
+			float aliasDb[WaveTable::maxOversample + 1] = {};
+			float autoAliasDb = 0.0f;
+			uint32_t autoOversample = 0;
+			for (const uint32_t mode : {1, 2, 4, 0}) {
+				wavetable.oversampleMode = mode;
+				const auto start = std::chrono::steady_clock::now();
+				RenderChannelA(out.data(), out.size(), inc, 0.5f, warpPot[(uint32_t)test.warp], test.amount);
+				const float blockTime = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count() * audioBlockSize / out.size();
+				const uint32_t factor = wavetable.oversample;
+
+				for (uint32_t i = 0; i < fftSize; ++i) {
+					const float x = 2.0f * std::numbers::pi_v<float> * i / fftSize;
+					const float window = 0.35875f - 0.48829f * std::cos(x) + 0.14128f * std::cos(2.0f * x) - 0.01168f * std::cos(3.0f * x);
+					spectrum[i] = out[settle + i] * window;
+				}
+				filter.FFT(spectrum.data(), fftSize, false);
+
+				float harmonics = 0.0f, alias = 0.0f, high = 0.0f;
+				const uint32_t harmonicBins = (uint32_t)inc * cycleBins;
+				for (uint32_t i = 1; i < fftSize / 2; ++i) {
+					const float power = std::norm(spectrum[i]);
+					const uint32_t dist = std::min(i % harmonicBins, harmonicBins - i % harmonicBins);
+					(dist <= 4 ? harmonics : alias) += power;		// Blackman-Harris main lobe is 4 bins either side
+					if (i > highBin) {
+						high += power;
+					}
+				}
+				const float db = 10.0f * std::log10(alias / harmonics);
+				if (mode == 0) {
+					autoOversample = factor;
+					autoAliasDb = db;
+				} else {
+					aliasDb[factor] = db;
+				}
+				printf("%-7s %6.2f %9.0f %5u%s %9.1f %10.1f %18.1f\r\n", WaveTable::warpNames[(uint32_t)test.warp].data(), test.amount / 65535.0f,
+						inc * sampleRate / defaultFrameSize, factor, mode == 0 ? " auto" : "     ", db, 10.0f * std::log10(high / harmonics), blockTime);
+			}
+
+			pass &= std::abs(autoAliasDb - aliasDb[autoOversample]) < 1.0f;
+			if (autoOversample > 1) {
+				pass &= (aliasDb[autoOversample] < aliasDb[1] - minAliasDropDb) && (aliasDb[4] <= aliasDb[2] + 1.0f);
+			}
+		}
+	}
+
+	calib.cfg.pitchBase = oldPitchBase;
+	wavetable.oversampleMode = oldOversampleMode;
+	return pass;
+}
+
+
+bool HostTests::Emulator()
+{
+	// Check the flash emulator's NOR semantics through WriteData, then that a drive written through FatTools survives closing
+	// and remounting the image file
+	constexpr uint32_t block = 16 * BlockDevice::eraseSize;
+	FlashEmulator flash(0, 0);
+	if (!flash.Open("test.img")) {
+		return false;
+	}
+	uint32_t data[BlockDevice::pageSize / 4];
+	auto mappedEquals = [&](const uint32_t address, const uint32_t words) {
+		return memcmp(flash.ReadMapped(address), data, words * 4) == 0;
+	};
+	uint32_t failures = 0;
+	auto check = [&](const char* name, const bool ok) {
+		printf("%-40s %s\r\n", name, ok ? "ok" : "FAILED");
+		failures += ok ? 0 : 1;
+	};
+
+	// Erase the block so earlier runs of the test do not affect the counts
+	flash.EraseBlock(block);
+	flash.blocksErased = 0;
+
+	for (uint32_t i = 0; i < 16; ++i) {
+		data[i] = 0x12345678 + i;
+	}
+	check("Program erased flash without erase", flash.WriteData(block, data, 16) && flash.blocksErased == 0 &&
+		flash.pagesProgrammed == 1 && mappedEquals(block, 16));
+
+	const uint32_t programmed = flash.pagesProgrammed;
+	check("Unchanged data not written", !flash.WriteData(block, data, 16) && flash.pagesProgrammed == programmed);
+
+	data[0] &= 0x0000FFFF;
+	check("Clearing bits does not erase", flash.WriteData(block, data, 16) && flash.blocksErased == 0 && mappedEquals(block, 16));
+
+	data[0] = 0xFFFF0000;									// Sets bits cleared above: rest of block is erased
+	check("Setting bits erases block", flash.WriteData(block, data, 1) && flash.blocksErased == 1 && mappedEquals(block, 1) &&
+		*(const uint32_t*)flash.ReadMapped(block + 4) == 0xFFFFFFFF);
+
+	for (uint32_t i = 0; i < 16; ++i) {
+		data[i] = 0xA5A50000 + i;
+	}
+	const uint32_t straddle = block + BlockDevice::pageSize - 32;	// 8 words in each page
+	const uint32_t pagesBefore = flash.pagesProgrammed;
+	check("Write across page boundary split", flash.WriteData(straddle, data, 16) && flash.pagesProgrammed == pagesBefore + 2 &&
+		mappedEquals(straddle, 16));
+
+	const uint32_t violationsBefore = flash.violations;
+	const uint32_t page = block + 2 * BlockDevice::pageSize;
+	flash.ProgramPage(page + BlockDevice::pageSize - 8, data, 4);	// Last two words wrap to the page start
+	check("Program crossing page wraps", flash.violations == violationsBefore + 1 &&
+		memcmp(flash.ReadMapped(page), data + 2, 8) == 0 && *(const uint32_t*)flash.ReadMapped(page + BlockDevice::pageSize) == 0xFFFFFFFF);
+	flash.Close();
+
+	// FatTools round trip through the image file
+	{
+		HostDrive drive;
+		const std::vector<float> samples = WriteWav("TRIP.WAV", 8, defaultFrameSize, SampleType::PCM16);
+		if (samples.empty() || !drive.Create("test.img") || !drive.MakeDir("TRIP") || !drive.CopyIn("TRIP.WAV", "TRIP/TRIP.WAV")) {
+			return false;
+		}
+		drive.Close();
+		check("No violations writing drive", drive.flash.violations == 0);
+	}
+	HostDrive drive;
+	if (!drive.Open("test.img")) {
+		return false;
+	}
+	FILE* original = fopen("TRIP.WAV", "rb");
+	FILE* copy = drive.CopyOut("TRIP/TRIP.WAV", "TRIPOUT.WAV") ? fopen("TRIPOUT.WAV", "rb") : nullptr;
+	bool same = (original != nullptr && copy != nullptr);
+	while (same) {
+		const int a = fgetc(original);
+		same = (a == fgetc(copy));
+		if (a == EOF) {
+			break;
+		}
+	}
+	if (original) {
+		fclose(original);
+	}
+	if (copy) {
+		fclose(copy);
+	}
+	check("File intact after remount", same && drive.flash.violations == 0);
+
+	return failures == 0;
+}
+
+
+bool HostTests::QueuedFlush()
+{
+	// With typical flash timings, queue 20 4K blocks through the flash queue as QueueFlush does (requeueing as jobs complete)
+	// while a stand in main loop polls: all blocks should be written without reading the mapping while busy. Then flush the
+	// FatTools write cache from CheckCache: the main loop keeps running and mip levels are not built until the flush completes
+	constexpr uint32_t blocks = 20;
+	constexpr uint32_t blockWords = BlockDevice::eraseSize / 4;
+	constexpr uint32_t baseAddress = 32 * 1024 * 1024;
+
+	std::mt19937 random(23);
+	std::vector<uint32_t> data(blocks * blockWords);
+	for (auto& word : data) {
+		word = random();
+	}
+
+	bool pass = true;
+	{
+		FlashEmulator flash(150, 25000);
+		if (!flash.Open("test.img")) {
+			return false;
+		}
+		const uint32_t zero = 0;
+		for (uint32_t b = 0; b < blocks; ++b) {
+			flash.ProgramPage(baseAddress + b * BlockDevice::eraseSize, &zero, 1);	// Each block then needs an erase
+		}
+		flash.pagesProgrammed = 0;
+		uint32_t queued = 0, loops = 0;
+		const auto start = std::chrono::steady_clock::now();
+		while (queued < blocks || !flash.QueueIdle()) {
+			while (queued < blocks && flash.QueueWrite(baseAddress + queued * BlockDevice::eraseSize, &data[queued * blockWords], blockWords)) {
+				++queued;
+			}
+			flash.Poll();
+			++loops;
+		}
+		const float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		const bool intact = memcmp(flash.ReadMapped(baseAddress), data.data(), data.size() * 4) == 0;
+		printf("%u blocks queued: %.1f ms, %u erases, %u programs, %u main loop passes, %u violations, data %s\r\n", blocks, ms,
+				flash.blocksErased, flash.pagesProgrammed, loops, flash.violations, intact ? "intact" : "CORRUPT");
+		pass = intact && flash.violations == 0 && flash.blocksErased == blocks && flash.pagesProgrammed == blocks * BlockDevice::eraseSize / BlockDevice::pageSize &&
+				loops > blocks;
+	}
+
+	// Queued flush of the FatTools write cache: data is written to unallocated clusters at the end of the drive
+	HostDrive drive(150, 25000);
+	if (!drive.Create("test.img") || WriteWav("MIPS.WAV", 4, defaultFrameSize, SampleType::PCM16).empty() ||
+			!drive.CopyIn("MIPS.WAV") || !drive.StartEngine("MIPS.WAV")) {
+		return false;
+	}
+	if (wavetable.mipWaveTable != wavetable.activeWaveTable) {
+		printf("Mip levels not built\r\n");
+		return false;
+	}
+	constexpr uint32_t firstSector = fatSectorCount - fatWriteCacheBlocks * fatEraseSectors * 2;
+	for (uint32_t b = 0; b < fatWriteCacheBlocks; ++b) {
+		fatTools.Write((const uint8_t*)&data[b * blockWords], firstSector + b * fatEraseSectors, fatEraseSectors);
+	}
+
+	uint32_t loops = 0;
+	bool mipsDeferred = false;
+	while (!fatTools.flushQueued) {							// Flush starts 500 ms after the last write
+		fatTools.CheckCache();
+	}
+	while (fatTools.Busy() || !drive.flash.QueueIdle()) {
+		drive.flash.Poll();
+		fatTools.CheckCache();
+		if (loops++ == 0) {
+			wavetable.mipRequest = WaveTable::noMipMap;		// Request the mip levels again while the flush is in progress
+			wavetable.UpdateMipMaps();
+			mipsDeferred = (wavetable.mipWaveTable == WaveTable::noMipMap && wavetable.mipRequest == WaveTable::noMipMap);
+		}
+	}
+	wavetable.UpdateMipMaps();
+	const bool intact = memcmp(drive.flash.ReadMapped(firstSector * fatSectorSize), data.data(), fatWriteCacheBlocks * BlockDevice::eraseSize) == 0;
+	printf("Write cache flush: %u blocks in %u ms, %u main loop passes, mip levels %s, data %s, %u violations\r\n",
+			fatTools.flushBlocks, fatTools.lastFlushTime, loops, mipsDeferred ? "deferred" : "NOT DEFERRED", intact ? "intact" : "CORRUPT",
+			drive.flash.violations);
+	pass &= intact && mipsDeferred && wavetable.mipWaveTable == wavetable.activeWaveTable && fatTools.flushBlocks == fatWriteCacheBlocks &&
+			loops > fatWriteCacheBlocks && drive.flash.violations == 0;
+	return pass;
+}
+
+
+
+bool HostTests::FlushPause()
+{
+	// Longest queued flush with typical flash timings: every header cache block and every write cache block is rewritten (the flash
+	// under the header cache is inverted, so every block that is not blank needs an erase, and the data blocks are cleared). The MSC
+	// endpoint is paused and CDC commands wait for the whole flush, which must finish within FatTools::maxFlushMicros (10% allowed)
+	constexpr uint32_t blockWords = BlockDevice::eraseSize / 4;
+	constexpr uint32_t headerBytes = fatCacheSectors * fatSectorSize;
+	constexpr uint32_t firstSector = fatSectorCount - fatWriteCacheBlocks * fatEraseSectors * 2;
+
+	HostDrive drive(BlockDevice::typicalProgramMicros, BlockDevice::typicalEraseMicros);
+	if (!drive.Create("test.img") || !drive.StartEngine()) {
+		return false;
+	}
+
+	std::mt19937 random(29);
+	std::vector<uint32_t> data(fatWriteCacheBlocks * blockWords);
+	for (auto& word : data) {
+		word = random();
+	}
+	std::vector<uint8_t> header(headerBytes);
+	fatTools.Read(header.data(), 0, fatCacheSectors);
+	std::vector<uint32_t> inverted(headerBytes / 4);
+	memcpy(inverted.data(), header.data(), headerBytes);
+	for (uint32_t b = 0; b < headerBytes / BlockDevice::eraseSize; ++b) {
+		for (uint32_t w = 0; w < blockWords; ++w) {
+			inverted[b * blockWords + w] = ~inverted[b * blockWords + w];
+		}
+		drive.flash.WriteData(b * BlockDevice::eraseSize, &inverted[b * blockWords], blockWords);
+	}
+	const std::vector<uint32_t> zeros(blockWords);
+	for (uint32_t b = 0; b < fatWriteCacheBlocks; ++b) {
+		drive.flash.WriteData(firstSector * fatSectorSize + b * BlockDevice::eraseSize, zeros.data(), blockWords);
+	}
+	const uint32_t erased = drive.flash.blocksErased;
+	for (uint32_t sector = 0; sector < fatCacheSectors; sector += fatEraseSectors) {
+		fatTools.Write(&header[sector * fatSectorSize], sector, fatEraseSectors);
+	}
+	for (uint32_t b = 0; b < fatWriteCacheBlocks; ++b) {
+		fatTools.Write((const uint8_t*)&data[b * blockWords], firstSector + b * fatEraseSectors, fatEraseSectors);
+	}
+
+	while (!fatTools.flushQueued) {							// Flush starts 500 ms after the last write
+		fatTools.CheckCache();
+	}
+	const auto start = std::chrono::steady_clock::now();
+	while (fatTools.flushQueued) {
+		drive.flash.Poll();
+		fatTools.CheckCache();
+	}
+	const float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	drive.WaitIdle();
+
+	const bool intact = memcmp(drive.flash.ReadMapped(0), header.data(), headerBytes) == 0 &&
+			memcmp(drive.flash.ReadMapped(firstSector * fatSectorSize), data.data(), data.size() * 4) == 0;
+	const float maxMs = FatTools::maxFlushMicros / 1000.0f;
+	printf("Flush of %u blocks: MSC paused %.1f ms (limit %.1f ms), %u erases, data %s, %u violations\r\n",
+			fatTools.flushBlocks, ms, maxMs, drive.flash.blocksErased - erased, intact ? "intact" : "CORRUPT", drive.flash.violations);
+	return intact && fatTools.flushBlocks == FatTools::maxFlushBlocks && ms <= maxMs * 1.1f && drive.flash.violations == 0;
+}
+
+
+bool HostTests::SuspendRead()
+{
+	// Rewrite write cache blocks with a queued flush using typical flash timings while an audio stand in reads the flash mapping
+	// once per block period through AcquireRead(): reads should suspend the erase or program in progress, none should read the
+	// mapping while the device is busy, and the flush should still complete with the new data
+	constexpr uint32_t rewrites = 4;
+	constexpr uint32_t blockWords = BlockDevice::eraseSize / 4;
+	constexpr uint32_t firstSector = fatSectorCount - fatWriteCacheBlocks * fatEraseSectors * 2;
+	constexpr auto blockPeriod = std::chrono::microseconds(1000000 * audioBlockSize / sampleRate);
+
+	HostDrive drive(150, 25000);
+	if (!drive.Create("test.img")) {
+		return false;
+	}
+	std::mt19937 random(24);
+	std::vector<uint32_t> data(rewrites * blockWords);
+	for (uint32_t pass = 0; pass < 2; ++pass) {				// First pass is written synchronously so the rewrite must erase
+		for (auto& word : data) {
+			word = random();
+		}
+		for (uint32_t b = 0; b < rewrites; ++b) {
+			fatTools.Write((const uint8_t*)&data[b * blockWords], firstSector + b * fatEraseSectors, fatEraseSectors);
+		}
+		if (pass == 0) {
+			drive.Flush();
+		}
+	}
+
+	const uint32_t oldErased = drive.flash.blocksErased;
+	while (!fatTools.flushQueued) {							// Flush starts 500 ms after the last write
+		fatTools.CheckCache();
+	}
+	uint32_t reads = 0, served = 0;
+	const auto start = std::chrono::steady_clock::now();
+	auto nextBlock = start;
+	while (fatTools.Busy() || !drive.flash.QueueIdle()) {
+		drive.flash.Poll();
+		fatTools.CheckCache();
+		if (std::chrono::steady_clock::now() >= nextBlock) {
+			nextBlock += blockPeriod;
+			++reads;
+			if (fatTools.AcquireRead()) {
+				drive.flash.ReadMapped(0);					// Emulator counts a violation if the mapping is unreadable
+				fatTools.ReleaseRead();
+				++served;
+			}
+		}
+	}
+	const float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	const bool intact = memcmp(drive.flash.ReadMapped(firstSector * fatSectorSize), data.data(), data.size() * 4) == 0;
+	printf("%u blocks rewritten in %.1f ms with %u erases: %u of %u reads served by suspending a write (%u refused), "
+			"%u violations, data %s\r\n", rewrites, ms, drive.flash.blocksErased - oldErased, served, reads, drive.flash.suspendRefused,
+			drive.flash.violations, intact ? "intact" : "CORRUPT");
+	return intact && drive.flash.blocksErased - oldErased == rewrites && served == drive.flash.suspendCount && served > 0 &&
+			drive.flash.violations == 0;
+}
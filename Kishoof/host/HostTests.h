@@ -0,0 +1,47 @@
+#pragma once
+
+#include "initialisation.h"
+#include <vector>
+#include <complex>
+
+/* Host tests of the engine, file system and flash code: each test prints its measurements and returns false on failure.
+Run all with 'kishoof-host test' (or 'make test'), or a single test by name.
+*/
+
+class HostTests {
+public:
+	bool Run(const char* name);							// Runs all tests if name is null
+
+private:
+	struct Test {
+		const char* name;
+		bool (HostTests::*run)();
+	};
+	static const Test tests[];
+
+	bool MipAliasing();
+	bool Fragmented();
+	bool CacheLoad();
+	bool Filter2D();
+	bool Tiers();
+	bool PitchTracking();
+	bool FastMath();
+	bool Polyphase();
+	bool PolyphaseQ15();
+	bool Additive();
+	bool FloatFrames();
+	bool Oversampling();
+	bool WriteCache();
+	bool WriteSpeed();
+	bool MSCWrite();
+	bool IndexSave();
+	bool Emulator();
+	bool QueuedFlush();
+	bool FlushPause();
+	bool SuspendRead();
+
+	ADCValues controls;
+	void RenderChannelA(float* out, const uint32_t samples, const float pitchInc, const float posA, const uint16_t warpTypePot = 0, const uint16_t warpAmtPot = 0);
+	static float AmplitudeAt(const float* samples, const uint32_t count, const float freq);
+	static std::vector<float> WriteWav(const char* path, const uint32_t frames, const uint32_t frameSize, const SampleType type);
+};
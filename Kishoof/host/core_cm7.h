@@ -0,0 +1,13 @@
+#pragma once
+
+// Host builds have no Cortex-M7 caches: compile the cache maintenance functions out (they store pointers in 32 bit registers)
+#undef __ICACHE_PRESENT
+#define __ICACHE_PRESENT 0U
+#undef __DCACHE_PRESENT
+#define __DCACHE_PRESENT 0U
+
+// NVIC vector table accessors cast the 32 bit VTOR register to a pointer: unused on the host
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
+#include_next "core_cm7.h"
+#pragma GCC diagnostic pop
@@ -0,0 +1,167 @@
+#include "BlockDevice.h"
+
+static bool DataChanged(const uint32_t* mapped, const uint32_t* data, const uint32_t words, bool& eraseRequired)
+{
+	// Returns true if the data differs from the flash contents, setting eraseRequired if any bits that need to be set are zero
+	bool dataChanged = false;
+	eraseRequired = false;
+	for (uint32_t i = 0; i < words; ++i) {
+		if (mapped[i] != data[i]) {
+			dataChanged = true;
+			if ((mapped[i] & data[i]) != data[i]) {			// 'And' tests if any bits that need to be set are currently zero - ie needing an erase
+				eraseRequired = true;
+				break;
+			}
+		}
+	}
+	return dataChanged;
+}
+
+
+static uint32_t PageWords(const uint32_t address, const uint32_t remainingWords)
+{
+	// Writes are split at page boundaries
+	const uint32_t pageWords = (BlockDevice::pageSize - (address & (BlockDevice::pageSize - 1))) / 4;
+	return remainingWords < pageWords ? remainingWords : pageWords;
+}
+
+
+bool BlockDevice::WriteData(uint32_t address, const uint32_t* data, const uint32_t words)
+{
+	// Writes data aligned to word boundary, erasing the containing block first if any bits need to be set (data must not span blocks)
+	while (!QueueIdle()) {									// Queued writes must complete first
+		Poll();
+	}
+	while (Busy()) {};
+
+	bool eraseRequired;
+	if (!DataChanged((const uint32_t*)ReadMapped(address), data, words, eraseRequired)) {
+		return false;
+	}
+
+	if (eraseRequired) {
+		EraseBlock(address & ~(eraseSize - 1));
+	}
+
+	uint32_t remainingWords = words;
+	while (remainingWords > 0) {
+		const uint32_t writeWords = PageWords(address, remainingWords);
+		ProgramPage(address, data, writeWords);
+
+		data += writeWords;
+		address += writeWords * 4;
+		remainingWords -= writeWords;
+	}
+
+	while (Busy()) {};										// Device is memory mapped again once complete
+	return true;
+}
+
+
+bool BlockDevice::QueueWrite(const uint32_t address, const uint32_t* data, const uint32_t words, const WriteCallback callback)
+{
+	// Add write to queue, starting it immediately if the queue was idle
+	CompletionInterrupt(false);
+	const bool queued = (queueWrite - queueRead < queueDepth);
+	if (queued) {
+		queue[queueWrite % queueDepth] = Job {.address = address, .data = data, .words = words, .callback = callback};
+		queueWrite = queueWrite + 1;
+		if (!queueActive) {
+			queueActive = true;
+			Step();
+		}
+	}
+	CompletionInterrupt(true);
+	return queued;
+}
+
+
+void BlockDevice::OperationComplete()
+{
+	// Called by the device when a program or erase issued by the queue has finished
+	Step();
+}
+
+
+void BlockDevice::Step()
+{
+	// Issue the next program or erase of the current job, moving on to the next job when complete
+	stepping = true;
+	operation = Operation::none;
+	while (queueRead != queueWrite) {
+		const Job& job = queue[queueRead % queueDepth];
+
+		if (!jobStarted) {
+			while (Busy()) {};								// Returns device to memory mapped mode for comparison
+			bool eraseRequired;
+			jobChanged = DataChanged((const uint32_t*)ReadMapped(job.address), job.data, job.words, eraseRequired);
+			jobWords = jobChanged ? 0 : job.words;		// Unchanged data is skipped
+			jobStarted = true;
+			if (eraseRequired) {
+				EraseBlock(job.address & ~(eraseSize - 1));
+				AwaitCompletion(Operation::erase);
+				return;
+			}
+		}
+
+		if (jobWords < job.words) {
+			const uint32_t address = job.address + jobWords * 4;
+			const uint32_t writeWords = PageWords(address, job.words - jobWords);
+			ProgramPage(address, job.data + jobWords, writeWords);
+			jobWords += writeWords;
+			AwaitCompletion(Operation::program);
+			return;
+		}
+
+		// Job complete: free slot before callback so callback can queue a further write
+		const Job complete = job;
+		jobStarted = false;
+		queueRead = queueRead + 1;
+		if (complete.callback != nullptr) {
+			complete.callback(complete.address, jobChanged);
+		}
+	}
+
+	while (Busy()) {};										// Return device to memory mapped mode
+	queueActive = false;
+	stepping = false;
+}
+
+
+void BlockDevice::AwaitCompletion(const Operation op)
+{
+	operationSuspends = 0;
+	runTicks = Ticks();
+	operation = op;
+	NotifyWhenReady();
+	stepping = false;
+}
+
+
+bool BlockDevice::SuspendForRead()
+{
+	// Called from an interrupt that pre-empts the queue. Suspends the program or erase in progress if allowed by its policy
+	if (!queueActive) {
+		return true;
+	}
+	const SuspendPolicy& policy = (operation == Operation::erase) ? erasePolicy : programPolicy;
+	if (stepping || operation == Operation::none || operationSuspends >= policy.maxSuspends ||
+			Ticks() - runTicks < policy.minRunMicros * ticksPerMicro || !Suspend()) {
+		++suspendRefused;
+		return false;
+	}
+	++operationSuspends;
+	++suspendCount;
+	suspended = true;
+	return true;
+}
+
+
+void BlockDevice::ResumeAfterRead()
+{
+	if (suspended) {
+		suspended = false;
+		runTicks = Ticks();
+		Resume();
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+
+/* Interface to the NOR flash holding the file system and wavetable index.
+Contents are read through a contiguous memory mapping. Programming can only clear bits and is limited to one 256 byte page
+per operation; erasing sets all bits of a 4K block. Program and erase may complete after the call returns: while Busy()
+is true the mapping must not be read. Implemented by the OctoSPI flash driver (ExtFlash) and, for off-target builds, a
+file-backed emulator (FlashEmulator).
+
+Writes can either be made synchronously with WriteData or queued with QueueWrite. Queued writes are sequenced from the
+device's completion signal (the status match interrupt on target) so the caller is free to continue: the data must not
+change and the mapping must not be read until the job's callback has been made or the queue is idle.
+
+Interrupts that pre-empt the queue (ie audio) can read the mapping during a queued write by calling SuspendForRead(), which
+suspends the program or erase in progress. Each operation must run for a minimum time after starting or resuming before it
+can be suspended again, and can only be suspended a limited number of times, so that erases still complete.
+*/
+
+class BlockDevice {
+public:
+	static constexpr uint32_t pageSize = 256;				// Largest program operation: must not cross a page boundary
+	static constexpr uint32_t eraseSize = 4096;				// Smallest erase
+	static constexpr uint32_t queueDepth = 8;				// Maximum number of queued writes
+	static constexpr uint32_t typicalProgramMicros = 150;	// Page program
+	static constexpr uint32_t typicalEraseMicros = 25000;	// 4K erase
+	static constexpr uint32_t typicalBlockMicros = typicalEraseMicros + (eraseSize / pageSize) * typicalProgramMicros;	// Erase and program a 4K block
+
+	using WriteCallback = void (*)(const uint32_t address, const bool written);		// Called from interrupt on completion of a queued write
+
+	struct SuspendPolicy {
+		uint32_t minRunMicros;								// Time operation must run after starting or resuming before a suspend
+		uint32_t maxSuspends;								// Suspends allowed per operation: reads are then refused until it completes
+	};
+
+	virtual const uint8_t* ReadMapped(const uint32_t address) = 0;	// Memory mapped address of device contents
+	virtual void ProgramPage(const uint32_t address, const uint32_t* data, const uint32_t words) = 0;
+	virtual void EraseBlock(const uint32_t address) = 0;
+	virtual bool Busy() = 0;								// Program or erase in progress
+	virtual void Poll() {}									// Deliver completion on devices without an interrupt
+
+	bool WriteData(uint32_t address, const uint32_t* data, const uint32_t words);	// Returns false if data unchanged
+	bool QueueWrite(const uint32_t address, const uint32_t* data, const uint32_t words, const WriteCallback callback = nullptr);	// False if queue full
+	bool QueueIdle() const { return !queueActive; }
+	bool SuspendForRead();									// True if the mapping can be read: call ResumeAfterRead() when finished
+	void ResumeAfterRead();
+
+	bool flashCorrupt = false;
+	SuspendPolicy programPolicy {50, 4};					// Page program takes 150us typically
+	SuspendPolicy erasePolicy {300, 100};					// 4K erase takes 25ms typically
+	uint32_t suspendCount = 0;								// Reads served during queued writes
+	uint32_t suspendRefused = 0;							// Reads refused during queued writes
+
+protected:
+	virtual void NotifyWhenReady() = 0;						// Call OperationComplete() once the current program or erase has finished
+	virtual void CompletionInterrupt(const bool enable) {}	// Disable completion signal while queue is changed
+	virtual bool Suspend() = 0;								// Suspend program or erase awaiting completion and make mapping readable
+	virtual void Resume() = 0;								// Resume suspended operation and call OperationComplete() when finished
+	virtual uint32_t Ticks() = 0;							// Free running counter used to time suspend policy
+	void OperationComplete();
+
+	uint32_t ticksPerMicro = 1;
+
+private:
+	struct Job {
+		uint32_t address;
+		const uint32_t* data;
+		uint32_t words;
+		WriteCallback callback;
+	} queue[queueDepth];
+	volatile uint32_t queueRead = 0;						// Free running indexes into queue
+	volatile uint32_t queueWrite = 0;
+	volatile bool queueActive = false;
+	enum class Operation : uint8_t {none, program, erase};
+	volatile Operation operation = Operation::none;			// Queued operation awaiting completion
+	volatile bool stepping = false;							// Queue is issuing commands: operation cannot be suspended
+	bool suspended = false;
+	uint32_t operationSuspends = 0;
+	uint32_t runTicks = 0;									// Time operation was started or last resumed
+	bool jobStarted = false;								// Current job has been compared and its erase or first program issued
+	bool jobChanged = false;								// Current job differs from flash contents
+	uint32_t jobWords = 0;									// Words of current job programmed
+
+	void Step();
+	void AwaitCompletion(const Operation op);
+};
+
+extern BlockDevice* flashDevice;							// Device used by file system and wavetable index
@@ -0,0 +1,144 @@
+#include "Catalogue.h"
+#include <cstring>
+#include <algorithm>
+
+Catalogue __attribute__((section (".catalogue_buffer"))) catalogue;		// Not initialised at startup: cleared before first scan
+
+static_assert(sizeof(Catalogue) <= Catalogue::budget, "Catalogue exceeds memory budget");
+
+
+void Catalogue::Clear()
+{
+	pool[0] = 0;											// Offset zero holds an empty string
+	poolUsed = 1;
+	poolFull = false;
+	std::fill(buckets, buckets + poolBuckets, 0);
+}
+
+
+Catalogue::Wav Catalogue::Get(const uint32_t i) const
+{
+	return Wav {
+		.startAddr = startAddr[i],
+		.cluster = cluster[i],
+		.tableCount = tableCount[i],
+		.frameSize = (uint16_t)FrameLength(i),
+		.sampleType = Type(i),
+		.invalid = invalid[i],
+		.isDir = IsDir(i),
+		.fragmented = IsFragmented(i)
+	};
+}
+
+
+void Catalogue::Set(const uint32_t i, const Wav& wav)
+{
+	// Frame size is stored as a power of 2: other sizes are only held by invalid entries
+	const uint32_t frameBits = std::bit_width((uint32_t)wav.frameSize | 1) - 1;
+	format[i] = ((uint8_t)wav.sampleType & typeMask) | ((frameBits << frameShift) & frameMask) |
+			(wav.isDir ? isDirFlag : 0) | (wav.fragmented ? fragmentedFlag : 0);
+	startAddr[i] = wav.startAddr;
+	cluster[i] = wav.cluster;
+	tableCount[i] = wav.tableCount;
+	invalid[i] = wav.invalid;
+}
+
+
+void Catalogue::Move(const uint32_t dest, const uint32_t src, const uint32_t count)
+{
+	memmove(&startAddr[dest], &startAddr[src], count * sizeof(startAddr[0]));
+	memmove(&stamp[dest], &stamp[src], count * sizeof(stamp[0]));
+	memmove(&name[dest], &name[src], count * sizeof(name[0]));
+	memmove(&lfn[dest], &lfn[src], count * sizeof(lfn[0]));
+	memmove(&cluster[dest], &cluster[src], count * sizeof(cluster[0]));
+	memmove(&dir[dest], &dir[src], count * sizeof(dir[0]));
+	memmove(&tableCount[dest], &tableCount[src], count * sizeof(tableCount[0]));
+	memmove(&format[dest], &format[src], count * sizeof(format[0]));
+	memmove(&invalid[dest], &invalid[src], count * sizeof(invalid[0]));
+}
+
+
+void Catalogue::Sort(const uint32_t first, const uint32_t last)
+{
+	// Heap sort: sorts the arrays in place without needing a temporary index or copy of the entries
+	const uint32_t n = last - first;
+	auto siftDown = [&](uint32_t root, const uint32_t end) {
+		while (2 * root + 1 < end) {
+			uint32_t child = 2 * root + 1;
+			if (child + 1 < end && Less(first + child, first + child + 1)) {
+				++child;
+			}
+			if (!Less(first + root, first + child)) {
+				return;
+			}
+			Swap(first + root, first + child);
+			root = child;
+		}
+	};
+
+	for (uint32_t i = n / 2; i-- > 0;) {
+		siftDown(i, n);
+	}
+	for (uint32_t end = n; end-- > 1;) {
+		Swap(first, first + end);
+		siftDown(0, end);
+	}
+}
+
+
+bool Catalogue::Less(const uint32_t a, const uint32_t b) const
+{
+	if (IsDir(a) != IsDir(b)) {
+		return IsDir(a);
+	}
+	return memcmp(name[a], name[b], 8) < 0;
+}
+
+
+void Catalogue::Swap(const uint32_t a, const uint32_t b)
+{
+	std::swap(startAddr[a], startAddr[b]);
+	std::swap(stamp[a], stamp[b]);
+	std::swap(name[a], name[b]);
+	std::swap(lfn[a], lfn[b]);
+	std::swap(cluster[a], cluster[b]);
+	std::swap(dir[a], dir[b]);
+	std::swap(tableCount[a], tableCount[b]);
+	std::swap(format[a], format[b]);
+	std::swap(invalid[a], invalid[b]);
+}
+
+
+uint16_t Catalogue::Intern(const std::string_view text)
+{
+	// Names are found by following the chain for the hash of the name; new names are appended to the pool, padded to a word
+	// Names from entries since removed are only reclaimed on the next full scan. Returns the empty string if the pool is full
+	if (text.empty()) {
+		return 0;
+	}
+	uint32_t hash = 2166136261;
+	for (const char c : text) {
+		hash = (hash ^ (uint8_t)c) * 16777619;
+	}
+	uint16_t& bucket = buckets[hash % poolBuckets];
+
+	for (uint16_t offset = bucket; offset != 0; offset = *(uint16_t*)&pool[offset]) {
+		if (text == (const char*)&pool[offset] + sizeof(uint16_t)) {
+			return offset;
+		}
+	}
+
+	const uint32_t words = (sizeof(uint16_t) + text.size() + 1 + 3) / 4;
+	if (poolUsed + words > poolWords) {
+		poolFull = true;
+		return 0;
+	}
+	const uint16_t offset = poolUsed;
+	char* entry = (char*)&pool[offset];
+	*(uint16_t*)entry = bucket;
+	memcpy(entry + sizeof(uint16_t), text.data(), text.size());
+	entry[sizeof(uint16_t) + text.size()] = 0;
+	bucket = offset;
+	poolUsed += words;
+	return offset;
+}
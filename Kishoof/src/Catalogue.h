@@ -0,0 +1,87 @@
+#pragma once
+
+#include "initialisation.h"
+#include <string_view>
+#include <bit>
+
+/* Catalogue of wavetables and folders found in the file system.
+Fields are held in parallel arrays so picker navigation and sorting only touch the fields they use. Long file names are
+interned in a string pool so names shared by several entries (eg '<< Back') are stored once. Arrays and pool are carved from
+a fixed memory budget in the AHB SRAM: the arrays are sized assuming an average allowance of name bytes per entry, so the
+number of entries is limited by the budget rather than a fixed count. Header details not needed for playback are parsed
+again from the file when required.
+*/
+
+class Catalogue {
+public:
+	enum Invalid : uint8_t {OK = 0, Fragmented, HeaderCorrupt, SampleFormat, ChannelCount, EmptyFolder, Unaligned, FrameSize, End};
+	static constexpr const char* InvalidText[Invalid::End] {"OK", "Fragged", "Corrupt", "Format", "Channels", "Empty", "Unaligned", "FrameSize"};
+
+	static constexpr uint32_t budget = 128 * 1024;			// Size of AHB SRAM
+	static constexpr uint32_t nameAllowance = 12;			// Average pool bytes per entry assumed when dividing budget between arrays and pool
+	static constexpr uint32_t entryBytes = 22 + sizeof(const uint8_t*);	// Bytes per entry across all arrays (start address is 8 bytes in 64 bit host builds)
+	static constexpr uint32_t poolBuckets = 256;			// Hash chains used to find interned names
+	static constexpr uint32_t headerBytes = 8 + poolBuckets * sizeof(uint16_t);
+	static constexpr uint32_t capacity = (budget - headerBytes) / (entryBytes + nameAllowance);
+	static constexpr uint32_t poolWords = (budget - headerBytes - capacity * entryBytes) / 4;
+	static_assert(poolWords < 65536, "Pool offsets are stored as 16 bit word indexes");
+
+	struct Wav {											// Details of an entry used for playback
+		const uint8_t* startAddr;							// Address of data section
+		uint16_t cluster;									// Starting cluster
+		uint16_t tableCount;								// Number of frames in file
+		uint16_t frameSize;									// Samples per frame
+		SampleType sampleType;
+		Invalid invalid;									// Code indicating why wav is invalid
+		bool isDir;
+		bool fragmented;
+	};
+
+	void Clear();											// Empty name pool before a full scan
+	Wav Get(const uint32_t i) const;
+	void Set(const uint32_t i, const Wav& wav);
+	void Move(const uint32_t dest, const uint32_t src, const uint32_t count);	// Copy entries (ranges may overlap)
+	void Sort(const uint32_t first, const uint32_t last);	// Sort folders first followed by short file name
+	uint16_t Intern(const std::string_view text);			// Return pool offset of name, adding it if not already stored
+
+	bool IsDir(const uint32_t i) const		{ return format[i] & isDirFlag; }
+	bool IsFragmented(const uint32_t i) const	{ return format[i] & fragmentedFlag; }
+	SampleType Type(const uint32_t i) const	{ return (SampleType)(format[i] & typeMask); }
+	uint32_t FrameLength(const uint32_t i) const	{ return 1 << ((format[i] & frameMask) >> frameShift); }
+	std::string_view LongName(const uint32_t i) const	{ return (const char*)&pool[lfn[i]] + sizeof(uint16_t); }
+
+	uint32_t poolUsed;										// Words of pool in use
+	bool poolFull;											// Set if a name could not be stored
+
+	// Entry fields
+	const uint8_t* startAddr[capacity];
+	union {
+		uint32_t stamp[capacity];							// Hash of file size and write time to detect modified files
+		uint32_t dirHash[capacity];							// For directories holds hash of directory entries at last scan
+	};
+	char name[capacity][8];									// Short file name (not null terminated)
+	uint16_t lfn[capacity];									// Pool offset of long file name
+	uint16_t cluster[capacity];								// Starting cluster
+	uint16_t dir[capacity];									// Index of entry containing directory item
+	union {
+		uint16_t tableCount[capacity];						// Number of frames in file
+		uint16_t firstWav[capacity];						// For directories holds the index of the first file
+	};
+	uint8_t format[capacity];								// Sample type, log2 frame size and flags
+	Invalid invalid[capacity];
+
+private:
+	static constexpr uint8_t typeMask = 0b11;
+	static constexpr uint8_t frameShift = 2;
+	static constexpr uint8_t frameMask = 0b1111 << frameShift;
+	static constexpr uint8_t isDirFlag = 1 << 6;
+	static constexpr uint8_t fragmentedFlag = 1 << 7;
+
+	uint16_t buckets[poolBuckets];							// First pool offset in each hash chain
+	uint32_t pool[poolWords];								// Each name: 16 bit offset of next name in chain followed by null terminated string
+
+	bool Less(const uint32_t a, const uint32_t b) const;
+	void Swap(const uint32_t a, const uint32_t b);
+};
+
+extern Catalogue catalogue;
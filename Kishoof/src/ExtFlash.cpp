@@ -2,6 +2,7 @@
 #include "FatTools.h"
 
 ExtFlash extFlash;
+BlockDevice* flashDevice = &extFlash;
 
 static constexpr bool dtr = false;			// Double data rate
 
@@ -30,6 +31,11 @@ void ExtFlash::Init()
 		SetOctoMode();
 	}
 	MemoryMapped();
+
+	ticksPerMicro = SystemCoreClock / 1000000;				// Suspend policy timed with cycle counter
+	NVIC_SetPriority(OCTOSPI1_IRQn, 3);						// Lower priority than audio and USB interrupts
+	NVIC_EnableIRQ(OCTOSPI1_IRQn);
+
 	fatTools.InitFatFS();									// Initialise FatFS
 }
 
@@ -104,6 +110,13 @@ void ExtFlash::WriteEnable()
 {
 	MemMappedOff();
 	CheckBusy();
+	Instruction(writeEnable);
+}
+
+
+void ExtFlash::Instruction(const ospiRegister instruction)
+{
+	// Send instruction with no address or data
 	OCTOSPI1->TCR &= ~OCTOSPI_TCR_DCYC_Msk;					// Dummy cycles
 	OCTOSPI1->CR |= OCTOSPI_CR_EN;							// Enable QSPI
 	OCTOSPI1->CR &= ~OCTOSPI_CR_FMODE;						// *00: Indirect write mode; 01: Indirect read mode; 10: Automatic polling mode; 11: Memory-mapped mode
@@ -111,10 +124,10 @@ void ExtFlash::WriteEnable()
 		OCTOSPI1->CCR = OCTOSPI_CCR_ISIZE_0 |				// Instruction size 16 bits
 						OCTOSPI_CCR_IMODE_2 |				// 100: Eight lines
 						dtrCCR;
-		OCTOSPI1->IR = writeEnable;
+		OCTOSPI1->IR = instruction;
 	} else {
 		OCTOSPI1->CCR = OCTOSPI_CCR_IMODE_0;				// 000: None; *001: One line; 010: Two lines; 011: Four lines; 100: Eight lines
-		OCTOSPI1->IR = (writeEnable >> 8);					// Convert instruction to SPI mode
+		OCTOSPI1->IR = (instruction >> 8);					// Convert instruction to SPI mode
 	}
 	while (OCTOSPI1->SR & OCTOSPI_SR_BUSY) {};
 	OCTOSPI1->CR &= ~OCTOSPI_CR_EN;							// Disable QSPI
@@ -250,74 +263,38 @@ uint32_t ExtFlash::Read(uint32_t address)
 }
 
 
-bool ExtFlash::WriteData(uint32_t address, uint32_t* writeBuff, uint32_t words)
+const uint8_t* ExtFlash::ReadMapped(const uint32_t address)
 {
-	// Writes up to 256 bytes at a time aligned to 256 boundary
-	bool eraseRequired = false;
-	bool dataChanged = false;
-	uint32_t* memAddr = (uint32_t*)(flashAddress + address);	// address is passed relative to zero - store the memory mapped address
-
-	for (uint32_t i = 0; i < words; ++i) {
-		if (memAddr[i] != writeBuff[i]) {
-			dataChanged = true;
-			if ((memAddr[i] & writeBuff[i]) != writeBuff[i]) {	// 'And' tests if any bits that need to be set are currently zero - ie needing an erase
-				eraseRequired = true;
-				break;
-			}
-		}
-	}
-	if (!dataChanged) {										// No difference between Flash contents and write data
-		return false;
-	}
-
-	if (eraseRequired) {
-		BlockErase(address & ~(fatEraseSectors - 1));		// Force address to 4096 byte (8192 in dual flash mode) boundary
-	}
-
-	uint32_t remainingWords = words;
-
-	do {
-		WriteEnable();
-
-		// Mandated by Flash chip: Can write 256 bytes (64 words) at a time, and must be aligned to page boundaries (256 bytes)
-		constexpr uint32_t pageShift = 8;					// Will divide words into pages 256 bytes
-		const uint32_t startPage = (address >> pageShift);
-		const uint32_t endPage = (((address + (remainingWords * 4)) - 1) >> pageShift);
-
-		uint32_t writeSize = remainingWords * 4;			// Size of current write in bytes
-		if (endPage != startPage) {
-			writeSize = ((startPage + 1) << pageShift) - address;	// When crossing pages only write up to the 256 byte boundary
-		}
-
-		OCTOSPI1->DLR = writeSize - 1;						// number of bytes - 1 to transmit
-		OCTOSPI1->CR &= ~OCTOSPI_CR_FMODE;					// *00: Indirect write mode; 01: Indirect read mode; 10: Automatic polling mode; 11: Memory-mapped mode
-		OCTOSPI1->TCR &= ~OCTOSPI_TCR_DCYC_Msk;				// Dummy cycles
-		OCTOSPI1->CCR = octoCCR;
-		OCTOSPI1->IR = writePage;
-		OCTOSPI1->CR |= OCTOSPI_CR_EN;						// Enable OCTOSPI
-		OCTOSPI1->AR = address;								// Set address register
-
-		for (uint32_t i = 0; i < 64; ++i) {
-			while ((OCTOSPI1->SR & OCTOSPI_SR_FTF) == 0) {};// Wait until there is space in the FIFO
-			OCTOSPI1->DR = *writeBuff++;					// Set data register
-		}
+	// Valid once any program or erase is complete (see Busy())
+	return flashAddress + address;
+}
 
-		remainingWords -= (writeSize / 4);
-		address += writeSize;
 
-		while (OCTOSPI1->SR & OCTOSPI_SR_BUSY) {};
-		OCTOSPI1->CR &= ~OCTOSPI_CR_EN;						// Disable OCTOSPI
-	} while (remainingWords > 0);
+void ExtFlash::ProgramPage(const uint32_t address, const uint32_t* data, const uint32_t words)
+{
+	// Mandated by Flash chip: Can write 256 bytes (64 words) at a time, and must not cross page boundaries (256 bytes)
+	WriteEnable();											// Waits for any previous program or erase to complete
 
-	SCB_InvalidateDCache_by_Addr(memAddr, words * 4);		// Ensure cache is refreshed after write or erase
+	OCTOSPI1->DLR = (words * 4) - 1;						// number of bytes - 1 to transmit
+	OCTOSPI1->CR &= ~OCTOSPI_CR_FMODE;						// *00: Indirect write mode; 01: Indirect read mode; 10: Automatic polling mode; 11: Memory-mapped mode
+	OCTOSPI1->TCR &= ~OCTOSPI_TCR_DCYC_Msk;					// Dummy cycles
+	OCTOSPI1->CCR = octoCCR;
+	OCTOSPI1->IR = writePage;
+	OCTOSPI1->CR |= OCTOSPI_CR_EN;							// Enable OCTOSPI
+	OCTOSPI1->AR = address;									// Set address register
 
-	MemoryMapped();											// Switch back to memory mapped mode
+	for (uint32_t i = 0; i < words; ++i) {
+		while ((OCTOSPI1->SR & OCTOSPI_SR_FTF) == 0) {};	// Wait until there is space in the FIFO
+		OCTOSPI1->DR = data[i];								// Set data register
+	}
 
-	return true;
+	while (OCTOSPI1->SR & OCTOSPI_SR_BUSY) {};
+	OCTOSPI1->CR &= ~OCTOSPI_CR_EN;							// Disable OCTOSPI
+	MarkChanged(address, words * 4);
 }
 
 
-void ExtFlash::BlockErase(const uint32_t address)
+void ExtFlash::EraseBlock(const uint32_t address)
 {
 	// Erase a 4k sector (ie a FAT block) NB a 'Block' for the Flash is 64K
 	WriteEnable();
@@ -337,6 +314,101 @@ void ExtFlash::BlockErase(const uint32_t address)
 	while ((OCTOSPI1->SR & OCTOSPI_SR_TCF) == 0) {};		// Wait until transfer complete
 	while (OCTOSPI1->SR & OCTOSPI_SR_BUSY) {};
 	OCTOSPI1->CR &= ~OCTOSPI_CR_EN;							// Disable OCTOSPI
+	MarkChanged(address & ~(eraseSize - 1), eraseSize);
+}
+
+
+bool ExtFlash::Busy()
+{
+	// Poll status register after a program or erase; once complete invalidate changed data from cache and return to memory mapped mode
+	if (memMapMode) {
+		return false;
+	}
+	if (ReadStatusReg() & writeInProgress) {
+		return true;
+	}
+	if (changedEnd > changedStart) {
+		SCB_InvalidateDCache_by_Addr(flashAddress + changedStart, changedEnd - changedStart);
+		changedStart = UINT32_MAX;
+		changedEnd = 0;
+	}
+	MemoryMapped();
+	return false;
+}
+
+
+void ExtFlash::NotifyWhenReady()
+{
+	// Automatic polling of the status register with an interrupt on match, rather than waiting as in CheckBusy()
+	OCTOSPI1->CR &= ~OCTOSPI_CR_EN;							// Disable
+	OCTOSPI1->DLR = 1;										// Return 2 bytes
+	OCTOSPI1->PSMKR = 0x01;									// Mask on bit 1 (Busy)
+	OCTOSPI1->PSMAR = 0b00000000;							// Match Busy = 0
+	OCTOSPI1->PIR = 0x10;									// Polling interval in clock cycles
+	OCTOSPI1->CR |= OCTOSPI_CR_APMS | OCTOSPI_CR_SMIE;		// Auto-stop on match and enable status match interrupt
+	OCTOSPI1->CR = (OCTOSPI1->CR & ~OCTOSPI_CR_FMODE) |
+					OCTOSPI_CR_FMODE_1;						// 10: Automatic polling mode
+
+	OCTOSPI1->TCR = (OCTOSPI1->TCR & ~OCTOSPI_TCR_DCYC_Msk) | (4 << OCTOSPI_TCR_DCYC_Pos);	// Set number of dummy cycles
+	OCTOSPI1->CCR = octoCCR;
+	OCTOSPI1->IR = readStatusReg;
+	OCTOSPI1->CR |= OCTOSPI_CR_EN;							// Enable OCTOSPI
+	OCTOSPI1->AR = 0;										// Set address register to start polling
+}
+
+
+void ExtFlash::StatusMatch()
+{
+	if (OCTOSPI1->SR & OCTOSPI_SR_SMF) {
+		OCTOSPI1->FCR = OCTOSPI_FCR_CSMF;					// Acknowledge status match flag
+		OCTOSPI1->CR &= ~(OCTOSPI_CR_EN | OCTOSPI_CR_SMIE | OCTOSPI_CR_FMODE);	// Disable and return to indirect write mode
+		OCTOSPI1->TCR &= ~OCTOSPI_TCR_DCYC_Msk;				// Clear number of dummy cycles
+		OperationComplete();
+	}
+}
+
+
+bool ExtFlash::Suspend()
+{
+	// Only while automatically polling for a queued operation with no completion pending (otherwise commands are being issued)
+	if ((OCTOSPI1->CR & (OCTOSPI_CR_FMODE | OCTOSPI_CR_SMIE)) != (OCTOSPI_CR_FMODE_1 | OCTOSPI_CR_SMIE) || (OCTOSPI1->SR & OCTOSPI_SR_SMF)) {
+		return false;
+	}
+	OCTOSPI1->CR |= OCTOSPI_CR_ABORT;						// Stop automatic polling
+	while (OCTOSPI1->CR & OCTOSPI_CR_ABORT) {};
+	OCTOSPI1->CR &= ~(OCTOSPI_CR_EN | OCTOSPI_CR_SMIE | OCTOSPI_CR_FMODE);
+	OCTOSPI1->TCR &= ~OCTOSPI_TCR_DCYC_Msk;
+	OCTOSPI1->FCR = OCTOSPI_FCR_CSMF | OCTOSPI_FCR_CTCF;
+
+	Instruction(writeSuspend);
+	MemoryMapped();											// Waits for busy flag to clear once suspended (20us maximum)
+	return true;
+}
+
+
+void ExtFlash::Resume()
+{
+	// Polling is restarted to signal completion: a completion cleared by Suspend() is signalled immediately
+	MemMappedOff();
+	Instruction(writeResume);
+	NotifyWhenReady();
+}
+
+
+void ExtFlash::CompletionInterrupt(const bool enable)
+{
+	if (enable) {
+		NVIC_EnableIRQ(OCTOSPI1_IRQn);
+	} else {
+		NVIC_DisableIRQ(OCTOSPI1_IRQn);
+	}
+}
+
+
+void ExtFlash::MarkChanged(const uint32_t address, const uint32_t bytes)
+{
+	changedStart = std::min(changedStart, address);
+	changedEnd = std::max(changedEnd, address + bytes);
 }
 
 
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cmath>
+#include <array>
+#include <bit>
+#include <cstdint>
+
+/* Fast exp2 and log2 approximations used in the audio path in place of std::pow and std::log2.
+Both split the argument into an integer octave (applied to or taken from the float exponent) and a fractional
+octave, looked up in a 256 entry table and linearly interpolated. Over the pitch ADC range with the default and
+current calibration values ('kishoof-host test fastmath') FastExp2 is within 0.002 cents, well inside the 0.1 cent
+V/Oct budget; FastLog2 is within 3e-6 octaves and selects the same filter LUT position as std::log2.
+*/
+
+static constexpr uint32_t fastMathLUTSize = 256;
+
+constexpr auto CreateExp2LUT()							// constexpr function to generate LUT in Flash
+{
+	std::array<float, fastMathLUTSize + 1> array {};	// Create one extra entry to simplify interpolation
+	for (uint32_t i = 0; i < fastMathLUTSize + 1; ++i) {
+		array[i] = std::exp2((double)i / fastMathLUTSize);
+	}
+	return array;
+}
+
+constexpr auto CreateLog2LUT()
+{
+	std::array<float, fastMathLUTSize + 1> array {};
+	for (uint32_t i = 0; i < fastMathLUTSize + 1; ++i) {
+		array[i] = std::log2(1.0 + (double)i / fastMathLUTSize);
+	}
+	return array;
+}
+
+inline constexpr std::array<float, fastMathLUTSize + 1> exp2LUT = CreateExp2LUT();
+inline constexpr std::array<float, fastMathLUTSize + 1> log2LUT = CreateLog2LUT();
+
+
+static inline float FastExp2(const float x)
+{
+	// Valid for x from -126 to 127: fractional part is looked up and the integer part added to the exponent of the result
+	const float octave = std::floor(x);
+	const float pos = (x - octave) * fastMathLUTSize;
+	const uint32_t index = (uint32_t)pos;
+	const float mantissa = exp2LUT[index] + (pos - index) * (exp2LUT[index + 1] - exp2LUT[index]);
+	return std::bit_cast<float>(std::bit_cast<int32_t>(mantissa) + ((int32_t)octave << 23));
+}
+
+
+static inline float FastLog2(const float x)
+{
+	// Returns log2(|x|): exponent gives the integer part, top 8 bits of the mantissa index the table and the remaining 15 bits interpolate
+	const uint32_t bits = std::bit_cast<uint32_t>(x) & 0x7FFFFFFF;
+	const int32_t octave = (int32_t)(bits >> 23) - 127;
+	const uint32_t index = (bits >> 15) & 0xFF;
+	const float ratio = (bits & 0x7FFF) * (1.0f / 32768.0f);
+	return octave + log2LUT[index] + ratio * (log2LUT[index + 1] - log2LUT[index]);
+}
@@ -1,5 +1,5 @@
 #include "FatTools.h"
-#include "usb.h"
+#include "USB.h"
 #include "WaveTable.h"
 #include <cstring>
 
@@ -7,12 +7,12 @@ FatTools fatTools;
 
 bool FatTools::InitFatFS()
 {
-	if (extFlash.flashCorrupt || SafeMode) {
+	if (flashDevice->flashCorrupt || SafeMode) {
 		return false;
 	}
 
 	// Set up cache area for header data
-	memcpy(headerCache, flashAddress, fatSectorSize * fatCacheSectors);
+	memcpy(headerCache, flashDevice->ReadMapped(0), fatSectorSize * fatCacheSectors);
 
 	const FRESULT res = f_mount(&fatFs, fatPath, 1) ;		// Register the file system object to the FatFs module
 	if (res == FR_NO_FILESYSTEM) {
@@ -37,7 +37,7 @@ bool FatTools::Format()
 	// If in safe mode, copy the header data into the cache so the cached writes work correctly
 	if (SafeMode) {
 		printf("Creating header cache ...\r\n");
-		memcpy(headerCache, flashAddress, fatSectorSize * fatCacheSectors);
+		memcpy(headerCache, flashDevice->ReadMapped(0), fatSectorSize * fatCacheSectors);
 	}
 
 	printf("Mounting File System ...\r\n");
@@ -71,50 +71,106 @@ bool FatTools::Format()
 
 void FatTools::Read(uint8_t* buffer, const uint32_t readSector, const uint32_t sectorCount)
 {
-	// Used by diskio to copy flash data into buffer
-	const uint8_t* readAddress;
+	// Used by diskio to copy data into buffer: header sectors are read from the header cache, sectors written since the last
+	// flush from the write cache, otherwise from flash
 	if (readSector < fatCacheSectors) {
-		readAddress = &(headerCache[readSector * fatSectorSize]);	// If reading header data return from cache
-	} else {
-		readAddress = flashAddress + (readSector * fatSectorSize);
+		memcpy(buffer, &(headerCache[readSector * fatSectorSize]), fatSectorSize * sectorCount);
+		return;
+	}
+	for (uint32_t sector = readSector; sector < readSector + sectorCount; ++sector) {
+		const uint8_t* cached = WriteCacheSector(sector);
+		memcpy(buffer, cached ? cached : flashDevice->ReadMapped(sector * fatSectorSize), fatSectorSize);
+		buffer += fatSectorSize;
 	}
-
-	memcpy(buffer, readAddress, fatSectorSize * sectorCount);
 }
 
 
-void FatTools::Write(const uint8_t* readBuff, const uint32_t writeSector, const uint32_t sectorCount)
+bool FatTools::Write(const uint8_t* readBuff, const uint32_t writeSector, const uint32_t sectorCount, const bool canEvict)
 {
+	// Returns false without writing if the caches are being flushed from the flash queue, or if a block would have to be evicted
+	// and canEvict is not set: evictions are synchronous flash writes so must not be made from the USB interrupt, which would
+	// otherwise wait on a queue that only advances at the lower priority of the flash interrupt
+	if (flushQueued || (!canEvict && writeSector >= fatCacheSectors && !WriteCacheFree(writeSector, sectorCount))) {
+		++writesDeferred;
+		return false;
+	}
+
 	writingWait = SysTickVal + writingWaitSet;
 	if (writeSector < fatCacheSectors) {
 		// Update the bit array of dirty blocks [There are 8 x 512 = 4096 byte sectors in a block]
-		dirtyCacheBlocks |= (1 << (writeSector / fatEraseSectors));
+		for (uint32_t block = writeSector / fatEraseSectors; block <= (writeSector + sectorCount - 1) / fatEraseSectors; ++block) {
+			dirtyCacheBlocks |= (1 << block);
+		}
 
 		uint8_t* writeAddress = &(headerCache[writeSector * fatSectorSize]);
 		memcpy(writeAddress, readBuff, fatSectorSize * sectorCount);
 	} else {
-		// Check which block is being written to
-		const int32_t block = writeSector / fatEraseSectors;
-		if (block != writeBlock) {
-			if (writeBlock > 0) {					// Write previously cached block to flash
-				FlushCache();
+		for (uint32_t sector = writeSector; sector < writeSector + sectorCount; ++sector) {
+			// Check if block being written to is in the write cache, otherwise use a free or the least recently used block
+			const int32_t block = sector / fatEraseSectors;
+			WriteCacheBlock* wcb = nullptr;
+			for (auto& c : writeCache) {
+				if (c.block == block) {
+					wcb = &c;
+					break;
+				}
 			}
 
-			// Load cache with current flash values
-			writeBlock = block;
-			const uint8_t* readAddress = flashAddress + (block * fatEraseSectors * fatSectorSize);
-			writeBusy = true;
-			memcpy(writeBlockCache, readAddress, fatEraseSectors * fatSectorSize);
-			writeBusy = false;
-		}
+			if (wcb == nullptr) {
+				wcb = &writeCache[0];
+				for (auto& c : writeCache) {
+					if (c.dirtySectors == 0) {
+						wcb = &c;
+						break;
+					}
+					if (c.lastUsed < wcb->lastUsed) {
+						wcb = &c;
+					}
+				}
 
-		// write cache is now valid - copy newly changed values into it
-		const uint32_t byteOffset = (writeSector - (block * fatEraseSectors)) * fatSectorSize;		// Offset within currently block
-		memcpy(&(writeBlockCache[byteOffset]), readBuff, fatSectorSize * sectorCount);
-		writeCacheDirty = true;
+				if (wcb->dirtySectors) {				// Write least recently used block to flash
+					flushCacheBusy = true;
+					while (!flashDevice->QueueIdle()) {	// Flash can only be read once queued writes have finished
+						flashDevice->Poll();
+					}
+					FillWriteCacheBlock(*wcb);
+					flashDevice->WriteData(wcb->block * fatEraseSectors * fatSectorSize, (uint32_t*)wcb->data, (fatEraseSectors * fatSectorSize) / 4);
+					flushCacheBusy = false;
+					++writeCacheEvictions;
+				}
+				wcb->block = block;
+				wcb->dirtySectors = 0;
+			}
+
+			// Sectors not written to are filled from flash when the block is written back
+			const uint32_t blockSector = sector - (block * fatEraseSectors);
+			memcpy(&(wcb->data[blockSector * fatSectorSize]), readBuff, fatSectorSize);
+			wcb->dirtySectors |= (1 << blockSector);
+			wcb->lastUsed = ++writeCount;
+			readBuff += fatSectorSize;
+		}
 	}
 
 	cacheUpdated = SysTickVal;
+	return true;
+}
+
+
+bool FatTools::WriteCacheFree(const uint32_t writeSector, const uint32_t sectorCount)
+{
+	// Returns true if the blocks written to are in the write cache or can use clean cache blocks without evicting a dirty block
+	const int32_t firstBlock = writeSector / fatEraseSectors;
+	const int32_t lastBlock = (writeSector + sectorCount - 1) / fatEraseSectors;
+	uint32_t newBlocks = lastBlock - firstBlock + 1;
+	uint32_t cleanBlocks = 0;
+	for (auto& wcb : writeCache) {
+		if (wcb.block >= firstBlock && wcb.block <= lastBlock) {
+			--newBlocks;
+		} else if (wcb.dirtySectors == 0) {
+			++cleanBlocks;
+		}
+	}
+	return newBlocks <= cleanBlocks;
 }
 
 
@@ -122,11 +178,19 @@ void FatTools::CheckCache()
 {
 	// If dirty buffers and sufficient time has elapsed since cache updated flush the cache to Flash
 	// Also added check on read blocks as there seems to be some interference between flushing the cache and USB MSC reads
-	if ((dirtyCacheBlocks || writeCacheDirty) && cacheUpdated > 0 && ((int32_t)SysTickVal - (int32_t)cacheUpdated) > 500  && (readWait <= SysTickVal))	{
+	if (flushQueued) {
+		QueueFlush();							// Queue any blocks that did not fit in the flash queue
+		if (!dirtyCacheBlocks && !WriteCacheDirty() && flashDevice->QueueIdle()) {
+			flushQueued = false;
+			lastFlushTime = SysTickVal - flushStart;
+			usb.ResumeEndpoint(usb.msc);
+		}
+
+	} else if (!indexQueued && (dirtyCacheBlocks || WriteCacheDirty()) && cacheUpdated > 0 && ((int32_t)SysTickVal - (int32_t)cacheUpdated) > 500  && (readWait <= SysTickVal))	{
 
 		// Windows will access index information setting the last accessed time stamp - if this is the only write do not save
 		// A write may set blocks 0, 9, 10, 11: ClnShutBitMask, 'System Volume Information' dir, 'IndexerVolume' file,  'WPSettings.dat' file
-		if (!writeCacheDirty && (dirtyCacheBlocks & ~0b1110'0000'0001) == 0) {
+		if (!WriteCacheDirty() && (dirtyCacheBlocks & ~0b1110'0000'0001) == 0) {
 			cacheUpdated = 0;
 			return;
 		}
@@ -135,10 +199,20 @@ void FatTools::CheckCache()
 			updateWavetables = true;			// Will trigger a wavetable update when writes have finished
 		}
 
+		// Blocks are written from the flash interrupt so the main loop continues; caches must not change until the flush completes.
+		// Unlike audio, MSC reads are not served by suspending the write: the endpoint stays paused until the flush has finished
+		// (at most maxFlushMicros with typical flash times)
 		usb.PauseEndpoint(usb.msc);				// Sends NAKs from the msc endpoint whilst the Flash device is unavailable
-		FlushCache();
-		usb.ResumeEndpoint(usb.msc);
+		flushQueued = true;
+		flushStart = SysTickVal;
+		flushBlocks = 0;
 		cacheUpdated = 0;
+		for (auto& wcb : writeCache) {			// Flash can only be read before the first block is queued
+			if (wcb.dirtySectors) {
+				FillWriteCacheBlock(wcb);
+			}
+		}
+		QueueFlush();
 	}
 
 	if (!Busy() && updateWavetables) {
@@ -150,6 +224,93 @@ void FatTools::CheckCache()
 }
 
 
+bool FatTools::AcquireRead()
+{
+	// Called from audio interrupt before reading flash: during a queued flush the program or erase in progress is suspended if
+	// permitted by the flash suspend policy. Synchronous writes and wavetable list updates block reads
+	if (flushCacheBusy) {
+		return false;
+	}
+	return flashDevice->SuspendForRead();
+}
+
+
+void FatTools::ReleaseRead()
+{
+	flashDevice->ResumeAfterRead();
+}
+
+
+void FatTools::QueueFlush()
+{
+	// Queue dirty header cache blocks then write cache blocks (which must already be filled) in address order: blocks that do
+	// not fit in the queue are left dirty for the next call
+	constexpr uint32_t blockWords = (fatEraseSectors * fatSectorSize) / 4;
+	for (uint32_t blockPos = 0; dirtyCacheBlocks != 0; ++blockPos) {
+		if (dirtyCacheBlocks & (1 << blockPos)) {
+			const uint32_t byteOffset = blockPos * fatEraseSectors * fatSectorSize;
+			if (!flashDevice->QueueWrite(byteOffset, (uint32_t*)&(headerCache[byteOffset]), blockWords, FlushComplete)) {
+				return;
+			}
+			dirtyCacheBlocks &= ~(1 << blockPos);
+		}
+	}
+
+	while (WriteCacheBlock* wcb = NextWriteBackBlock()) {
+		if (!flashDevice->QueueWrite(wcb->block * fatEraseSectors * fatSectorSize, (uint32_t*)wcb->data, blockWords, FlushComplete)) {
+			return;
+		}
+		wcb->dirtySectors = 0;
+	}
+}
+
+
+FatTools::WriteCacheBlock* FatTools::NextWriteBackBlock()
+{
+	// Returns the dirty write cache block with the lowest address so blocks are written in order
+	WriteCacheBlock* next = nullptr;
+	for (auto& wcb : writeCache) {
+		if (wcb.dirtySectors && (next == nullptr || wcb.block < next->block)) {
+			next = &wcb;
+		}
+	}
+	return next;
+}
+
+
+void FatTools::FillWriteCacheBlock(WriteCacheBlock& wcb)
+{
+	// Copy sectors that have not been written to from flash so the whole block can be written back
+	const uint8_t* flashBlock = flashDevice->ReadMapped(wcb.block * fatEraseSectors * fatSectorSize);
+	for (uint32_t sector = 0; sector < fatEraseSectors; ++sector) {
+		if ((wcb.dirtySectors & (1 << sector)) == 0) {
+			memcpy(&(wcb.data[sector * fatSectorSize]), flashBlock + sector * fatSectorSize, fatSectorSize);
+		}
+	}
+	wcb.dirtySectors = allSectorsDirty;
+}
+
+
+bool FatTools::WriteCacheDirty()
+{
+	for (auto& wcb : writeCache) {
+		if (wcb.dirtySectors) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void FatTools::FlushComplete(const uint32_t address, const bool written)
+{
+	// Called from flash interrupt when a queued block has been written
+	if (written) {
+		++fatTools.flushBlocks;
+	}
+}
+
+
 uint32_t fatLastFlush = 0;						// For debugging
 
 uint8_t FatTools::FlushCache()
@@ -166,7 +327,7 @@ uint8_t FatTools::FlushCache()
 	while (dirtyCacheBlocks != 0) {
 		if (dirtyCacheBlocks & (1 << blockPos)) {
 			uint32_t byteOffset = blockPos * fatEraseSectors * fatSectorSize;
-			if (extFlash.WriteData(byteOffset, (uint32_t*)&(headerCache[byteOffset]), (fatEraseSectors * fatSectorSize) / 4)) {
+			if (flashDevice->WriteData(byteOffset, (uint32_t*)&(headerCache[byteOffset]), (fatEraseSectors * fatSectorSize) / 4)) {
 				++count;
 			}
 			dirtyCacheBlocks &= ~(1 << blockPos);
@@ -174,13 +335,13 @@ uint8_t FatTools::FlushCache()
 		++blockPos;
 	}
 
-	// Write current working block to flash
-	if (writeCacheDirty && writeBlock > 0) {
-		uint32_t writeAddress = writeBlock * fatEraseSectors * fatSectorSize;
-		if (extFlash.WriteData(writeAddress, (uint32_t*)writeBlockCache, (fatEraseSectors * fatSectorSize) / 4)) {
+	// Write cached data blocks to flash in address order
+	while (WriteCacheBlock* wcb = NextWriteBackBlock()) {
+		FillWriteCacheBlock(*wcb);
+		if (flashDevice->WriteData(wcb->block * fatEraseSectors * fatSectorSize, (uint32_t*)wcb->data, (fatEraseSectors * fatSectorSize) / 4)) {
 			++count;
 		}
-		writeCacheDirty = false;			// Indicates that write cache is clean
+		wcb->dirtySectors = 0;				// Indicates that write cache block is clean
 	}
 
 	flushCacheBusy = false;
@@ -198,33 +359,82 @@ const uint8_t* FatTools::GetClusterAddr(const uint32_t cluster, const bool ignor
 	if (offsetByte < fatCacheSectors * fatSectorSize && !ignoreCache) {			// In cache
 		return headerCache + offsetByte;
 	} else {
-		return flashAddress + offsetByte;						// in memory mapped flash data
+		return flashDevice->ReadMapped(offsetByte);				// in memory mapped flash data
 	}
 }
 
 
+FatTools::DirReader::DirReader(const uint32_t cluster) : cluster(cluster)
+{
+	if (fatTools.noFileSystem) {
+		this->cluster = 0;
+		entry = end = nullptr;
+	} else if (cluster == 0) {
+		entry = fatTools.rootDirectory;
+		end = entry + fatTools.fatFs.n_rootdir;
+	} else {
+		entry = (const FATFileInfo*)fatTools.GetClusterAddr(cluster);
+		end = entry + fatClusterSize / sizeof(FATFileInfo);
+	}
+}
+
+
+const FATFileInfo* FatTools::DirReader::Next()
+{
+	if (entry == end) {
+		// Move to next cluster of a subdirectory: values from 0xFFF8 mark the end of the chain
+		const uint32_t next = (cluster == 0) ? 0 : fatTools.clusterChain[cluster];
+		if (next < 2 || next >= fatMaxCluster || ++clusterCount >= fatMaxCluster) {
+			cluster = 0;
+			return nullptr;
+		}
+		cluster = next;
+		entry = (const FATFileInfo*)fatTools.GetClusterAddr(cluster);
+		end = entry + fatClusterSize / sizeof(FATFileInfo);
+	}
+
+	if (entry->name[0] == 0 || (uint8_t)entry->name[0] == 0xFF) {		// Free entry marks end of directory (0xFF if flash is erased)
+		cluster = 0;
+		end = entry;
+		return nullptr;
+	}
+	return entry++;
+}
+
+
 const uint8_t* FatTools::GetSectorAddr(const uint32_t sector, bool block)
 {
 	// Used by MSC when reading: depending on sector return header or write cache; otherwise flash address
 	if (sector < fatCacheSectors) {
 		return &(headerCache[sector * fatSectorSize]);
 	} else {
-		// Check if using write cache
-		const int32_t block = sector / fatEraseSectors;
-		if (writeBlock == block && writeCacheDirty) {
-			const uint32_t byteOffset = (sector - (block * fatEraseSectors)) * fatSectorSize;		// Offset within currently block
-			return &(writeBlockCache[byteOffset]);
-		} else {
-			if (block) {
-				readWait = SysTickVal + readWaitSet;
-			}
-			const uint8_t* sectorAddress = flashAddress + (sector * fatSectorSize);
-			return sectorAddress;
+		if (const uint8_t* cached = WriteCacheSector(sector)) {
+			return cached;
+		}
+
+		if (sector / fatEraseSectors) {
+			readWait = SysTickVal + readWaitSet;
 		}
+		const uint8_t* sectorAddress = flashDevice->ReadMapped(sector * fatSectorSize);
+		return sectorAddress;
 	}
 }
 
 
+const uint8_t* FatTools::WriteCacheSector(const uint32_t sector)
+{
+	// Returns address of sector in the write cache if it has been written since the last flush, otherwise nullptr
+	const int32_t block = sector / fatEraseSectors;
+	const uint32_t blockSector = sector - (block * fatEraseSectors);
+	for (auto& wcb : writeCache) {
+		if (wcb.block == block && (wcb.dirtySectors & (1 << blockSector))) {
+			return &(wcb.data[blockSector * fatSectorSize]);
+		}
+	}
+	return nullptr;
+}
+
+
 void FatTools::PrintDirInfo(const uint32_t cluster)
 {
 	// Output a detailed analysis of FAT directory structure
@@ -233,22 +443,14 @@ void FatTools::PrintDirInfo(const uint32_t cluster)
 		return;
 	}
 
-	const FATFileInfo* fatInfo;
 	if (cluster == 0) {
 		printf("\r\n  Attrib Address      Bytes    Created   Accessed Name          Clusters\r\n"
 				   "  ---------------------------------------------------------------------\r\n");
-		fatInfo = rootDirectory;
-	} else {
-		fatInfo = (FATFileInfo*)GetClusterAddr(cluster);
-	}
-
-	if (fatInfo->fileSize == 0xFFFFFFFF && *(uint32_t*)fatInfo->name == 0xFFFFFFFF) {		// Handle corrupt subdirectory (where flash has not been initialised
-		return;
 	}
 
-	const uint8_t* endOfCluster = (uint8_t*)fatInfo + fatClusterSize;
-
-	while (fatInfo->name[0] != 0 && (uint8_t*)fatInfo < endOfCluster) {
+	DirReader reader(cluster);
+	const FATFileInfo* fatInfo;
+	while ((fatInfo = reader.Next()) != nullptr) {
 
 		if (usb.cdc.transmitting) {		// Add delay so that output can catch up
 			DelayMS(2);
@@ -302,7 +504,6 @@ void FatTools::PrintDirInfo(const uint32_t cluster)
 		if ((fatInfo->attr & AM_DIR) && (fatInfo->name[0] != '.') && (fatInfo->name[0] != FATFileInfo::fileDeleted) && (fatInfo->firstClusterLow < fatMaxCluster)) {
 			PrintDirInfo(fatInfo->firstClusterLow);
 		}
-		fatInfo++;
 	}
 }
 
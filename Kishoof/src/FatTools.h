@@ -33,7 +33,8 @@ static constexpr uint32_t fatClusterSize = 4096;									// Cluster size used by
 static constexpr uint32_t fatMaxCluster = (fatSectorSize * fatSectorCount) / fatClusterSize;		// Store largest cluster number
 static constexpr uint32_t fatEraseSectors = 8;										// Number of sectors in an erase block (4096 bytes per device)
 static constexpr uint32_t fatCacheSectors = 128;									// 72 in Header + extra for testing NB - must be divisible by 8 (fatEraseSectors)
-static constexpr uint32_t fatDirectoryEntries = 128;								// Number of 32 byte directory items - limit to 128 to ensure directory fits in cluster
+static constexpr uint32_t fatWriteCacheBlocks = 8;									// Number of erase blocks held in the write cache (4096 bytes each)
+static constexpr uint32_t fatDirectoryEntries = 128;								// Number of 32 byte root directory items - limit to 128 to ensure root directory fits in cluster
 
 
 // Struct to hold regular 32 byte directory entries (SFN)
@@ -82,6 +83,17 @@ public:
 	static constexpr uint32_t readWaitSet = 1000;		// Block sample output for at least X ms after a read
 	uint32_t readWait = 0;				// Time to block sample output since a read last reported
 	bool updateWavetables = false;		// Set during write so that updates to wavetables can be batched
+	bool flushQueued = false;			// Cache blocks are being written from the flash queue
+	bool indexQueued = false;			// Wavetable list index is being written from the flash queue
+	volatile uint32_t flushBlocks = 0;	// Number of blocks changed by last queued flush
+	uint32_t lastFlushTime = 0;			// Duration of last queued flush in ms
+	uint32_t writeCacheEvictions = 0;	// Blocks written to flash during a write to free a write cache slot
+	uint32_t writesDeferred = 0;		// Writes refused during a queued flush or needing an eviction from the USB interrupt
+
+	// Longest the MSC endpoint is paused by a queued flush with typical flash times: every header and write cache block is erased
+	// and programmed. Audio reads that suspend the flush extend it by the time they hold the suspend
+	static constexpr uint32_t maxFlushBlocks = fatCacheSectors / fatEraseSectors + fatWriteCacheBlocks;
+	static constexpr uint32_t maxFlushMicros = maxFlushBlocks * BlockDevice::typicalBlockMicros;
 
 	bool noFileSystem = true;
 	uint16_t* clusterChain;				// Pointer to beginning of cluster chain (AKA FAT)
@@ -91,7 +103,7 @@ public:
 	void Read(uint8_t* buffAddress, const uint32_t readSector, const uint32_t sectorCount);
 	const uint8_t* GetSectorAddr(const uint32_t sector, bool block);
 	const uint8_t* GetClusterAddr(const uint32_t cluster, const bool ignoreCache = false);
-	void Write(const uint8_t* readBuff, const uint32_t writeSector, const uint32_t sectorCount);
+	bool Write(const uint8_t* readBuff, const uint32_t writeSector, const uint32_t sectorCount, const bool canEvict = true);
 	void PrintDirInfo(uint32_t cluster = 0);
 	void PrintFatInfo();
 	void PrintFiles(char* path);
@@ -99,7 +111,21 @@ public:
 	uint8_t FlushCache();
 	void InvalidateFatFSCache();
 	bool Format();
-	bool Busy() { return flushCacheBusy | writeBusy | (writingWait > SysTickVal) | (readWait > SysTickVal); }
+	bool Busy() { return flushCacheBusy | flushQueued | indexQueued | writeBusy | (writingWait > SysTickVal) | (readWait > SysTickVal); }
+	bool AcquireRead();					// Audio read of flash: call ReleaseRead() when finished
+	void ReleaseRead();
+
+	// Returns directory entries one at a time in place, following the cluster chain of subdirectories (root directory is a fixed size)
+	class DirReader {
+	public:
+		DirReader(const uint32_t cluster);				// Cluster 0 reads the root directory
+		const FATFileInfo* Next();						// Returns nullptr after the last entry
+	private:
+		const FATFileInfo* entry;
+		const FATFileInfo* end;							// End of current cluster
+		uint32_t cluster;
+		uint32_t clusterCount = 0;						// Stops a corrupt cluster chain from looping
+	};
 private:
 	FATFS fatFs;						// File system object for RAM disk logical drive
 	const char fatPath[4] = "0:/";		// Logical drive path for FAT File system
@@ -108,15 +134,30 @@ private:
 	uint32_t cacheUpdated = 0;			// Store the systick time the cache was last updated so separate timer can periodically clean up cache
 	uint8_t headerCache[fatSectorSize * fatCacheSectors];	// Cache for storing the header section of the Flash FAT drive
 	uint64_t dirtyCacheBlocks = 0;		// Bit array containing dirty blocks in header cache (block = erasesector)
-
-	// Initialise Write Cache - this is used to cache write data into blocks for safe erasing when overwriting existing data
-	uint8_t writeBlockCache[fatSectorSize * fatEraseSectors];
-	int32_t writeBlock = -1;			// Keep track of which block is currently held in the write cache
-	bool writeCacheDirty = false;		// Indicates whether the data in the write cache has changes
+	uint32_t flushStart = 0;
+
+	// Write cache holds data section blocks being written to so that interleaved writes to several blocks (eg file data and
+	// subdirectory entries) do not each trigger an erase. Only written sectors are held: the remainder of the block is filled
+	// from flash when it is written back, so a block written in full is never read. Least recently used block is evicted
+	struct WriteCacheBlock {
+		int32_t block = -1;				// Erase block held, -1 if free
+		uint8_t dirtySectors = 0;		// Bit array of sectors in block holding written data
+		uint32_t lastUsed = 0;			// Write count when block was last written
+		uint8_t data[fatSectorSize * fatEraseSectors];
+	} writeCache[fatWriteCacheBlocks];
+	uint32_t writeCount = 0;			// Incremented on each write to order cache blocks by use
+	static constexpr uint8_t allSectorsDirty = (1 << fatEraseSectors) - 1;
 
 	std::string GetFileName(const FATFileInfo* lfn);
 	std::string GetAttributes(const FATFileInfo* fi);
 	std::string FileDate(const uint16_t date);
+	void QueueFlush();
+	WriteCacheBlock* NextWriteBackBlock();
+	bool WriteCacheFree(const uint32_t writeSector, const uint32_t sectorCount);
+	void FillWriteCacheBlock(WriteCacheBlock& wcb);
+	const uint8_t* WriteCacheSector(const uint32_t sector);
+	bool WriteCacheDirty();
+	static void FlushComplete(const uint32_t address, const bool written);
 	void MakeDummyFiles();
 	void LFNDirEntries(uint8_t* address, const char* sfn, const char* lfn1, const char* lfn2, const uint8_t checksum, const uint8_t attributes, const uint16_t cluster, const uint32_t size);
 
@@ -1,18 +1,29 @@
 #include "Filter.h"
+#include <cstdio>
 
 
 Filter filter;
+Filter::FilterQ15<Filter::firTaps> __attribute__((section (".dtcm_buffer"))) Filter::q15LUT[fullFirBanks];
+Filter::FilterQ15<Filter::shortFirTaps> __attribute__((section (".dtcm2_buffer"))) Filter::shortQ15LUT[shortFirBanks];
 
 void Filter::Init()
 {
-	FIRFilterWindow();
-	BuildLUT();
+	const uint32_t start = SysTickVal;
+	BuildLUT(filterLUT, q15LUT);
+	BuildLUT(shortFilterLUT, shortQ15LUT);
+	lutBuildTime = SysTickVal - start;
+	printf("Filter: %lu polyphase banks of %lu phases, %lu bytes; built in %lu ms\r\n", std::size(q15LUT) + std::size(shortQ15LUT),
+			polyphases, polyphaseBytes, lutBuildTime);
 }
 
 
-void Filter::BuildLUT()
+template<uint32_t taps>
+void Filter::BuildLUT(FilterLUT<taps>* lut, FilterQ15<taps>* polyphase)
 {
-	// Build a lookup table of coefficients
+	// Build a lookup table of coefficients: folded float coefficients (used by the DSP tests) and the polyphase fixed point bank
+	constexpr Tier bankTier = (taps == firTaps) ? Tier::fullFIR : Tier::shortFIR;
+	float winCoeff[taps];
+	FIRFilterWindow(winCoeff, taps);
 
 	// Eg is sampling freq = 20 kHz, then Nyquist = 10 kHz. LPF with 3 dB corner at 1 kHz set omega = 0.1 (1 kHz / 10 kHz)
 	// Each LUT is for an integer pitch increment from 1 to 90 (maximum pitch increment with 5V and octave up
@@ -20,10 +31,85 @@ void Filter::BuildLUT()
 	for (uint32_t i = 0; i < lutSize; ++i) {
 		float pitchInc = std::pow(2.0f, inc * i);
 		const float omega = 1.0f / pitchInc;
-		filterLUT[i].inc = pitchInc;
-		for (int8_t j = 0; j < (int8_t)foldedFirTaps; ++j) {
-			const int8_t  arg = j - (firTaps - 1) / 2;
-			filterLUT[i].coeff[j] = omega * Sinc(omega * arg * M_PI) * winCoeff[j];
+		lut[i].inc = pitchInc;
+		lut[i].tier = lutTiers[i];
+		for (int8_t j = 0; j < (int8_t)((taps + 1) / 2); ++j) {
+			const int8_t  arg = j - (taps - 1) / 2;
+			lut[i].coeff[j] = omega * Sinc(omega * arg * M_PI) * winCoeff[j];
+		}
+
+		// Polyphase bank (only for LUT positions using this bank's tier): prototype evaluated at each fractional delay, normalised to the
+		// DC gain of phase 0 to avoid modulation at the phase rate
+		if (lut[i].tier != bankTier) {
+			continue;
+		}
+		FilterQ15<taps>& bank = polyphase[polyphaseSlot[i]];
+		float coeff[storedPhases][taps + 1];
+		float dcGain0 = 0.0f;
+		float peak = 0.0f;
+		for (uint32_t p = 0; p < storedPhases; ++p) {
+			const float delay = (float)p / polyphases;
+			float dcGain = 0.0f;
+			for (uint32_t k = 0; k < taps + 1; ++k) {
+				coeff[p][k] = PrototypeCoeff(omega, k - delay, taps);
+				dcGain += coeff[p][k];
+			}
+			if (p == 0) {
+				dcGain0 = dcGain;
+			}
+			for (uint32_t k = 0; k < taps + 1; ++k) {
+				coeff[p][k] *= dcGain0 / dcGain;
+				peak = std::max(peak, std::abs(coeff[p][k]));
+			}
+		}
+
+		// Full Q15 range: the PCM16 kernel accumulates in 64 bits so cannot overflow
+		const float scale = 32767.0f / peak;
+		bank.scale = 1.0f / scale;
+		for (uint32_t p = 0; p < storedPhases; ++p) {
+			for (uint32_t k = 0; k < taps + 1; ++k) {
+				const float scaled = coeff[p][k] * scale;
+				bank.coeff[p][k] = (int16_t)std::round(scaled);
+				bank.residual[p][k] = (int16_t)std::round((scaled - bank.coeff[p][k]) * 32768.0f);
+			}
+		}
+	}
+}
+
+
+float Filter::PrototypeCoeff(const float omega, const float t, const uint32_t taps)
+{
+	// Windowed sinc low pass filter at (fractional) tap position t
+	return omega * Sinc(omega * (t - (taps - 1) / 2) * M_PI) * KaiserWindow(t, taps);
+}
+
+
+void Filter::FFT(std::complex<float>* data, const uint32_t n, const bool inverse)
+{
+	// In-place iterative radix-2 FFT (n must be a power of 2); inverse transform is not normalised
+	for (uint32_t i = 1, j = 0; i < n; ++i) {				// Bit reversal reordering
+		uint32_t bit = n >> 1;
+		for (; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j) {
+			std::swap(data[i], data[j]);
+		}
+	}
+
+	for (uint32_t len = 2; len <= n; len <<= 1) {
+		const float angle = (inverse ? 2.0f : -2.0f) * std::numbers::pi_v<float> / len;
+		const std::complex<float> wInc {std::cos(angle), std::sin(angle)};
+		for (uint32_t i = 0; i < n; i += len) {
+			std::complex<float> w {1.0f, 0.0f};
+			for (uint32_t j = 0; j < len / 2; ++j) {
+				const std::complex<float> u = data[i + j];
+				const std::complex<float> v = data[i + j + len / 2] * w;
+				data[i + j] = u + v;
+				data[i + j + len / 2] = u - v;
+				w *= wInc;
+			}
 		}
 	}
 }
@@ -38,13 +124,22 @@ float Filter::Sinc(const float x)
 }
 
 
-void Filter::FIRFilterWindow()
+void Filter::FIRFilterWindow(float* winCoeff, const uint32_t taps)
+{
+	for (uint8_t j = 0; j < taps; j++) {
+		winCoeff[j] = KaiserWindow(j, taps);
+	}
+}
+
+
+float Filter::KaiserWindow(const float t, const uint32_t taps)
 {
-	// Kaiser window
-	for (uint8_t j = 0; j < firTaps; j++) {
-		const float arg = windowBeta * sqrt(1.0f - pow( (static_cast<float>(2 * j) + 1 - firTaps) / (firTaps + 1), 2.0) );
-		winCoeff[j] = Bessel(arg) / Bessel(windowBeta);
+	// Kaiser window at (fractional) tap position t; zero outside the filter
+	const float x = (2.0f * t + 1 - taps) / (taps + 1);
+	if (std::abs(x) >= 1.0f) {
+		return 0.0f;
 	}
+	return Bessel(windowBeta * std::sqrt(1.0f - x * x)) / Bessel(windowBeta);
 }
 
 
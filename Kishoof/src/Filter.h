@@ -6,104 +6,361 @@
  */
 
 #include "initialisation.h"
+#include "FastMath.h"
 #include <cmath>
+#include <cstring>
 #include <complex>
 #include <array>
+#include <algorithm>
+#include <numbers>
+#include <string_view>
 
 struct Filter {
 	friend class SerialHandler;				// Allow the serial handler access to private data for printing
 	friend class Config;					// Allow access to config to store values
+	friend class HostTests;
 public:
 
 	void Init();
 
+	// Interpolation kernels are templated on the frame length (a power of 2) so read positions wrap with a constant mask
+	template<uint32_t frameSize = defaultFrameSize, typename sampleType>
+	float CalcInterpolatedFilter(int32_t pos, const sampleType* waveTable, const float ratio, const float pitchInc)
+	{
+		// Interpolate sample at pos + ratio, filtering to remove harmonics that would alias at pitchInc
+		return Interpolate<false, frameSize>(pos, waveTable, waveTable, ratio, 0.0f, pitchInc);
+	}
+
+
+	template<uint32_t frameSize = defaultFrameSize, typename sampleType>
+	float CalcInterpolatedFilter2D(int32_t pos, const sampleType* frame1, const sampleType* frame2, const float ratio, const float wtRatio, const float pitchInc)
+	{
+		// Filters and interpolates between two wavetable frames in a single pass: as the FIR is linear the frames can be blended before convolution
+		return Interpolate<true, frameSize>(pos, frame1, frame2, ratio, wtRatio, pitchInc);
+	}
+
+
 	template<typename sampleType>
-	float CalcInterpolatedFilter(int32_t pos, sampleType* waveTable, const float ratio, const float pitchInc)
+	float CalcCubic(const sampleType* waveTable, const float pos, const uint32_t mask)
 	{
-		// FIR Convolution routine using folded FIR structure.
-		// Samples are interpolated according to ratio and filtering is carried out to minimise multiplications
+		// 4 point Catmull-Rom interpolation; mask wraps read position to table length (which must be a power of 2)
+		const uint32_t p = (uint32_t)pos;
+		return Cubic(waveTable[(p - 1) & mask], waveTable[p & mask], waveTable[(p + 1) & mask], waveTable[(p + 2) & mask], pos - p);
+	}
 
-		// Calculate filter coefficient lookup table (converts pitch increment from exponential to linear scale)
-		const uint32_t lutPos = std::min(uint32_t(std::round(std::log2(pitchInc) * lutLookupMult)), lutSize - 1);
-		auto& filterCoeff = filterLUT[lutPos].coeff;
 
-		if (ratio < 0.00001f) {								// To avoid a divide by zero and for better performance
-			return CalcFilter(pos, waveTable, lutPos);
+	void FFT(std::complex<float>* data, const uint32_t n, const bool inverse);
+
+	float windowBeta = 4;					// between 0.0 and 10.0 - trade-off between stop band attenuation and filter transistion width
+
+	static constexpr uint32_t firTaps = 31;
+	static constexpr uint32_t firDelay = (firTaps - 1) / 2;		// Latency of all interpolation tiers in samples
+
+	// Interpolation tiers selected by pitch increment: Hermite when no harmonics can alias, short FIR where its aliasing is close to the full FIR
+	enum class Tier : uint8_t {hermite, shortFIR, fullFIR};
+	static constexpr std::string_view tierNames[] = {"Hermite", "Short FIR", "Full FIR"};
+	Tier tier = Tier::fullFIR;				// Most recently used tier for diagnostics
+
+private:
+	static constexpr uint32_t shortFirTaps = 15;
+	static constexpr uint32_t lutSize = 90;
+	static constexpr uint32_t lutRange = 7;
+	static constexpr float lutLookupMult = (float)lutSize / (float)lutRange;
+
+	// Tier boundaries as filter LUT positions (log2(pitchInc) * lutLookupMult) measured with 'kishoof-host test tiers' using a sawtooth frame:
+	// short FIR used where its alias to signal ratio is within 3dB of the full FIR (3.1dB at position 2, kept short as the full FIR banks
+	// fill their DTCM bank); below a pitch increment of 1 no harmonics can alias so Hermite is used
+	static constexpr uint32_t hermiteLUTLimit = 1;
+	static constexpr struct { uint32_t start; uint32_t end; } shortFirRanges[] = {{2, 38}, {67, lutSize}};
+	static constexpr auto lutTiers = [] {
+		std::array<Tier, lutSize> tiers {};
+		for (uint32_t i = 0; i < lutSize; ++i) {
+			tiers[i] = (i < hermiteLUTLimit) ? Tier::hermite : Tier::fullFIR;
+			for (auto& range : shortFirRanges) {
+				if (i >= range.start && i < range.end) {
+					tiers[i] = Tier::shortFIR;
+				}
+			}
 		}
+		return tiers;
+	}();
 
-		float outputSample = 0.0f;
+	template<bool blendFrames, uint32_t frameSize, typename sampleType>
+	float Interpolate(int32_t pos, const sampleType* frame1, const sampleType* frame2, const float ratio, const float wtRatio, const float pitchInc)
+	{
+		// Calculate filter coefficient lookup table (converts pitch increment from exponential to linear scale)
+		const uint32_t lutPos = std::clamp((int32_t)(FastLog2(pitchInc) * lutLookupMult + 0.5f), (int32_t)0, (int32_t)lutSize - 1);
 
-		const float invertedRatio = 1.0f / ratio - 1.0f;	// half the samples are interpolated during filtering, and then the total normalised
+		tier = filterLUT[lutPos].tier;
+		if (tier == Tier::hermite) {
+			return CalcHermite<blendFrames, frameSize>(pos, frame1, frame2, ratio, wtRatio);
+		}
+		// FIR tiers use the polyphase banks for both PCM16 and float sources, convolving both frames in the same pass over the coefficients
+		if (tier == Tier::shortFIR) {
+			return ConvolvePolyphase<frameSize, blendFrames>(pos, frame1, frame2, ratio, wtRatio, shortQ15LUT[polyphaseSlot[lutPos]]);
+		}
+		return ConvolvePolyphase<frameSize, blendFrames>(pos, frame1, frame2, ratio, wtRatio, q15LUT[polyphaseSlot[lutPos]]);
+	}
 
-		// pos = position of sample N, N-1, N-2 etc
-		int32_t revpos = (pos - firTaps + 1) & 0x7FF;		// position of sample 1, 2, 3 etc
 
-		for (uint8_t i = 0; i < firTaps / 2; ++i) {
+	template<uint32_t taps, bool blendFrames, uint32_t frameSize = defaultFrameSize, typename sampleType>
+	float Convolve(int32_t pos, const sampleType* frame1, const sampleType* frame2, const float ratio, const float wtRatio, const float* filterCoeff)
+	{
+		// FIR Convolution routine using folded FIR structure, centred firDelay samples behind pos so all tiers have the same latency
+		// Filtered samples either side of the read position are linearly interpolated according to ratio. Used as the float reference
+		// in the DSP tests: playback uses the polyphase banks, which have much lower error at fractional positions
+		// If blending frames, frames are interpolated on the folded sample pairs so only one extra multiply is needed per pair
+		constexpr int32_t mask = frameSize - 1;
+		auto pair = [&](const int32_t p1, const int32_t p2) {
+			const float pair1 = frame1[p1] + frame1[p2];
+			if constexpr (blendFrames) {
+				return pair1 + wtRatio * (frame2[p1] + frame2[p2] - pair1);
+			} else {
+				return pair1;
+			}
+		};
+		auto single = [&](const int32_t p) {
+			if constexpr (blendFrames) {
+				return std::lerp((float)frame1[p], (float)frame2[p], wtRatio);
+			} else {
+				return (float)frame1[p];
+			}
+		};
+
+		float sample0 = 0.0f;								// Filtered sample at pos
+		float sample1 = 0.0f;								// Filtered sample at pos + 1
+
+		// pos = position of sample N, N-1, N-2 etc; revpos = position of sample 1, 2, 3 etc
+		int32_t revpos = (pos - firDelay - (taps - 1) / 2) & mask;
+		pos = (pos - firDelay + (taps - 1) / 2) & mask;
+
+		for (uint8_t i = 0; i < taps / 2; ++i) {
 			// Folded FIR structure - as coefficients are symmetrical we can multiple the sample 1 + sample N by the 1st coefficient, sample 2 + sample N - 1 by 2nd coefficient etc
-			const int32_t pos2 = (pos + 1) & 0x7FF;
-			const int32_t revpos2 = (revpos + 1) & 0x7FF;
+			const int32_t pos2 = (pos + 1) & mask;
+			const int32_t revpos2 = (revpos + 1) & mask;
 
-			outputSample += filterCoeff[i] * ((invertedRatio * (waveTable[revpos] + waveTable[pos]) +
-					(waveTable[revpos2] + waveTable[pos2])));
+			sample0 += filterCoeff[i] * pair(revpos, pos);
+			sample1 += filterCoeff[i] * pair(revpos2, pos2);
 
 			revpos = revpos2;
-			pos = (pos - 1) & 0x7FF;
+			pos = (pos - 1) & mask;
 		}
 
-		outputSample += filterCoeff[firTaps / 2] * (invertedRatio * waveTable[revpos] + waveTable[(revpos + 1) & 0x7FF]);
+		sample0 += filterCoeff[taps / 2] * single(revpos);
+		sample1 += filterCoeff[taps / 2] * single((revpos + 1) & mask);
 
-		return outputSample * ratio;
+		return sample0 + ratio * (sample1 - sample0);
 	}
 
 
-	template<typename sampleType>
-	float CalcFilter(int32_t pos, sampleType* waveTable, const uint32_t lutPos)
+	// Polyphase Q15 coefficients: one set of taps + 1 coefficients per fractional delay of phase / polyphases. Phases above half a sample
+	// are the time reverse of those below so are not stored. 32 phases measured with 'kishoof-host test polyphase': error at fractional
+	// positions of a sine (harmonics 256 to 768) is -42 to -61dB with 8 phases, -55 to -73dB with 16, -66 to -79dB with 32 and no
+	// better with 64. Each Q15 coefficient has a Q15 residual (the rounding error of the coefficient scaled by 2^15): alone, Q15 coefficients
+	// are within -85dB of the float filter on white noise, with the residual better than -130dB ('kishoof-host test polyphaseq15')
+	static constexpr uint32_t polyphases = 32;
+	static constexpr uint32_t storedPhases = polyphases / 2 + 1;
+	template<uint32_t taps>
+	struct FilterQ15 {
+		float scale;						// Converts accumulator to sample units
+		int16_t coeff[storedPhases][taps + 1];
+		int16_t residual[storedPhases][taps + 1];
+	};
+	static constexpr float residualScale = 1.0f / 32768.0f;
+
+	// Banks are only built for the LUT positions where their tier is used: slot of each LUT position in the bank for its tier
+	static constexpr auto polyphaseSlot = [] {
+		std::array<uint8_t, lutSize> slot {};
+		uint8_t count[3] = {};
+		for (uint32_t i = 0; i < lutSize; ++i) {
+			slot[i] = count[(uint8_t)lutTiers[i]]++;
+		}
+		return slot;
+	}();
+	static constexpr uint32_t fullFirBanks = std::count(lutTiers.begin(), lutTiers.end(), Tier::fullFIR);
+	static constexpr uint32_t shortFirBanks = std::count(lutTiers.begin(), lutTiers.end(), Tier::shortFIR);
+
+
+	template<uint32_t frameSize, bool blendFrames, uint32_t taps, typename sampleType>
+	float ConvolvePolyphase(const int32_t pos, const sampleType* frame1, const sampleType* frame2, const float ratio, const float wtRatio, const FilterQ15<taps>& q15)
 	{
-		// FIR Convolution routine using folded FIR structure
-		float outputSample = 0.0f;
-		auto& filterCoeff = filterLUT[lutPos].coeff;
+		// Polyphase FIR: output is interpolated between the phases either side of the fractional read position
+		constexpr int32_t mask = frameSize - 1;
+		const int32_t start = (pos - firDelay - (taps - 1) / 2) & mask;
+		sampleType wrapped[2][taps + 1];
+		auto window = [&](const sampleType* frame, sampleType* copy) {
+			if (start + taps + 1 > frameSize) {				// Copy window that wraps around end of frame
+				for (uint32_t i = 0; i < taps + 1; ++i) {
+					copy[i] = frame[(start + i) & mask];
+				}
+				return (const sampleType*)copy;
+			}
+			return &frame[start];
+		};
+		const sampleType* window1 = window(frame1, wrapped[0]);
+		const sampleType* window2 = blendFrames ? window(frame2, wrapped[1]) : window1;
+
+		const float phasePos = ratio * polyphases;
+		const uint32_t phase = std::min((uint32_t)phasePos, polyphases - 1);
+		const float sample0 = PhaseConvolve<blendFrames>(window1, window2, q15, phase, wtRatio);
+		const float sample1 = PhaseConvolve<blendFrames>(window1, window2, q15, phase + 1, wtRatio);
+		return (sample0 + (phasePos - phase) * (sample1 - sample0)) * q15.scale;
+	}
 
-		// pos = position of sample N, N-1, N-2 etc
-		int32_t revpos = (pos - firTaps + 1) & 0x7FF;		// position of sample 1, 2, 3 etc
 
-		for (uint8_t i = 0; i < firTaps / 2; ++i) {
-			// Folded FIR structure - as coefficients are symmetrical we can multiple the sample 1 + sample N by the 1st coefficient, sample 2 + sample N - 1 by 2nd coefficient etc
-			outputSample += filterCoeff[i] * (waveTable[revpos] + waveTable[pos]);
-			revpos = (revpos + 1) & 0x7FF;
-			pos = (pos - 1) & 0x7FF;
+	template<bool blendFrames, uint32_t taps>
+	static __attribute__((noinline)) float PhaseConvolve(const int16_t* window1, const int16_t* window2, const FilterQ15<taps>& q15, const uint32_t phase, const float wtRatio)
+	{
+		// PCM16: two taps per multiply-accumulate instruction into 64 bit accumulators, so coefficients can use the full Q15 range;
+		// coefficients and residuals are accumulated separately and combined at the end
+		// When blending frames each coefficient pair is loaded once and applied to both windows, the results blended by wtRatio
+		// Not inlined as shared by the kernels for each frame length (saves Flash)
+		int64_t acc1 = 0, acc2 = 0, res1 = 0, res2 = 0;
+		if (phase < storedPhases) {
+			const int16_t* coeff = q15.coeff[phase];
+			const int16_t* residual = q15.residual[phase];
+			for (uint32_t i = 0; i < taps + 1; i += 2) {
+				const uint32_t coeffPair = Load32(&coeff[i]);
+				const uint32_t residualPair = Load32(&residual[i]);
+				const uint32_t samples1 = Load32(&window1[i]);
+				acc1 = DualMAC(samples1, coeffPair, acc1);
+				res1 = DualMAC(samples1, residualPair, res1);
+				if constexpr (blendFrames) {
+					const uint32_t samples2 = Load32(&window2[i]);
+					acc2 = DualMAC(samples2, coeffPair, acc2);
+					res2 = DualMAC(samples2, residualPair, res2);
+				}
+			}
+		} else {
+			// Mirrored phase: read stored coefficient pairs in reverse order with the halves exchanged
+			const int16_t* coeff = q15.coeff[polyphases - phase];
+			const int16_t* residual = q15.residual[polyphases - phase];
+			for (uint32_t i = 0; i < taps + 1; i += 2) {
+				const uint32_t coeffPair = Load32(&coeff[taps - 1 - i]);
+				const uint32_t residualPair = Load32(&residual[taps - 1 - i]);
+				const uint32_t samples1 = Load32(&window1[i]);
+				acc1 = DualMACX(samples1, coeffPair, acc1);
+				res1 = DualMACX(samples1, residualPair, res1);
+				if constexpr (blendFrames) {
+					const uint32_t samples2 = Load32(&window2[i]);
+					acc2 = DualMACX(samples2, coeffPair, acc2);
+					res2 = DualMACX(samples2, residualPair, res2);
+				}
+			}
+		}
+		const float sample1 = (float)acc1 + (float)res1 * residualScale;
+		if constexpr (blendFrames) {
+			return std::lerp(sample1, (float)acc2 + (float)res2 * residualScale, wtRatio);
+		} else {
+			return sample1;
 		}
+	}
 
-		outputSample += filterCoeff[firTaps / 2] * waveTable[revpos];
 
-		return outputSample;
+	template<bool blendFrames, uint32_t taps>
+	static __attribute__((noinline)) float PhaseConvolve(const float* window1, const float* window2, const FilterQ15<taps>& q15, const uint32_t phase, const float wtRatio)
+	{
+		// Float: coefficients are converted from Q15 and residual as they are used
+		const bool mirrored = (phase >= storedPhases);
+		const int16_t* coeff = q15.coeff[mirrored ? polyphases - phase : phase];
+		const int16_t* residual = q15.residual[mirrored ? polyphases - phase : phase];
+		float acc1 = 0.0f, acc2 = 0.0f;
+		for (uint32_t i = 0; i < taps + 1; ++i) {
+			const uint32_t k = mirrored ? taps - i : i;
+			const float c = coeff[k] + residual[k] * residualScale;
+			acc1 += c * window1[i];
+			if constexpr (blendFrames) {
+				acc2 += c * window2[i];
+			}
+		}
+		if constexpr (blendFrames) {
+			return std::lerp(acc1, acc2, wtRatio);
+		} else {
+			return acc1;
+		}
 	}
 
 
-	float windowBeta = 4;					// between 0.0 and 10.0 - trade-off between stop band attenuation and filter transistion width
+	static inline uint32_t Load32(const int16_t* p)
+	{
+		uint32_t val;									// Pair of samples: compiles to a single (unaligned) word load
+		memcpy(&val, p, sizeof(val));
+		return val;
+	}
+
+
+	static inline int64_t DualMAC(const uint32_t x, const uint32_t y, const int64_t acc)
+	{
+		// Dual 16 bit multiply-accumulate: single SMLALD instruction on Cortex-M7, portable version for other targets
+#if defined(__ARM_FEATURE_DSP) && (__ARM_FEATURE_DSP == 1)
+		return (int64_t)__SMLALD(x, y, (uint64_t)acc);
+#else
+		return acc + (int16_t)x * (int16_t)y + (int16_t)(x >> 16) * (int16_t)(y >> 16);
+#endif
+	}
+
+
+	static inline int64_t DualMACX(const uint32_t x, const uint32_t y, const int64_t acc)
+	{
+		// As DualMAC with the halves of y exchanged (SMLALDX)
+#if defined(__ARM_FEATURE_DSP) && (__ARM_FEATURE_DSP == 1)
+		return (int64_t)__SMLALDX(x, y, (uint64_t)acc);
+#else
+		return acc + (int16_t)x * (int16_t)(y >> 16) + (int16_t)(x >> 16) * (int16_t)y;
+#endif
+	}
 
-private:
-	static constexpr uint32_t firTaps = 31;
-	static constexpr uint32_t foldedFirTaps = (firTaps + 1) / 2;
-	static constexpr uint32_t lutSize = 90;
-	static constexpr uint32_t lutRange = 7;
-	static constexpr float lutLookupMult = (float)lutSize / (float)lutRange;
 
-	void BuildLUT();
+	template<bool blendFrames, uint32_t frameSize, typename sampleType>
+	float CalcHermite(const int32_t pos, const sampleType* frame1, const sampleType* frame2, const float ratio, const float wtRatio)
+	{
+		// 4 point interpolation at the same latency as the FIR tiers
+		constexpr int32_t mask = frameSize - 1;
+		auto sample = [&](int32_t p) {
+			p &= mask;
+			if constexpr (blendFrames) {
+				return std::lerp((float)frame1[p], (float)frame2[p], wtRatio);
+			} else {
+				return (float)frame1[p];
+			}
+		};
+		const int32_t p = pos - firDelay;
+		return Cubic(sample(p - 1), sample(p), sample(p + 1), sample(p + 2), ratio);
+	}
+
+
+	static inline float Cubic(const float y0, const float y1, const float y2, const float y3, const float t)
+	{
+		return y1 + 0.5f * t * (y2 - y0 + t * (2.0f * y0 - 5.0f * y1 + 4.0f * y2 - y3 + t * (3.0f * (y1 - y2) + y3 - y0)));
+	}
+
+
+	template<uint32_t taps>
+	struct FilterLUT {
+		Tier tier;
+		float inc;
+		float coeff[(taps + 1) / 2];
+	};
+
+	template<uint32_t taps>
+	void BuildLUT(FilterLUT<taps>* lut, FilterQ15<taps>* polyphase);
+	float PrototypeCoeff(const float omega, const float t, const uint32_t taps);
+	float KaiserWindow(const float t, const uint32_t taps);
 	float Sinc(const float x);
-	void FIRFilterWindow();
+	void FIRFilterWindow(float* winCoeff, const uint32_t taps);
 	float Bessel(const float x);
 
-	float winCoeff[firTaps];
+	FilterLUT<firTaps> filterLUT[lutSize];
+	FilterLUT<shortFirTaps> shortFilterLUT[lutSize];
+	static FilterQ15<firTaps> q15LUT[fullFirBanks];			// Polyphase tables declared static to allow placement in DTCM
+	static FilterQ15<shortFirTaps> shortQ15LUT[shortFirBanks];
+	static_assert(sizeof(q15LUT) <= 64 * 1024 && sizeof(shortQ15LUT) <= 64 * 1024, "Polyphase banks must each fit a 64K DTCM bank");
 
-	struct {
-		float log;
-		float inc;
-		float coeff[foldedFirTaps];
-	} filterLUT[lutSize];
+public:
+	static constexpr uint32_t polyphaseBytes = sizeof(q15LUT) + sizeof(shortQ15LUT);
+	uint32_t lutBuildTime = 0;				// Time in ms to build all coefficient tables
 
 };
 
 
 extern Filter filter;
-
-
@@ -0,0 +1,170 @@
+#if defined(__linux__)
+
+#include "FlashEmulator.h"
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+BlockDevice* flashDevice = nullptr;							// Set to an open FlashEmulator by HostDrive (host/HostDrive.cpp)
+
+FlashEmulator::FlashEmulator(const uint32_t programMicros, const uint32_t eraseMicros)
+	: programTime(programMicros), eraseTime(eraseMicros)
+{
+}
+
+
+FlashEmulator::~FlashEmulator()
+{
+	Close();
+}
+
+
+bool FlashEmulator::Open(const char* path)
+{
+	Close();
+	file = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat info;
+	if (file < 0 || fstat(file, &info) != 0 || ftruncate(file, deviceSize) != 0) {
+		Close();
+		return false;
+	}
+
+	image = (uint8_t*)mmap(nullptr, deviceSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (image == MAP_FAILED) {
+		image = nullptr;
+		Close();
+		return false;
+	}
+
+	// A new or short image is extended as erased flash
+	if (info.st_size < deviceSize) {
+		memset(image + info.st_size, 0xFF, deviceSize - info.st_size);
+	}
+	readyTime = std::chrono::steady_clock::now();
+	return true;
+}
+
+
+void FlashEmulator::Close()
+{
+	if (image != nullptr) {
+		msync(image, deviceSize, MS_SYNC);
+		munmap(image, deviceSize);
+		image = nullptr;
+	}
+	if (file >= 0) {
+		close(file);
+		file = -1;
+	}
+}
+
+
+const uint8_t* FlashEmulator::ReadMapped(const uint32_t address)
+{
+	// Real device returns status rather than data while busy
+	if (Busy() || address >= deviceSize) {
+		++violations;
+	}
+	return image + address;
+}
+
+
+void FlashEmulator::ProgramPage(const uint32_t address, const uint32_t* data, const uint32_t words)
+{
+	// Bits can only be cleared; data past the end of the page wraps to the page start as on the real device
+	WaitReady();
+	if (address >= deviceSize || (address & 0b11) || words > pageSize / 4) {
+		++violations;
+		return;
+	}
+	const uint32_t page = address & ~(pageSize - 1);
+	uint32_t offset = address - page;
+	if (offset + words * 4 > pageSize) {
+		++violations;
+	}
+
+	for (uint32_t i = 0; i < words; ++i) {
+		uint32_t* word = (uint32_t*)(image + page + offset);
+		*word &= data[i];
+		offset = (offset + 4) & (pageSize - 1);
+	}
+	++pagesProgrammed;
+	readyTime = std::chrono::steady_clock::now() + programTime;
+}
+
+
+void FlashEmulator::EraseBlock(const uint32_t address)
+{
+	WaitReady();
+	if (address >= deviceSize) {
+		++violations;
+		return;
+	}
+	memset(image + (address & ~(eraseSize - 1)), 0xFF, eraseSize);
+	++blocksErased;
+	readyTime = std::chrono::steady_clock::now() + eraseTime;
+}
+
+
+bool FlashEmulator::Busy()
+{
+	return std::chrono::steady_clock::now() < readyTime;
+}
+
+
+void FlashEmulator::Poll()
+{
+	if (notifyPending && !isSuspended && !Busy()) {
+		notifyPending = false;
+		OperationComplete();
+	}
+}
+
+
+void FlashEmulator::NotifyWhenReady()
+{
+	notifyPending = true;
+}
+
+
+bool FlashEmulator::Suspend()
+{
+	const auto now = std::chrono::steady_clock::now();
+	if (isSuspended || now >= readyTime) {					// Completion pending
+		return false;
+	}
+	// The operation runs on until suspended; the time lost is added to it when resumed
+	const auto latency = std::chrono::microseconds(suspendMicros);
+	const auto suspendTime = std::min(now + latency, readyTime);
+	while (std::chrono::steady_clock::now() < suspendTime) {}
+	suspendWaitMicros += std::chrono::duration_cast<std::chrono::microseconds>(suspendTime - now).count();
+	suspendedTime = readyTime - suspendTime + latency;
+	readyTime = suspendTime;
+	isSuspended = true;
+	return true;
+}
+
+
+void FlashEmulator::Resume()
+{
+	readyTime = std::chrono::steady_clock::now() + suspendedTime;
+	isSuspended = false;
+}
+
+
+uint32_t FlashEmulator::Ticks()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void FlashEmulator::WaitReady()
+{
+	// Commands issued while busy wait for the previous operation as the OctoSPI driver polls the status register first
+	std::this_thread::sleep_until(readyTime);
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "BlockDevice.h"
+#include <chrono>
+
+/* File-backed emulation of the MX25LM51245G flash for off-target builds (Linux only: not compiled for the module).
+Models NOR semantics so FatTools, the MSC handler and the wavetable scanner can be run against image files: programming
+only clears bits, erase sets a 4K block to 0xFF, programs crossing a page boundary wrap to the start of the page, and
+operations take the configured program and erase times (zero to run at full speed). Misuse that the real device would
+not report (reading while busy, wrapped programs, out of range addresses) is counted in violations. Queued writes advance
+when the host build (host/, kishoof-host) calls Poll(), standing in for the status match interrupt. A suspended operation's
+remaining time is held until it is resumed. Each suspend costs the reader the device's suspend latency, and the resumed
+operation takes as long again. The 'emulator' host test checks these semantics.
+*/
+
+class FlashEmulator : public BlockDevice {
+public:
+	static constexpr uint32_t deviceSize = 64 * 1024 * 1024;
+	static constexpr uint32_t suspendMicros = 20;			// Maximum program or erase suspend latency
+
+	FlashEmulator(const uint32_t programMicros = typicalProgramMicros, const uint32_t eraseMicros = typicalEraseMicros);
+	~FlashEmulator();
+	bool Open(const char* path);							// Map image file, creating an erased device if not found
+	void Close();
+
+	const uint8_t* ReadMapped(const uint32_t address) override;
+	void ProgramPage(const uint32_t address, const uint32_t* data, const uint32_t words) override;
+	void EraseBlock(const uint32_t address) override;
+	bool Busy() override;
+	void Poll() override;
+
+	uint32_t pagesProgrammed = 0;
+	uint32_t blocksErased = 0;
+	uint32_t violations = 0;
+	uint32_t suspendWaitMicros = 0;							// Total time readers have waited for suspends
+
+private:
+	const std::chrono::microseconds programTime;
+	const std::chrono::microseconds eraseTime;
+	std::chrono::steady_clock::time_point readyTime;
+	uint8_t* image = nullptr;
+	int file = -1;
+	bool notifyPending = false;
+	bool isSuspended = false;
+	std::chrono::steady_clock::duration suspendedTime;		// Time remaining of suspended operation
+
+	void NotifyWhenReady() override;
+	bool Suspend() override;
+	void Resume() override;
+	uint32_t Ticks() override;
+	void WaitReady();
+};
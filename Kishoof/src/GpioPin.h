@@ -15,7 +15,7 @@ public:
 	static void Init(GPIO_TypeDef* port, const uint32_t pin, const Type pinType, const uint32_t alternateFunction = 0, const DriveStrength driveStrength = DriveStrength::Low)
 	{
 		// maths to calculate RCC clock to enable
-		const uint32_t portPos = ((uint32_t)port - SRD_AHB4PERIPH_BASE) >> 10;
+		const uint32_t portPos = ((uintptr_t)port - SRD_AHB4PERIPH_BASE) >> 10;
 		RCC->AHB4ENR |= (1 << portPos);
 
 		// 00: Input, 01: Output, 10: Alternate function, 11: Analog (reset state)
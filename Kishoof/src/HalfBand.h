@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cmath>
+#include <array>
+#include <cstdint>
+
+/* Polyphase half-band decimator used to bring oversampled warp output back to the output sample rate.
+Kaiser windowed sinc with every even coefficient other than the centre tap zero: the odd input stream is filtered by the
+symmetric non-zero coefficients (folded so each multiply serves two taps) and the even stream only needs the 0.5 centre tap.
+Coefficients are generated at compile time so each filter costs (taps + 1) / 4 multiplies per output sample.
+*/
+
+constexpr double KaiserI0(const double x)				// Power series of the zeroth order modified Bessel function
+{
+	double sum = 1.0, term = 1.0;
+	for (uint32_t i = 1; i < 40; ++i) {
+		term *= (x / 2.0) / i;
+		sum += term * term;
+	}
+	return sum;
+}
+
+template<uint32_t pairs>
+constexpr auto CreateHalfBandCoeffs(const float beta)
+{
+	// Coefficient i is for offsets +/-(2i + 1) from the centre tap
+	std::array<float, pairs> array {};
+	constexpr double pi = 3.14159265358979323846;
+	for (uint32_t i = 0; i < pairs; ++i) {
+		const double offset = (double)(2 * i + 1) / (2 * pairs);
+		const double sinc = ((i & 1) ? -1.0 : 1.0) / (pi * (2 * i + 1));
+		array[i] = sinc * KaiserI0(beta * std::sqrt(1.0 - offset * offset)) / KaiserI0(beta);
+	}
+	return array;
+}
+
+
+template<uint32_t taps, float beta>
+class HalfBandDecimator {
+	static_assert(taps % 4 == 3, "Half-band filter must have 4n - 1 taps");
+	static constexpr uint32_t pairs = (taps + 1) / 4;
+	static constexpr std::array<float, pairs> coeff = CreateHalfBandCoeffs<pairs>(beta);
+
+public:
+	static constexpr float delay = (taps - 1) / 4.0f;	// Group delay in output samples
+
+	float Process(const float x0, const float x1) {
+		// Takes two consecutive input samples and returns one output sample; buffers are written twice to avoid wrapping
+		if (++evenPos == pairs) { evenPos = 0; }
+		even[evenPos] = even[evenPos + pairs] = x0;
+		if (++oddPos == 2 * pairs) { oddPos = 0; }
+		odd[oddPos] = odd[oddPos + 2 * pairs] = x1;
+
+		const float* window = &odd[oddPos + 1];			// Oldest to newest odd samples
+		float out = 0.5f * even[evenPos + 1];			// Centre tap
+		for (uint32_t i = 0; i < pairs; ++i) {
+			out += coeff[i] * (window[pairs - 1 - i] + window[pairs + i]);
+		}
+		return out;
+	}
+
+	void Reset() {
+		even.fill(0.0f);
+		odd.fill(0.0f);
+	}
+
+private:
+	std::array<float, 2 * pairs> even = {};
+	std::array<float, 4 * pairs> odd = {};
+	uint32_t evenPos = 0;
+	uint32_t oddPos = 0;
+};
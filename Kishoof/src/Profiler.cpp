@@ -0,0 +1,43 @@
+#include "Profiler.h"
+#include <cstdio>
+
+Profiler profiler;
+
+#if (PROFILE)
+void Profiler::Print()
+{
+	// Sections are shown as a percentage of the block period, with the average also given per sample
+	const uint32_t sampleBudget = SystemCoreClock / sampleRate;
+	const float budget = sampleBudget * audioBlockSize;
+	printf("Cycles per sample: %lu; per block: %lu\r\n\r\n"
+			"Section        Min      Avg      Max  Avg/smp   Avg %%   Max %%   Histogram from bin n (2^(n-1) to 2^n - 1 cycles)\r\n",
+			sampleBudget, sampleBudget * audioBlockSize);
+
+	for (uint32_t s = 0; s < count; ++s) {
+		// Copy and reset with audio interrupt disabled so statistics are not updated part way through
+		NVIC_DisableIRQ(DMA1_Stream3_IRQn);
+		const Stats copy = stats[s];
+		stats[s] = {};
+		NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+
+		if (copy.events == 0) {
+			printf("%-10s  No data\r\n", sectionNames[s]);
+			continue;
+		}
+
+		const float avg = (float)copy.total / copy.events;
+		printf("%-10s %7lu %8.0f %8lu %8.1f %6.1f%% %6.1f%%  ", sectionNames[s], copy.min, avg, copy.max, avg / audioBlockSize,
+				100.0f * avg / budget, 100.0f * copy.max / budget);
+
+		uint32_t first = 0, last = histogramBins - 1;
+		while (copy.histogram[first] == 0) { ++first; }
+		while (copy.histogram[last] == 0) { --last; }
+		printf("n=%lu:", first);
+		for (uint32_t b = first; b <= last; ++b) {
+			printf(" %lu", copy.histogram[b]);
+		}
+		printf("\r\n");
+	}
+	printf("\r\n");
+}
+#endif
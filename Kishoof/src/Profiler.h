@@ -0,0 +1,68 @@
+#pragma once
+
+#include "initialisation.h"
+#include <bit>
+
+/* Audio interrupt profiler using the DWT cycle counter (enabled in InitDebugTimer).
+The render loop runs as a sequence of block rate stages (control update, then loops over the block for pitch, channel B,
+channel A warp and sample, and output mix/draw): cycles since the previous mark are recorded to each stage once per block
+as min/avg/max and a histogram of power of 2 bins, along with the whole interrupt. The 'perf' command prints and resets the data.
+With PROFILE false the calls compile to nothing so release builds carry no timing overhead in the audio interrupt.
+*/
+
+// Enables audio interrupt profiling and the 'perf' serial command
+#define PROFILE false
+
+class Profiler {
+public:
+	enum Section : uint8_t {control, pitch, channelB, warp, channelA, output, block, count};
+
+	void StartBlock() {
+#if (PROFILE)
+		blockStart = lastMark = DWT->CYCCNT;
+#endif
+	}
+
+	void Record(const Section section) {		// Record cycles since last mark to section
+#if (PROFILE)
+		const uint32_t now = DWT->CYCCNT;
+		stats[section].Add(now - lastMark);
+		lastMark = now;
+#endif
+	}
+
+	void EndBlock() {
+#if (PROFILE)
+		stats[block].Add(DWT->CYCCNT - blockStart);
+#endif
+	}
+
+#if (PROFILE)
+	void Print();								// Print and reset statistics
+
+private:
+	static constexpr uint32_t histogramBins = 20;	// Bin n counts times from 2^(n-1) to 2^n - 1 cycles; last bin holds all longer times
+	static constexpr const char* sectionNames[count] = {"Control", "Pitch", "Channel B", "Warp", "Channel A", "Output", "Block"};
+
+	struct Stats {
+		uint32_t min = UINT32_MAX;
+		uint32_t max = 0;
+		uint64_t total = 0;
+		uint32_t events = 0;
+		uint32_t histogram[histogramBins] = {};
+
+		void Add(const uint32_t cycles) {
+			min = std::min(min, cycles);
+			max = std::max(max, cycles);
+			total += cycles;
+			++events;
+			++histogram[std::min((uint32_t)std::bit_width(cycles), histogramBins - 1)];
+		}
+	} stats[count];
+
+	uint32_t lastMark = 0;
+	uint32_t blockStart = 0;
+#endif
+};
+
+extern Profiler profiler;
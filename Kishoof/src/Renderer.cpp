@@ -0,0 +1,441 @@
+#include "Renderer.h"
+#include "WaveTable.h"
+#include "FatTools.h"
+#include "Calib.h"
+#include <cstring>
+#include <cstdio>
+
+Renderer renderer;
+
+bool Renderer::Render()
+{
+	if (fatTools.noFileSystem) {
+		printf("** No file System **\r\n");
+		return false;
+	}
+
+	fatTools.InvalidateFatFSCache();						// Ensure that the FAT FS cache is updated
+
+	// Load script into memory
+	FIL file;
+	uint32_t bytes;
+	if (f_open(&file, scriptFile, FA_READ) != FR_OK) {
+		printf("Unable to open %s\r\n", scriptFile);
+		return false;
+	}
+	const FRESULT res = f_read(&file, script, maxScriptSize, (unsigned int*)&bytes);
+	f_close(&file);
+	if (res != FR_OK) {
+		printf("Error reading %s\r\n", scriptFile);
+		return false;
+	}
+	script[bytes] = '\0';
+
+	// First pass validates the script and calculates the total render length
+	uint32_t totalSamples = 0;
+	Segment seg;
+	const char* line = script;
+	while (*line != '\0') {
+		if (ParseSegment(line, seg, true)) {
+			totalSamples += seg.samples;
+		}
+	}
+	if (totalSamples == 0) {
+		printf("No segments found in %s\r\n", scriptFile);
+		return false;
+	}
+
+	if (f_open(&file, outputFile, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+		printf("Unable to create %s\r\n", outputFile);
+		return false;
+	}
+	uint8_t header[44];
+	WriteHeader(header, totalSamples);
+	bool written = (f_write(&file, header, sizeof(header), (unsigned int*)&bytes) == FR_OK);
+
+	// Pause audio output and drive the wavetable engine from the script control values
+	NVIC_DisableIRQ(DMA1_Stream3_IRQn);
+	std::fill(audioBuffer, audioBuffer + audioBufferLength, 0);
+
+	ResetControls();
+
+	Segment prev {};
+	float renderTime = 0.0f;								// Render time in microseconds
+	uint32_t chunkPos = 0;
+	line = script;
+
+	while (*line != '\0') {
+		if (!ParseSegment(line, seg, false)) {
+			continue;
+		}
+		if (prev.samples == 0) {
+			prev = seg;										// First segment starts at its own values
+		}
+
+		SetSwitches(seg);
+
+		// Control values are ramped at block rate from the previous segment's values
+		const uint32_t blocks = seg.samples / audioBlockSize;
+		for (uint32_t b = 0; b < blocks; ++b) {
+			SetControls(prev, seg, (float)(b + 1) / blocks);
+
+			float outA[audioBlockSize];
+			float outB[audioBlockSize];
+			StartDebugTimer();
+			wavetable.RenderBlock(outA, outB, audioBlockSize);
+			renderTime += StopDebugTimer();
+
+			for (uint32_t i = 0; i < audioBlockSize; ++i) {
+				renderBuffer[chunkPos++] = outA[i];
+				renderBuffer[chunkPos++] = outB[i];
+			}
+			if (chunkPos == std::size(renderBuffer)) {
+				written &= (f_write(&file, renderBuffer, sizeof(renderBuffer), (unsigned int*)&bytes) == FR_OK && bytes == sizeof(renderBuffer));
+				chunkPos = 0;
+			}
+		}
+		prev = seg;
+	}
+
+	if (chunkPos > 0) {
+		written &= (f_write(&file, renderBuffer, chunkPos * sizeof(float), (unsigned int*)&bytes) == FR_OK && bytes == chunkPos * sizeof(float));
+	}
+	written &= (f_close(&file) == FR_OK);
+
+	wavetable.ResetPlayback(&adc);
+	NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+
+	if (!written) {
+		printf("Error writing %s: drive may be full\r\n", outputFile);
+		return false;
+	}
+
+	const float nsPerSample = renderTime * 1000.0f / totalSamples;
+	printf("Rendered %lu samples to %s in %.1f ms: %.1f ns/sample (%.1f%% of sample period)\r\n",
+			totalSamples, outputFile, renderTime / 1000.0f, nsPerSample, nsPerSample * sampleRate / 1e7f);
+	return true;
+}
+
+
+bool Renderer::Regress(const bool record, const float minSNR, const float maxError)
+{
+	if (fatTools.noFileSystem) {
+		printf("** No file System **\r\n");
+		return false;
+	}
+
+	fatTools.InvalidateFatFSCache();						// Ensure that the FAT FS cache is updated
+
+	FIL file;
+	uint32_t bytes;
+	if (f_open(&file, goldenFile, record ? (FA_CREATE_ALWAYS | FA_WRITE) : FA_READ) != FR_OK) {
+		printf("Unable to open %s\r\n", goldenFile);
+		return false;
+	}
+
+	GoldenHeader header = {{'K', 'G', 'L', 'D'}, regressSamples};
+	if (record) {
+		f_write(&file, &header, sizeof(header), (unsigned int*)&bytes);
+	} else {
+		f_read(&file, &header, sizeof(header), (unsigned int*)&bytes);
+		if (bytes != sizeof(header) || memcmp(header.id, "KGLD", 4) != 0 || header.samples != regressSamples) {
+			printf("%s is not a valid golden file: record with 'regress:record'\r\n", goldenFile);
+			f_close(&file);
+			return false;
+		}
+	}
+
+	// Test wavetables used when recording: default wavetable and the first valid wavetables in the test folder
+	uint32_t tables[maxRegressTables] = {0};
+	uint32_t tableCount = 1;
+	for (uint32_t i = 1; i < wavetable.wavetableCount && tableCount < maxRegressTables; ++i) {
+		if (FindTestWavetable(catalogue.name[i]) == (int32_t)i) {
+			tables[tableCount++] = i;
+		}
+	}
+
+	// Pause audio output and drive the wavetable engine with the test control ramp
+	NVIC_DisableIRQ(DMA1_Stream3_IRQn);
+	std::fill(audioBuffer, audioBuffer + audioBufferLength, 0);
+	const uint32_t oldActiveWaveTable = wavetable.activeWaveTable;
+
+	constexpr uint32_t warpCount = (uint32_t)WaveTable::Warp::count;
+	constexpr uint32_t blocks = regressSamples / audioBlockSize;
+	uint32_t passed = 0, failed = 0, missing = 0, totalSamples = 0;
+	float renderTime = 0.0f;								// Render time in microseconds
+
+	printf("Wavetable Source  Format  Warp     Mode       SNR dB  Max error  Result\r\n");
+
+	for (uint32_t c = 0; ; ++c) {
+		// Record: cases for each table played directly and cached, each warp type, smooth and stepped; compare: cases from file
+		GoldenCase test;
+		int32_t index;
+		if (record) {
+			if (c == tableCount * 2 * warpCount * 2) {
+				break;
+			}
+			index = tables[c / (4 * warpCount)];
+			memcpy(test.wavetable, catalogue.name[index], 8);
+			test.cached = (c / (2 * warpCount)) & 1;
+			test.warp = (c / 2) % warpCount;
+			test.stepped = c & 1;
+		} else {
+			f_read(&file, &test, sizeof(test), (unsigned int*)&bytes);
+			if (bytes != sizeof(test)) {
+				break;
+			}
+			index = FindTestWavetable(test.wavetable);
+		}
+
+		const bool selected = (index >= 0) && SelectWavetable(index, test.cached);
+		if (!selected) {
+			if (!record) {
+				printf("%-9.8s %-7s %-7s %-8s %-8s %9s %10s  Missing\r\n", test.wavetable, test.cached ? "Cache" : "Direct", "",
+						WaveTable::warpNames[test.warp].data(), test.stepped ? "Stepped" : "Smooth", "", "");
+				f_lseek(&file, f_tell(&file) + regressSamples * 2 * sizeof(float));
+				++missing;
+			}
+			continue;										// When recording skip tables that cannot be cached or are fragmented
+		}
+
+		const bool inCache = (wavetable.cacheWaveTable[wavetable.cacheSlot] == (uint32_t)index);
+		test.sampleType = (uint8_t)(inCache ? SampleType::PCM16 : catalogue.Type(index));
+		if (record) {
+			f_write(&file, &test, sizeof(test), (unsigned int*)&bytes);
+		}
+
+		// Control ramp: pitch sweeps five octaves while wavetable positions and warp amount sweep their full range
+		ResetControls();
+		const Segment start = {regressSamples, PitchADC(55.0f), 0.0f, 1.0f, test.warp, 0.0f, (bool)test.stepped, false, false, 1.0f};
+		Segment end = start;
+		end.pitch = PitchADC(1760.0f);
+		end.posA = 1.0f;
+		end.posB = 0.0f;
+		end.warpAmt = 1.0f;
+		SetSwitches(end);
+
+		double signal = 0.0, noise = 0.0;
+		float maxDiff = 0.0f;
+		for (uint32_t b = 0; b < blocks; ++b) {
+			SetControls(start, end, (float)(b + 1) / blocks);
+
+			float outA[audioBlockSize];
+			float outB[audioBlockSize];
+			StartDebugTimer();
+			wavetable.RenderBlock(outA, outB, audioBlockSize);
+			renderTime += StopDebugTimer();
+
+			float* out = renderBuffer;
+			for (uint32_t i = 0; i < audioBlockSize; ++i) {
+				out[i * 2] = outA[i];
+				out[i * 2 + 1] = outB[i];
+			}
+
+			if (record) {
+				f_write(&file, out, audioBlockSize * 2 * sizeof(float), (unsigned int*)&bytes);
+			} else {
+				float* golden = &renderBuffer[audioBlockSize * 2];
+				f_read(&file, golden, audioBlockSize * 2 * sizeof(float), (unsigned int*)&bytes);
+				for (uint32_t i = 0; i < audioBlockSize * 2; ++i) {
+					const float diff = out[i] - golden[i];
+					signal += golden[i] * golden[i];
+					noise += diff * diff;
+					maxDiff = std::max(maxDiff, std::abs(diff));
+				}
+			}
+		}
+		totalSamples += regressSamples;
+
+		const char* sampleType = (test.sampleType == (uint8_t)SampleType::PCM16) ? "PCM16" : "Float32";
+		if (record) {
+			printf("%-9.8s %-7s %-7s %-8s %-8s %9s %10s  Recorded\r\n", test.wavetable, test.cached ? "Cache" : "Direct", sampleType,
+					WaveTable::warpNames[test.warp].data(), test.stepped ? "Stepped" : "Smooth", "", "");
+		} else {
+			const float snr = (noise > 0.0) ? 10.0 * std::log10(signal / noise) : INFINITY;
+			const bool pass = (snr >= minSNR && maxDiff <= maxError);
+			printf("%-9.8s %-7s %-7s %-8s %-8s %9.1f %10.2e  %s\r\n", test.wavetable, test.cached ? "Cache" : "Direct", sampleType,
+					WaveTable::warpNames[test.warp].data(), test.stepped ? "Stepped" : "Smooth", snr, maxDiff, pass ? "Pass" : "FAIL");
+			if (pass) {
+				++passed;
+			} else {
+				++failed;
+			}
+		}
+	}
+	f_close(&file);
+
+	// Restore playback of the active wavetable: cache and mip levels are rebuilt by the main loop
+	wavetable.activeWaveTable = oldActiveWaveTable;
+	wavetable.cacheWaveTable[0] = wavetable.cacheWaveTable[1] = WaveTable::noCache;
+	wavetable.cacheRequest = WaveTable::noCache;
+	wavetable.mipRequest = WaveTable::noMipMap;
+	wavetable.ResetPlayback(&adc);
+	NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+
+	if (!record) {
+		printf("\r\n%lu passed, %lu failed, %lu missing (thresholds: SNR %.1f dB, max error %.2e)\r\n",
+				passed, failed, missing, minSNR, maxError);
+	}
+	if (totalSamples > 0) {
+		const float samplesPerSecond = totalSamples * 1e6f / renderTime;
+		printf("Throughput: %.0f samples/s (%.1f x real time)\r\n", samplesPerSecond, samplesPerSecond / sampleRate);
+	}
+	return totalSamples > 0 && failed == 0 && missing == 0;
+}
+
+
+int32_t Renderer::FindTestWavetable(const char* name)
+{
+	// Return index of the default wavetable or a valid wavetable in the test folder with matching short name
+	if (strncmp(name, catalogue.name[0], 8) == 0) {
+		return 0;
+	}
+	for (uint32_t i = 1; i < wavetable.wavetableCount; ++i) {
+		const uint32_t dir = catalogue.dir[i];
+		if (!catalogue.IsDir(i) && catalogue.invalid[i] == Catalogue::OK && strncmp(name, catalogue.name[i], 8) == 0 &&
+				catalogue.IsDir(dir) && strncmp(catalogue.name[dir], regressDir, 8) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+bool Renderer::SelectWavetable(const uint32_t index, const bool cached)
+{
+	// Make wavetable active, either decoded to the PCM16 cache or played directly, then build mip levels from the playback data
+	wavetable.activeWaveTable = index;
+	wavetable.cacheWaveTable[0] = wavetable.cacheWaveTable[1] = WaveTable::noCache;
+	wavetable.cacheRequest = index;
+
+	// Cache decode and mip level builds are skipped while flash is being written (eg by recording the golden file)
+	const uint32_t start = SysTickVal;
+	while (fatTools.Busy() && SysTickVal - start < 1000) {}
+
+	if (cached) {
+		wavetable.cacheRequest = WaveTable::noCache;
+		wavetable.UpdateCache();
+		if (wavetable.cacheWaveTable[wavetable.cacheSlot] != index) {
+			return false;
+		}
+	} else if (catalogue.IsFragmented(index)) {
+		return false;
+	}
+
+	wavetable.mipRequest = WaveTable::noMipMap;
+	wavetable.UpdateMipMaps();
+	return true;
+}
+
+
+bool Renderer::ParseSegment(const char*& line, Segment& seg, const bool report)
+{
+	// Parse one script line, advancing to the start of the next line; returns false for comments, blank or invalid lines
+	const char* end = line + std::strcspn(line, "\r\n");
+	const char* next = end + std::strspn(end, "\r\n");
+	char* pos;
+
+	bool valid = (*line != '#');
+	if (valid) {
+		const float ms = std::strtof(line, &pos);
+		valid = (pos != line && pos <= end && ms > 0.0f);
+		if (valid) {
+			const float hz = std::strtof(pos, &pos);
+			seg.posA = std::clamp(std::strtof(pos, &pos), 0.0f, 1.0f);
+			seg.posB = std::clamp(std::strtof(pos, &pos), 0.0f, 1.0f);
+			seg.warp = std::min((uint32_t)std::strtoul(pos, &pos, 10), (uint32_t)WaveTable::Warp::count - 1);
+			seg.warpAmt = std::clamp(std::strtof(pos, &pos), 0.0f, 1.0f);
+			valid = (pos <= end && hz > 0.0f);
+
+			// Round length up to a whole number of blocks
+			seg.samples = ((uint32_t)(ms * sampleRate / 1000.0f) + audioBlockSize - 1) & ~(audioBlockSize - 1);
+
+			seg.pitch = PitchADC(hz);
+
+			seg.stepped = seg.mix = seg.ringMod = false;
+			seg.octave = 1.0f;
+			for (; pos < end; ++pos) {
+				switch (*pos) {
+					case 'S': seg.stepped = true; break;
+					case 'M': seg.mix = true; break;
+					case 'R': seg.ringMod = true; break;
+					case 'U': seg.octave = 2.0f; break;
+					case 'D': seg.octave = 0.5f; break;
+				}
+			}
+		}
+	}
+
+	if (report && !valid && *line != '#' && line != end) {
+		printf("Invalid script line: %.*s\r\n", (int)(end - line), line);
+	}
+	line = next;
+	return valid;
+}
+
+
+float Renderer::PitchADC(const float hz)
+{
+	// Convert frequency to pitch ADC value using calibration: inc = pitchBase * 2 ^ (adc * pitchMult)
+	const float inc = hz * 2048.0f / sampleRate;
+	return std::clamp(std::log2(inc / calib.cfg.pitchBase) / calib.cfg.pitchMult, 0.0f, 65535.0f);
+}
+
+
+void Renderer::ResetControls()
+{
+	controls.WarpCV = 65535;								// CV inputs set to maximum so only pot values are used
+	controls.WavetablePosA_CV = 65535;
+	controls.WavetablePosB_CV = 65535;
+	controls.Warp_Amt_Trm = 0;
+	controls.Wavetable_Pos_A_Trm = 0;
+	wavetable.ResetPlayback(&controls);
+}
+
+
+void Renderer::SetSwitches(const Segment& seg)
+{
+	// Warp type and switches are set at the start of a segment
+	wavetable.stepped = seg.stepped;
+	wavetable.octave = seg.octave;
+	wavetable.mixChnB = seg.mix;
+	wavetable.ringModChnB = seg.ringMod && !seg.mix;
+	controls.Warp_Type_Pot = (seg.warp * 65536 + 32768) / (uint32_t)WaveTable::Warp::count;
+}
+
+
+void Renderer::SetControls(const Segment& prev, const Segment& seg, const float ramp)
+{
+	controls.Pitch_CV = (uint16_t)std::lerp(prev.pitch, seg.pitch, ramp);
+	controls.Wavetable_Pos_A_Pot = (uint16_t)(65535.0f * std::lerp(prev.posA, seg.posA, ramp));
+	controls.Wavetable_Pos_B_Pot = (uint16_t)(65535.0f * std::lerp(prev.posB, seg.posB, ramp));
+	controls.Warp_Amt_Pot = (uint16_t)(65535.0f * std::lerp(prev.warpAmt, seg.warpAmt, ramp));
+}
+
+
+void Renderer::WriteHeader(uint8_t* header, const uint32_t samples)
+{
+	// 44 byte wav header for stereo 32 bit float
+	const uint32_t dataSize = samples * 2 * sizeof(float);
+	const uint32_t riffSize = dataSize + 36;
+	const uint32_t fmtSize = 16;
+	const uint16_t format = 3;								// IEEE float
+	const uint16_t channels = 2;
+	const uint32_t rate = sampleRate;
+	const uint32_t byteRate = sampleRate * 2 * sizeof(float);
+	const uint16_t blockAlign = 2 * sizeof(float);
+	const uint16_t bitDepth = 32;
+
+	memcpy(&header[0],  "RIFF", 4);
+	memcpy(&header[4],  &riffSize, 4);
+	memcpy(&header[8],  "WAVEfmt ", 8);
+	memcpy(&header[16], &fmtSize, 4);
+	memcpy(&header[20], &format, 2);
+	memcpy(&header[22], &channels, 2);
+	memcpy(&header[24], &rate, 4);
+	memcpy(&header[28], &byteRate, 4);
+	memcpy(&header[32], &blockAlign, 2);
+	memcpy(&header[34], &bitDepth, 2);
+	memcpy(&header[36], "data", 4);
+	memcpy(&header[40], &dataSize, 4);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "initialisation.h"
+
+/* Offline renderer: plays a control script stored on the flash drive through the wavetable engine and writes
+the output to a 32 bit float stereo wav file, reporting the time taken to render each sample.
+
+Script (RENDER.TXT in root directory) - one segment per line, lines starting with '#' are ignored:
+	ms  pitch  posA  posB  warp  amount  [flags]
+
+ms       Duration of segment in milliseconds
+pitch    Frequency in Hz
+posA/B   Wavetable position of channel A and B (0.0 - 1.0)
+warp     Warp type (0 none, 1 squeeze, 2 bend, 3 mirror, 4 tzfm)
+amount   Warp amount (0.0 - 1.0)
+flags    Optional switch settings: S = stepped, M = channel B mix, R = channel B ring mod, U = octave up, D = octave down
+
+Pitch, positions and warp amount ramp from the previous segment's values; warp type and switches change at the start of the segment
+
+Regression suite: renders a fixed ramp of pitch, wavetable positions and warp amount for every warp type in smooth and stepped
+mode, playing each test wavetable both in its own sample format and from the PCM16 RAM cache. Test wavetables are the default
+wavetable plus any in the REGRESS folder. Renders are recorded to GOLDEN.BIN ('regress:record') and later runs are compared
+against them, failing cases whose SNR or maximum sample error exceed the thresholds, or whose wavetable is missing. Render
+throughput is reported with the results. The host build runs the suite against reference wavetables and golden renders checked
+in to host/regress ('make test'); goldens recorded on the module are kept on its drive as they depend on the compiler.
+*/
+
+class Renderer {
+public:
+	bool Render();									// Render RENDER.TXT to RENDER.WAV: false on error
+	bool Regress(const bool record, const float minSNR, const float maxError);	// Compare test renders with GOLDEN.BIN (or record): false on failure
+
+	static constexpr float defaultMinSNR = 100.0f;	// Regression pass thresholds: SNR in dB and maximum absolute sample error
+	static constexpr float defaultMaxError = 0.0001f;
+
+private:
+	static constexpr const char* scriptFile = "RENDER.TXT";
+	static constexpr const char* outputFile = "RENDER.WAV";
+	static constexpr uint32_t maxScriptSize = 4096;
+	static constexpr uint32_t chunkBlocks = 16;		// Blocks rendered between file writes (16 x 32 samples x 2 channels x 4 bytes = 4096 bytes)
+	static constexpr const char* goldenFile = "GOLDEN.BIN";
+	static constexpr char regressDir[8] = {'R', 'E', 'G', 'R', 'E', 'S', 'S', ' '};	// Short name of folder holding test wavetables
+	static constexpr uint32_t regressSamples = 4096;	// Samples per test case
+	static constexpr uint32_t maxRegressTables = 4;		// Default wavetable and first three in test folder
+
+	struct Segment {
+		uint32_t samples;
+		float pitch;								// Pitch as ADC value to match calibration
+		float posA;
+		float posB;
+		uint32_t warp;
+		float warpAmt;
+		bool stepped;
+		bool mix;
+		bool ringMod;
+		float octave;
+	};
+
+	// Golden file: header followed by each test case's description and its interleaved stereo float samples
+	struct GoldenHeader {
+		char id[4];
+		uint32_t samples;							// Samples per test case
+	};
+
+	struct GoldenCase {
+		char wavetable[8];							// Short name of wavetable
+		uint8_t cached;								// Played from PCM16 RAM cache rather than in its own format
+		uint8_t warp;
+		uint8_t stepped;
+		uint8_t sampleType;							// For reporting only
+	};
+
+	bool ParseSegment(const char*& line, Segment& seg, const bool report);
+	float PitchADC(const float hz);
+	void ResetControls();
+	void SetSwitches(const Segment& seg);
+	void SetControls(const Segment& prev, const Segment& seg, const float ramp);
+	int32_t FindTestWavetable(const char* name);
+	bool SelectWavetable(const uint32_t index, const bool cached);
+	void WriteHeader(uint8_t* header, const uint32_t samples);
+
+	ADCValues controls;								// Control values passed to the wavetable engine in place of the ADC
+	char script[maxScriptSize + 1];
+	float renderBuffer[chunkBlocks * audioBlockSize * 2];
+};
+
+extern Renderer renderer;
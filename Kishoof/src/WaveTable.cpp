@@ -1,8 +1,12 @@
 #include "WaveTable.h"
 #include "Filter.h"
 #include "Calib.h"
+#include "Profiler.h"
+#include "USB.h"
 
 #include <cstring>
+#include <cstddef>
+#include <bit>
 
 WaveTable wavetable;
 
@@ -15,12 +19,13 @@ uint32_t flashBusy = 0;
 extern bool vcaConnected;			// Temporary hack as current hardware does not have VCA normalled correctly
 
 
-void WaveTable::CalcSample()
+void WaveTable::OutputBlock(int32_t* outBuffer)
 {
-	if (fatTools.Busy()) {
-		SPI2->TXDR = (int32_t)0;
-		SPI2->TXDR = (int32_t)0;
-		++flashBusy;
+	// Fragmented wavetables can only be played once assembled in the cache. Flash writes in progress are suspended if possible
+	const bool cached = (cacheWaveTable[cacheSlot] == activeWaveTable);
+	if (!cached && (catalogue.IsFragmented(activeWaveTable) || !fatTools.AcquireRead())) {
+		std::fill(outBuffer, outBuffer + audioBlockSize * 2, 0);
+		flashBusy += audioBlockSize;
 		debugPin1.SetLow();		// Debug
 		debugPin2.SetHigh();	// Debug
 		return;
@@ -28,78 +33,177 @@ void WaveTable::CalcSample()
 	debugPin1.SetHigh();		// Debug
 	debugPin2.SetLow();			// Debug
 
-
-	// If crossfading (when switching warp type) blend from old sample to new sample
-	if (crossfade > 0.0f) {
-		outputSamples[0] = crossfade * oldOutputSamples[0] + (1.0f - crossfade) * outputSamples[0];
-		outputSamples[1] = crossfade * oldOutputSamples[1] + (1.0f - crossfade) * outputSamples[1];
-		crossfade -= 0.001f;
+	// Switch positions are read once per block
+	stepped = modeSwitch.IsLow();
+	octave = octaveUp.IsHigh() ? 2.0f : octaveDown.IsHigh() ? 0.5f : 1.0f;
+	mixChnB = chBMix.IsHigh();
+	ringModChnB = !mixChnB && chBRingMod.IsHigh();
+
+	float outA[audioBlockSize];
+	float outB[audioBlockSize];
+	RenderBlock(outA, outB, audioBlockSize);
+	if (!cached) {
+		fatTools.ReleaseRead();
 	}
 
-
-	// Previously calculated samples output at beginning of interrupt to keep timing independent of calculation time
+	// Convert to interleaved 32 bit integers for I2S
 	if (vcaConnected) {
-		const float vcaMult = std::max(60000.0f - adc.VcaCV, 0.0f);
-		SPI2->TXDR = (int32_t)(outputSamples[0] * scaleVCAOutput * vcaMult);
-		SPI2->TXDR = (int32_t)(outputSamples[1] * scaleVCAOutput * vcaMult);
+		for (uint32_t i = 0; i < audioBlockSize; ++i) {
+			const float vcaMult = std::max(60000.0f - adc.VcaCV, 0.0f);
+			outBuffer[i * 2]     = (int32_t)(outA[i] * scaleVCAOutput * vcaMult);
+			outBuffer[i * 2 + 1] = (int32_t)(outB[i] * scaleVCAOutput * vcaMult);
+		}
 	} else {
-		SPI2->TXDR = (int32_t)(outputSamples[0] * scaleOutput);
-		SPI2->TXDR = (int32_t)(outputSamples[1] * scaleOutput);
+		for (uint32_t i = 0; i < audioBlockSize; ++i) {
+			outBuffer[i * 2]     = (int32_t)(outA[i] * scaleOutput);
+			outBuffer[i * 2 + 1] = (int32_t)(outB[i] * scaleOutput);
+		}
 	}
 
-	// Pitch calculations
-	const float octave = octaveUp.IsHigh() ? 2.0f : octaveDown.IsHigh() ? 0.5 : 1.0f;
-	const float newInc = calib.cfg.pitchBase * std::pow(2.0f, (float)adc.Pitch_CV * calib.cfg.pitchMult) * octave;			// for cycle length matching sample rate (48k)
-	smoothedInc = 0.99 * smoothedInc + 0.01 * newInc;
+	debugPin1.SetLow();			// Debug off
+}
 
-	// Increment the read position for each channel; pitch inc will be used in filter to set anti-aliasing cutoff frequency
-	pitchInc[0] = smoothedInc;
-	readPos[0] += smoothedInc;
-	if (readPos[0] >= 2048.0f) { readPos[0] -= 2048.0f; }
 
-	pitchInc[1] = smoothedInc * (cfg.octaveChnB ? 0.5f : 1.0f) * (cfg.warpButton ? -1.0f : 1.0f);
-	readPos[1] += pitchInc[1];
-	if (readPos[1] >= 2048.0f) { readPos[1] -= 2048.0f; }
-	if (readPos[1] < 0.0f) { readPos[1] += 2048.0f; }
+void WaveTable::RenderBlock(float* outA, float* outB, const size_t n)
+{
+	// Each stage of the oscillator runs over the whole block in a loop specialised at compile time for the sample type, frame
+	// length, stepped mode or warp type. Loops are selected once per block so no kernel is called indirectly per sample, and
+	// templating the stages separately keeps the number of instantiations to the sum rather than the product of the options
+	// Sample loops indexed by [frame size][PCM16][stepped] with frame sizes doubling from minFrameSize
+	static constexpr auto sampleLoops = []<size_t... i>(std::index_sequence<i...>) {
+		using Loops = std::array<std::array<SampleLoop, 2>, 2>;
+		return std::array<Loops, sizeof...(i)> {Loops {{
+			{&WaveTable::OutputSamples<SampleType::Float32, false, (minFrameSize << i)>, &WaveTable::OutputSamples<SampleType::Float32, true, (minFrameSize << i)>},
+			{&WaveTable::OutputSamples<SampleType::PCM16, false, (minFrameSize << i)>, &WaveTable::OutputSamples<SampleType::PCM16, true, (minFrameSize << i)>}
+		}}...};
+	}(std::make_index_sequence<frameSizeCount>());
+	static constexpr WarpLoop warpLoops[] = {
+		&WaveTable::WarpSamples<Warp::none>, &WaveTable::WarpSamples<Warp::squeeze>, &WaveTable::WarpSamples<Warp::bend>,
+		&WaveTable::WarpSamples<Warp::mirror>, &WaveTable::WarpSamples<Warp::tzfm>
+	};
+
+	profiler.StartBlock();
+	UpdateControls(n);
+	UpdateAdditive(n);
+	UpdateOversampling();
+	const Wav wav = PlaybackWav(activeWaveTable);
+	const bool pcm16 = (wav.sampleType == SampleType::PCM16);
+	const uint32_t frameSizeIndex = std::countr_zero((uint32_t)wav.frameSize) - std::countr_zero(minFrameSize);
+	const bool mute = (wav.invalid != Invalid::OK);			// Active wavetable found corrupt when decoding to the cache
+	const SampleLoop outputSamplesA = mute ? &WaveTable::MuteSamples : sampleLoops[frameSizeIndex][pcm16][stepped];
+	const SampleLoop outputSamplesB = mute ? &WaveTable::MuteSamples : sampleLoops[frameSizeIndex][pcm16][true];	// Channel B only plays the wavetable in stepped mode
+	if (outputSamplesA != sampleLoop) {
+		sampleLoop = outputSamplesA;
+		crossfade = 1.0f;					// Crossfade when switching between stepped and smooth mode or sample type
+	}
+
+	// If channel A is affected by channel B (TZFM with octave down) use channel B's position to draw waveform
+	const uint32_t drawPosChn = (warpType == Warp::tzfm && cfg.octaveChnB) ? 1 : 0;
+	profiler.Record(Profiler::control);
+
+
+	// Ramp pitch towards the block rate target and increment the read position for each channel; pitch inc will be used in
+	// filter to set anti-aliasing cutoff frequency
+	float incA[audioBlockSize], incB[audioBlockSize];
+	float posA[audioBlockSize], posB[audioBlockSize];
+	const float chnBMult = (cfg.octaveChnB ? 0.5f : 1.0f) * (cfg.warpButton ? -1.0f : 1.0f);
+	for (size_t s = 0; s < n; ++s) {
+		incA[s] = smoothedInc.Next();
+		readPos[0] += incA[s];
+		if (readPos[0] >= 2048.0f) { readPos[0] -= 2048.0f; }
+		posA[s] = readPos[0];
+
+		incB[s] = incA[s] * chnBMult;
+		readPos[1] += incB[s];
+		if (readPos[1] >= 2048.0f) { readPos[1] -= 2048.0f; }
+		if (readPos[1] < 0.0f) { readPos[1] += 2048.0f; }
+		posB[s] = readPos[1];
+	}
+	profiler.Record(Profiler::pitch);
 
 
 	// Generate channel B output first as used in TZFM to alter channel A read position
-	stepped = modeSwitch.IsLow();
+	float chnB[audioBlockSize];
 	if (stepped) {
-		OutputSample(1, readPos[1]);
+		(this->*outputSamplesB)(wav, 1, posB, incB, chnB, n, 1);
 	} else {
-		AdditiveWave();
+		for (size_t s = 0; s < n; ++s) {
+			wavetablePos[1].pos.Next();
+			chnB[s] = AdditiveWave(posB[s]);
+		}
 	}
-	const float adjReadPos = CalcWarp();
-	OutputSample(0, adjReadPos);
-
-
-	// Apply mix/ring mod to channel B
-	if (chBMix.IsHigh()) {
-		outputSamples[1] = FastTanh(outputSamples[0] + outputSamples[1]);
-	} else 	if (chBRingMod.IsHigh()) {
-		outputSamples[1] = FastTanh(outputSamples[0] * outputSamples[1]);
+	float modulator = prevModulator;
+	for (size_t s = 0; s < n; ++s) {
+		modulatorSlope = std::max(modulatorSlope, std::abs(chnB[s] - modulator));
+		modulator = chnB[s];
 	}
+	profiler.Record(Profiler::channelB);
 
-	if (crossfade <= 0.0f) {
-		oldOutputSamples[0] = FastTanh(outputSamples[0]);
-		oldOutputSamples[1] = FastTanh(outputSamples[1]);
-	}
+	float chnA[audioBlockSize];
+	OutputChannelA(wav, outputSamplesA, warpLoops[(uint32_t)warpType], posA, incA, chnB, chnA, n);
 
 
-	// Enter sample in draw table to enable LCD update: If channel A is affected by channel B (TZFM with octave down) Use channel B's position to draw waveform
-	const uint32_t drawPosChn = (warpType == Warp::tzfm && cfg.octaveChnB) ? 1 : 0;
+	// Output stage: mix, crossfade and draw
+	for (size_t s = 0; s < n; ++s) {
+		// Apply mix/ring mod to channel B
+		float sampleB = chnB[s];
+		if (mixChnB) {
+			sampleB = FastTanh(chnA[s] + sampleB);
+		} else 	if (ringModChnB) {
+			sampleB = FastTanh(chnA[s] * sampleB);
+		}
 
-	const uint8_t drawPos0 = (uint8_t)std::round(readPos[drawPosChn] * drawWidthMult);		// convert from position in 2048 sample wavetable to draw width
-	drawData[0][drawPos0] = (uint8_t)((1.0f - outputSamples[0]) * drawHeightMult);
+		// If crossfading (when switching warp type) blend from old sample to new sample
+		if (crossfade > 0.0f) {
+			outA[s] = crossfade * oldOutputSamples[0] + (1.0f - crossfade) * chnA[s];
+			outB[s] = crossfade * oldOutputSamples[1] + (1.0f - crossfade) * sampleB;
+			crossfade -= 0.001f;
+		} else {
+			outA[s] = chnA[s];
+			outB[s] = sampleB;
+			oldOutputSamples[0] = FastTanh(chnA[s]);
+			oldOutputSamples[1] = FastTanh(sampleB);
+		}
+
+		// Enter sample in draw table to enable LCD update
+		const uint8_t drawPos0 = (uint8_t)std::round((drawPosChn ? posB[s] : posA[s]) * drawWidthMult);	// convert from position in 2048 sample wavetable to draw width
+		drawData[0][drawPos0] = (uint8_t)((1.0f - chnA[s]) * drawHeightMult);
 
-	uint8_t drawPos1 = (uint8_t)std::round(readPos[1] * drawWidthMult);
-	if (cfg.warpButton) {
-		drawPos1 = 199 - drawPos1;				// Invert channel B
+		uint8_t drawPos1 = (uint8_t)std::round(posB[s] * drawWidthMult);
+		if (cfg.warpButton) {
+			drawPos1 = 199 - drawPos1;				// Invert channel B
+		}
+		drawData[1][drawPos1] = (uint8_t)((1.0f - sampleB) * drawHeightMult);
 	}
-	drawData[1][drawPos1] = (uint8_t)((1.0f - outputSamples[1]) * drawHeightMult);
+	profiler.Record(Profiler::output);
+	profiler.EndBlock();
+}
 
-	debugPin1.SetLow();			// Debug off
+
+void WaveTable::ResetPlayback(const volatile ADCValues* source)
+{
+	// Clear oscillator and smoothing state so that renders from a control script are repeatable
+	controls = source;
+	readPos[0] = 0.0f;
+	readPos[1] = 0.0f;
+	smoothedInc = {};
+	warpAmt = {};
+	warpTypeVal = 0;
+	warpType = Warp::none;
+	crossfade = 0.0f;
+	outputSamples[0] = outputSamples[1] = 0.0f;
+	oldOutputSamples[0] = oldOutputSamples[1] = 0.0f;
+	wavetablePos[0].pos = {};
+	wavetablePos[1].pos = {};
+	std::fill(std::begin(harmonicLevel), std::end(harmonicLevel), 0.0f);
+	std::fill(std::begin(harmonicDelta), std::end(harmonicDelta), 0.0f);
+	activeHarmonics = 0;
+	sampleLoop = nullptr;						// First block fades in from silence
+	oversample = 1;
+	decimator2x.Reset();
+	decimator4x.Reset();
+	prevModulator = 0.0f;
+	modulatorSlope = 0.0f;
 }
 
 
@@ -107,76 +211,426 @@ float WaveTable::QuantisedWavetablePos(const uint8_t chn)
 {
 	// For drawing wavetable position: return quantised x position of current wavetable
 	if (!stepped) {
-		return wavetablePos[chn].pos;
+		return wavetablePos[chn].pos.val;
 	} else if (chn == 1) {
-		return std::round(wavetablePos[chn].pos * harmonicSets) / (float)harmonicSets;
+		return std::round(wavetablePos[chn].pos.val * harmonicSets) / (float)harmonicSets;
 	} else {
-		return std::round(wavetablePos[chn].pos * wavList[activeWaveTable].tableCount) / (float)wavList[activeWaveTable].tableCount;
+		return std::round(wavetablePos[chn].pos.val * catalogue.tableCount[activeWaveTable]) / (float)catalogue.tableCount[activeWaveTable];
 	}
 }
 
-inline void WaveTable::OutputSample(const uint8_t chn, const float readPos)
+template<SampleType sampleType, bool steppedMode, uint32_t frameSize>
+inline void WaveTable::OutputSample(const Wav& wav, const uint8_t chn, const float readPos)
 {
+	// Read position and pitch increment are scaled from the 2048 sample range used by the oscillator to the frame length
+	using T = std::conditional_t<sampleType == SampleType::PCM16, int16_t, float>;
+	constexpr float scale = (sampleType == SampleType::PCM16) ? 1.0f / 32768.0f : 1.0f;
+	constexpr float frameScale = (float)frameSize / defaultFrameSize;
+
 	// Get location of current wavetable frame in wavetable
-	const Wav wav = wavList[activeWaveTable];
-	const float pos = std::clamp(wavetablePos[chn].Val() * (wavList[activeWaveTable].tableCount - 1), 0.0f, (float)(wavList[activeWaveTable].tableCount - 1));
-	const uint32_t sampleOffset = 2048 * (stepped ? std::round(pos) : std::floor(pos));			// get sample position of wavetable frame
-
-	// Interpolate between samples
-	const float ratio = readPos - (uint32_t)readPos;
-	if (wav.sampleType == SampleType::Float32) {
-		outputSamples[chn] = filter.CalcInterpolatedFilter((uint32_t)readPos, (float*)wav.startAddr + sampleOffset, ratio, pitchInc[chn]);
-	} else if (wav.sampleType == SampleType::PCM16) {
-		outputSamples[chn] = filter.CalcInterpolatedFilter((uint32_t)readPos, (int16_t*)wav.startAddr + sampleOffset, ratio, pitchInc[chn]) * (1.0 / 32768.0f);
-	}
-
-	// Interpolate between wavetables if channel A
-	if (!stepped && chn == 0) {
-		const float wtRatio = pos - (uint32_t)pos;
-		if (wtRatio > 0.0001f) {
-			float outputSample2;
+	const float pos = std::clamp(wavetablePos[chn].pos.val * (wav.tableCount - 1), 0.0f, (float)(wav.tableCount - 1));
+	const uint32_t frame = steppedMode ? std::round(pos) : std::floor(pos);
+	const T* frameData = (const T*)wav.startAddr + frameSize * frame;		// get sample position of wavetable frame
+
+	// If band-limited mip levels are available use these in place of the anti-aliasing filter
+	if constexpr (frameSize <= defaultFrameSize) {
+		if (mipWaveTable == activeWaveTable) {
+			float mipReadPos = readPos - Filter::firDelay / frameScale;		// Delay to match latency of filter so switching is seamless
+			if (mipReadPos < 0.0f) { mipReadPos += defaultFrameSize; }
+
+			outputSamples[chn] = MipSample<sampleType, frameSize>(wav, frame, mipReadPos, pitchInc[chn]);
+			if (!steppedMode && chn == 0) {
+				const float wtRatio = pos - frame;
+				if (wtRatio > 0.0001f) {
+					outputSamples[0] = std::lerp(outputSamples[0], MipSample<sampleType, frameSize>(wav, frame + 1, mipReadPos, pitchInc[0]), wtRatio);
+				}
+			}
+			return;
+		}
+	}
+
+	// Interpolate between samples; if channel A also interpolate between wavetable frames in the same filter pass
+	const float framePos = readPos * frameScale;
+	const float ratio = framePos - (uint32_t)framePos;
+	const float wtRatio = (!steppedMode && chn == 0) ? pos - frame : 0.0f;
+	if (wtRatio > 0.0001f) {
+		outputSamples[0] = filter.CalcInterpolatedFilter2D<frameSize>((uint32_t)framePos, frameData, frameData + frameSize, ratio, wtRatio, pitchInc[0] * frameScale) * scale;
+	} else {
+		outputSamples[chn] = filter.CalcInterpolatedFilter<frameSize>((uint32_t)framePos, frameData, ratio, pitchInc[chn] * frameScale) * scale;
+	}
+}
+
+
+template<SampleType sampleType, bool steppedMode, uint32_t frameSize>
+void WaveTable::OutputSamples(const Wav& wav, const uint8_t chn, const float* readPos, const float* inc, float* out, const size_t n, const uint32_t step)
+{
+	// Sample loop for one channel: wavetable position is ramped once per output sample, so every step samples when oversampled
+	for (size_t s = 0; s < n; s += step) {
+		wavetablePos[chn].pos.Next();
+		for (size_t i = s; i < s + step; ++i) {
+			pitchInc[chn] = inc[i];
+			OutputSample<sampleType, steppedMode, frameSize>(wav, chn, readPos[i]);
+			out[i] = outputSamples[chn];
+		}
+	}
+}
+
+
+void WaveTable::MuteSamples(const Wav&, const uint8_t, const float*, const float*, float* out, const size_t n, const uint32_t)
+{
+	// Sample loop for a wavetable found corrupt when decoding to the cache: other parameters only match the SampleLoop signature
+	std::fill(out, out + n, 0.0f);
+}
+
+
+template<SampleType sampleType, uint32_t frameSize>
+inline float WaveTable::MipSample(const Wav& wav, const uint32_t frame, const float readPos, const float pitchInc)
+{
+	// Level n is alias free for increments up to 2^n (level 0 is the source wavetable). With 2^octave <= pitchInc < 2^(octave + 1)
+	// blend levels octave + 1 and octave + 2, which are both alias free, so harmonics fade out an octave before reaching nyquist
+	const uint32_t incBits = std::bit_cast<uint32_t>(std::abs(pitchInc));
+	const int32_t octave = (int32_t)(incBits >> 23) - 127;				// Exponent of float gives integer part of log2(pitchInc)
+	if (octave < -1) {
+		return SourceSample<sampleType, frameSize>(wav, frame, readPos);
+	}
+	if (octave >= (int32_t)mipLevels - 1) {
+		return MipLevelSample(frame, mipLevels, readPos);				// Aliases above an increment of 2^mipLevels
+	}
+	const float blend = (incBits & 0x7FFFFF) * (1.0f / 8388608.0f);	// Mantissa approximates fractional part of log2(pitchInc)
+	const float lower = (octave < 0) ? SourceSample<sampleType, frameSize>(wav, frame, readPos) : MipLevelSample(frame, octave + 1, readPos);
+	return std::lerp(lower, MipLevelSample(frame, octave + 2, readPos), blend);
+}
+
+
+inline float WaveTable::MipLevelSample(const uint32_t frame, const uint32_t level, const float readPos)
+{
+	const uint32_t size = 4096 >> level;
+	const int16_t* levelData = &mipBuffer[frame * mipFrameSize + 4096 - (size << 1)];
+	return filter.CalcCubic(levelData, readPos * size * (1.0f / 2048.0f), size - 1) * mipScale;
+}
+
+
+template<SampleType sampleType, uint32_t frameSize>
+inline float WaveTable::SourceSample(const Wav& wav, const uint32_t frame, const float readPos)
+{
+	constexpr float frameScale = (float)frameSize / defaultFrameSize;
+	if constexpr (sampleType == SampleType::PCM16) {
+		return filter.CalcCubic((int16_t*)wav.startAddr + frameSize * frame, readPos * frameScale, frameSize - 1) * (1.0f / 32768.0f);
+	} else {
+		return filter.CalcCubic((float*)wav.startAddr + frameSize * frame, readPos * frameScale, frameSize - 1);
+	}
+}
+
+
+inline WaveTable::Wav WaveTable::PlaybackWav(const uint32_t index)
+{
+	// Returns the cached copy of the wavetable if decoded, otherwise the wavetable in flash
+	const uint32_t slot = cacheSlot;
+	return (cacheWaveTable[slot] == index) ? cacheWav[slot] : catalogue.Get(index);
+}
+
+
+void WaveTable::UpdateCache()
+{
+	// Called from main loop: decode active wavetable into the cache slot not being played and swap it in when complete
+	if (cacheRequest == activeWaveTable || fatTools.Busy()) {
+		return;
+	}
+	const uint32_t request = activeWaveTable;
+	cacheRequest = request;
+
+	const Wav wav = catalogue.Get(request);
+	if (wav.isDir || wav.invalid != Invalid::OK || wav.tableCount * wav.frameSize > cacheSamples) {
+		return;
+	}
+
+	const uint32_t slot = cacheSlot ^ 1;
+	cacheWaveTable[slot] = noCache;
+	const uint32_t loadStart = SysTickVal;
+
+	// Scatter-gather load: follow the FAT cluster chain so fragmented files are assembled in order (contiguous files take the same path)
+	int16_t* buffer = cacheBuffer[slot];
+	const uint8_t* src = wav.startAddr;
+	uint32_t cluster = wav.cluster;
+	const uint32_t byteDepth = (wav.sampleType == SampleType::Float32) ? 4 : 2;
+	uint32_t remaining = wav.tableCount * wav.frameSize;
+	uint32_t clusterSamples = remaining;						// Built-in wavetable is held contiguously in RAM
+
+	if (cluster != 0) {
+		// Start address is calculated from the header's cluster, so first walk the chain to the cluster holding the start of the data
+		uint32_t offset = wav.startAddr - fatTools.GetClusterAddr(cluster, true);
+		while (offset >= fatClusterSize) {
+			cluster = fatTools.clusterChain[cluster];
+			if (cluster < 2 || cluster >= fatMaxCluster) {
+				BrokenChain(request);
+				return;
+			}
+			offset -= fatClusterSize;
+		}
+		src = fatTools.GetClusterAddr(cluster, true) + offset;
+		clusterSamples = (fatClusterSize - offset) / byteDepth;
+	}
+
+	while (remaining > 0) {
+		const uint32_t samples = std::min(clusterSamples, remaining);
+		if (wav.sampleType == SampleType::Float32) {
+			for (uint32_t i = 0; i < samples; ++i) {
+				buffer[i] = (int16_t)std::clamp(std::round(((float*)src)[i] * 32768.0f), -32768.0f, 32767.0f);
+			}
+		} else {
+			memcpy(buffer, src, samples * sizeof(int16_t));
+		}
+		buffer += samples;
+		remaining -= samples;
+
+		if (remaining > 0) {
+			cluster = fatTools.clusterChain[cluster];
+			if (cluster < 2 || cluster >= fatMaxCluster) {
+				BrokenChain(request);
+				return;
+			}
+			src = fatTools.GetClusterAddr(cluster, true);
+			clusterSamples = fatClusterSize / byteDepth;
+		}
+	}
+
+	// Retry if flash was accessed or wavetable changed during the decode
+	if (fatTools.Busy() || request != activeWaveTable) {
+		cacheRequest = noCache;
+		return;
+	}
+
+	cacheLoadTime = SysTickVal - loadStart;
+	cacheWav[slot] = wav;
+	cacheWav[slot].startAddr = (uint8_t*)cacheBuffer[slot];
+	cacheWav[slot].sampleType = SampleType::PCM16;
+	cacheWav[slot].fragmented = false;
+	memcpy(cacheName[slot], catalogue.name[request], 8);
+	cacheWaveTable[slot] = request;
+	cacheSlot = slot;							// Sample kernel change from float data crossfades at the swap
+}
+
+
+void WaveTable::BrokenChain(const uint32_t request)
+{
+	// Cluster chain ends before the data: mark the wavetable corrupt so it is muted and shown as invalid rather than played from
+	// flash, unless the chain was changed by a write during the decode in which case the decode is retried
+	if (fatTools.Busy() || request != activeWaveTable) {
+		cacheRequest = noCache;
+	} else {
+		catalogue.invalid[request] = Invalid::HeaderCorrupt;
+	}
+}
+
+
+void WaveTable::UpdateMipMaps()
+{
+	// Called from main loop: build band-limited mip levels by truncating harmonics of each frame's spectrum
+	const uint32_t request = activeWaveTable;
+	if (mipRequest == request) {
+		return;
+	}
+	mipRequest = request;
+	mipWaveTable = noMipMap;							// Playback uses the anti-aliasing filter until the mip levels are ready
+	if (fatTools.Busy()) {
+		mipRequest = noMipMap;							// Flash mapping may not be readable during a queued write: retry once idle
+		return;
+	}
+
+	const Wav wav = PlaybackWav(request);
+	if (wav.isDir || wav.invalid != Invalid::OK || wav.tableCount > mipMaxFrames || wav.frameSize > defaultFrameSize) {
+		return;
+	}
+	if (wav.fragmented) {
+		mipRequest = noMipMap;							// Retry once the wavetable has been assembled in the cache
+		return;
+	}
+
+	// Mip levels are independent of the frame length: shorter frames have fewer harmonics to copy
+	const uint32_t frameSize = wav.frameSize;
+	for (uint32_t frame = 0; frame < wav.tableCount; ++frame) {
+		for (uint32_t i = 0; i < frameSize; ++i) {
 			if (wav.sampleType == SampleType::Float32) {
-				outputSample2 = filter.CalcInterpolatedFilter((uint32_t)readPos, (float*)wav.startAddr + sampleOffset + 2048, ratio, pitchInc[chn]);
+				fftBuffer[i] = ((float*)wav.startAddr)[frame * frameSize + i];
 			} else {
-				outputSample2 = filter.CalcInterpolatedFilter((uint32_t)readPos, (int16_t*)wav.startAddr + sampleOffset + 2048, ratio, pitchInc[chn]) * (1.0 / 32768.0f);
+				fftBuffer[i] = ((int16_t*)wav.startAddr)[frame * frameSize + i] * (1.0f / 32768.0f);
+			}
+		}
+		filter.FFT(fftBuffer, frameSize, false);
+
+		for (uint32_t level = 1; level <= mipLevels; ++level) {
+			const uint32_t size = 4096 >> level;
+			const uint32_t harmonics = std::min(size / 4, frameSize / 2);	// Harmonic h is below nyquist when h * 2^level < 1024
+
+			std::fill(mipFFTBuffer, mipFFTBuffer + size, 0.0f);
+			mipFFTBuffer[0] = fftBuffer[0];
+			for (uint32_t h = 1; h < harmonics; ++h) {
+				mipFFTBuffer[h] = fftBuffer[h];
+				mipFFTBuffer[size - h] = fftBuffer[frameSize - h];
+			}
+			filter.FFT(mipFFTBuffer, size, true);
+
+			int16_t* levelData = &mipBuffer[frame * mipFrameSize + 4096 - (size << 1)];
+			for (uint32_t i = 0; i < size; ++i) {
+				levelData[i] = (int16_t)std::clamp(std::round(mipFFTBuffer[i].real() / (frameSize * mipScale)), -32768.0f, 32767.0f);
 			}
-			outputSamples[0] = std::lerp(outputSamples[0], outputSample2, wtRatio);
 		}
 	}
+	mipWaveTable = request;								// If the active wavetable has changed the levels are not used and are rebuilt
+}
+
+
+void WaveTable::UpdateControls(const size_t n)
+{
+	// Control rate stage called once per block: calculates smoothed targets which the audio path ramps to over the block
+	const float blockCoeff = std::pow(controlSmoothing, (float)n);		// Equivalent to n iterations of the per sample filter
+
+	UpdateWarpType();
+
+	const float newInc = calib.cfg.pitchBase * FastExp2((float)controls->Pitch_CV * calib.cfg.pitchMult) * octave;			// for cycle length matching sample rate (48k)
+	smoothedInc.Update(newInc, blockCoeff, n);
+
+	// Calculate smoothed warp amount from pot and CV with trimmer controlling range of CV
+	const float cv = std::max(61300.0f - controls->WarpCV, 0.0f);		// Reduce to ensure can hit zero with noise
+	warpAmt.Update(std::clamp((controls->Warp_Amt_Pot + NormaliseADC(controls->Warp_Amt_Trm) * cv), 0.0f, 65535.0f), blockCoeff, n);
+
+	for (auto& wp : wavetablePos) {
+		wp.pos.Update(wp.Target(*controls), blockCoeff, n);
+	}
 }
 
 
-inline float WaveTable::CalcWarp()
+void WaveTable::UpdateWarpType()
 {
-	// Set warp type from knob with hysteresis
-	if (abs(warpTypeVal - adc.Warp_Type_Pot) > 1000) {
-		warpTypeVal = adc.Warp_Type_Pot;
+	// Set warp type from knob with hysteresis, crossfading from the previous kernel's output
+	if (abs(warpTypeVal - controls->Warp_Type_Pot) > 1000) {
+		warpTypeVal = controls->Warp_Type_Pot;
 		const Warp newWarpType = (Warp)((uint32_t)Warp::count * warpTypeVal / 65536);
 		if (newWarpType != warpType) {
 			warpType = newWarpType;
 			crossfade = 1.0f;
 		}
 	}
+}
 
-	// Calculate smoothed warp amount from pot and CV with trimmer controlling range of CV
-	const float cv = std::max(61300.0f - adc.WarpCV, 0.0f);		// Reduce to ensure can hit zero with noise
-	warpAmt = (0.99f * warpAmt) +
-			  (0.01f * std::clamp((adc.Warp_Amt_Pot + NormaliseADC(adc.Warp_Amt_Trm) * cv), 0.0f, 65535.0f));
 
+void WaveTable::OutputChannelA(const Wav& wav, const SampleLoop sampleLoopA, const WarpLoop warpLoopA, const float* readPos, const float* inc, const float* modulator, float* out, const size_t n)
+{
+	// Warp and sample loops run over all sub-samples of the block, followed by decimation if oversampled
+	if (oversample == 1) {
+		float warpPos[audioBlockSize], warpInc[audioBlockSize];
+		(this->*warpLoopA)(readPos, inc, modulator, warpPos, warpInc, n);
+		profiler.Record(Profiler::warp);
+		(this->*sampleLoopA)(wav, 0, warpPos, warpInc, out, n, 1);
+		profiler.Record(Profiler::channelA);
+		return;
+	}
+
+	float warpPos[audioBlockSize * maxOversample], warpInc[audioBlockSize * maxOversample];
+	float samples[audioBlockSize * maxOversample];
+	(this->*warpLoopA)(readPos, inc, modulator, warpPos, warpInc, n);
+	profiler.Record(Profiler::warp);
+	(this->*sampleLoopA)(wav, 0, warpPos, warpInc, samples, n * oversample, oversample);
+
+	for (size_t s = 0; s < n; ++s) {
+		float* sub = &samples[s * oversample];
+		if (oversample == 4) {
+			sub[0] = decimator4x.Process(sub[0], sub[1]);
+			sub[1] = decimator4x.Process(sub[2], sub[3]);
+		}
+		out[s] = decimator2x.Process(sub[0], sub[1]);
+	}
+	profiler.Record(Profiler::channelA);				// Decimation included in channel A filter time
+}
+
+
+template<WaveTable::Warp warp>
+void WaveTable::WarpSamples(const float* readPos, const float* inc, const float* modulator, float* warpPos, float* warpInc, const size_t n)
+{
+	// Warp loop for channel A: outputs read position and pitch increment (for the filter cutoff) of each sub-sample
+	// Sub-samples are spaced evenly up to the current read position with channel B interpolated from the previous sample
+	// The filter cutoff stays at the output rate: content above it is only generated by the warp and removed by decimation
+	const float step = 1.0f / oversample;
+	for (size_t s = 0; s < n; ++s) {
+		warpAmt.Next();
+		if (oversample == 1) {
+			pitchInc[0] = inc[s];
+			warpPos[s] = CalcWarp<warp>(readPos[s], modulator[s]);
+			warpInc[s] = pitchInc[0];
+		} else {
+			for (uint32_t i = 0; i < oversample; ++i) {
+				const float ratio = step * (i + 1);
+				float pos = readPos[s] - inc[s] * (1.0f - ratio);
+				if (pos < 0.0f) { pos += 2048.0f; }
+
+				pitchInc[0] = inc[s];					// Warp adjusts pitch increment for the filter
+				warpPos[s * oversample + i] = CalcWarp<warp>(pos, std::lerp(prevModulator, modulator[s], ratio));
+				warpInc[s * oversample + i] = pitchInc[0];
+			}
+		}
+		prevModulator = modulator[s];
+	}
+}
+
+
+void WaveTable::UpdateOversampling()
+{
+	// Block rate estimate of how far the warp spreads channel A above nyquist, expressed relative to the limit for playing at 1x:
+	// Mirror folds add harmonics falling at 12dB/octave from the fastest read speed through the fold; TZFM modulation adds up to
+	// the deviation times channel B's slope to the read speed. Factor only drops with 20% hysteresis to avoid toggling
+	float aliasRatio = 0.0f;
+	float limit4x = 0.0f;						// Ratio above which 4x is used
+	const float inc = smoothedInc.smoothed;
+
+	if (warpType == Warp::mirror) {
+		const float a = std::clamp(warpAmt.smoothed / 32768.0f, 0.1f, 1.9f);
+		aliasRatio = inc * 2.0f / std::min(a, 2.0f - a) / mirrorAliasInc;
+		limit4x = 3.0f;
+	} else if (warpType == Warp::tzfm) {
+		const float deviation = std::abs(warpAmt.smoothed - 32767.0f) * (1.0f / 48.0f) * modulatorSlope;
+		aliasRatio = deviation / (tzfmAliasRatio * inc);
+		limit4x = 7.0f;
+	}
+	modulatorSlope *= modulatorSlopeRelease;
+
+	auto factor = [&](const float scale) -> uint32_t {
+		return (aliasRatio > limit4x * scale) ? 4 : (aliasRatio > scale) ? 2 : 1;
+	};
+	uint32_t newOversample = factor(1.0f);
+	if (newOversample < oversample) {
+		newOversample = std::max(newOversample, factor(0.8f));
+	}
+	if (oversampleMode != 0) {
+		newOversample = oversampleMode;
+	}
+
+	if (newOversample != oversample) {
+		oversample = newOversample;
+		decimator2x.Reset();
+		decimator4x.Reset();
+		crossfade = 1.0f;						// Crossfade over decimator delay and latency change
+	}
+}
+
+
+template<WaveTable::Warp warp>
+inline float WaveTable::CalcWarp(const float pos, const float modulator)
+{
+	// Returns channel A read position after warp from read position and channel B modulator (TZFM); instantiated per warp type
 	float adjReadPos;					// Read position after warp applied
 	float pitchAdj;						// To adjust the pitch increment for calculating ant-aliasing filter cutoff
 
-	switch (warpType) {
+	switch (warp) {
 	case Warp::bend: {
 		// Waveform is stretched to one side (or squeezed to the other side) [Like 'Asym' in Serum]
 		// https://www.desmos.com/calculator/u9aphhyiqm
-		const float a = std::clamp(warpAmt / 32768.0f, 0.1f, 1.9f);
-		if (readPos[0] < 1024.0f * a) {
+		const float a = std::clamp(warpAmt.val / 32768.0f, 0.1f, 1.9f);
+		if (pos < 1024.0f * a) {
 			pitchAdj = 1.0f / a;
-			adjReadPos = readPos[0] * pitchAdj;
+			adjReadPos = pos * pitchAdj;
 		} else {
 			pitchAdj = 1.0f / (2.0f - a);
-			adjReadPos = (readPos[0] + 2048.0f - 2048.0f * a) / (2.0f - a);
+			adjReadPos = (pos + 2048.0f - 2048.0f * a) / (2.0f - a);
 		}
 		pitchInc[0] *= pitchAdj;
 	}
@@ -186,33 +640,33 @@ inline float WaveTable::CalcWarp()
 		// Pinched: waveform squashed from sides to center; Stretched: from center to sides [Like 'Bend' in Serum]
 		// Deforms readPos using sine wave
 		const float bendAmt = 1.0f / 96.0f;		// Increase to extend bend amount range
-		if (warpAmt > 32767.0f) {
-			const float sinWarp = sineLUT[((uint32_t)readPos[0] + 1024) & 0x7ff];			// Apply a 180 degree phase shift and limit to 2047
-			pitchAdj = sinWarp * (warpAmt - 32767.0f) * bendAmt;
+		if (warpAmt.val > 32767.0f) {
+			const float sinWarp = sineLUT[((uint32_t)pos + 1024) & 0x7ff];			// Apply a 180 degree phase shift and limit to 2047
+			pitchAdj = sinWarp * (warpAmt.val - 32767.0f) * bendAmt;
 		} else {
-			const float sinWarp = sineLUT[(uint32_t)readPos[0]];			// Get amount of warp
-			pitchAdj = sinWarp * (32767.0f - warpAmt) * bendAmt;
+			const float sinWarp = sineLUT[(uint32_t)pos];			// Get amount of warp
+			pitchAdj = sinWarp * (32767.0f - warpAmt.val) * bendAmt;
 		}
-		adjReadPos = readPos[0] + pitchAdj;
+		adjReadPos = pos + pitchAdj;
 		pitchInc[0] *= 1.5f;			// Adding pitchAdj creates odd effects around bend point - sounds better multiplying by average
 	}
 	break;
 
 	case Warp::mirror: {
 		// Like bend but flips direction in center: https://www.desmos.com/calculator/8jtheoca0l
-		const float a = std::clamp(warpAmt / 32768.0f, 0.1f, 1.9f);
-		if (readPos[0] < 512.0f * a) {
+		const float a = std::clamp(warpAmt.val / 32768.0f, 0.1f, 1.9f);
+		if (pos < 512.0f * a) {
 			pitchAdj = 2.0f / a;
-			adjReadPos = pitchAdj * readPos[0];
-		} else if (readPos[0] < 1024.0f) {
+			adjReadPos = pitchAdj * pos;
+		} else if (pos < 1024.0f) {
 			pitchAdj = 2.0f / (2.0f - a);
-			adjReadPos = (readPos[0] * pitchAdj) + 2048.0f * (1.0f - a) / (2.0f - a);
-		} else if (readPos[0] < 2048.0f * (4.0f - a) / 4) {
+			adjReadPos = (pos * pitchAdj) + 2048.0f * (1.0f - a) / (2.0f - a);
+		} else if (pos < 2048.0f * (4.0f - a) / 4) {
 			pitchAdj = 2.0f / (2.0f - a);
-			adjReadPos = (readPos[0] * -pitchAdj) + 2048.0f * (3.0f - a) / (2.0f - a);
+			adjReadPos = (pos * -pitchAdj) + 2048.0f * (3.0f - a) / (2.0f - a);
 		} else {
 			pitchAdj = 2.0f / a;
-			adjReadPos = (4096.0f - readPos[0] * 2.0f) / a;
+			adjReadPos = (4096.0f - pos * 2.0f) / a;
 		}
 		pitchInc[0] *= pitchAdj;
 	}
@@ -221,14 +675,14 @@ inline float WaveTable::CalcWarp()
 	case Warp::tzfm: {
 		// Through Zero FM: Phase distorts channel A using scaled bipolar version of channel B's waveform
 		float bendAmt = 1.0f / 48.0f;		// Increase to extend bend amount range
-		pitchAdj = outputSamples[1] * (warpAmt - 32767.0f) * bendAmt;
-		adjReadPos = readPos[0] + pitchAdj;
+		pitchAdj = modulator * (warpAmt.val - 32767.0f) * bendAmt;
+		adjReadPos = pos + pitchAdj;
 		pitchInc[0] *= 1.5f;			// Adding pitchAdj creates odd effects around bend point - sounds better multiplying by average
 	}
 	break;
 
 	default:
-		adjReadPos = readPos[0];
+		adjReadPos = pos;
 		break;
 	}
 
@@ -239,26 +693,73 @@ inline float WaveTable::CalcWarp()
 }
 
 
-inline void WaveTable::AdditiveWave()
+void WaveTable::UpdateAdditive(const size_t n)
 {
-	// Calculate which pair of harmonic sets to interpolate between
-	const float harmonicPos = wavetablePos[1].Val() * (harmonicSets - 1);
-	const uint32_t harmonicLow = (uint32_t)harmonicPos;
+	// Block rate stage of additive engine: calculate harmonic levels at the end of the block by interpolating between harmonic sets
+	// Harmonics are faded out over one harmonic as they approach nyquist and culled above it
+	const float harmonicPos = wavetablePos[1].pos.smoothed * (harmonicSets - 1);
+	const uint32_t harmonicLow = std::min((uint32_t)harmonicPos, harmonicSets - 1);
+	const uint32_t harmonicHigh = std::min(harmonicLow + 1, harmonicSets - 1);
 	const float ratio = harmonicPos - harmonicLow;
 
-	float sample = 0.0f;
-	float pos = 0.0f;
-	float revPos = 0.0f;
-	for (uint32_t i = 0; i < harmonicCount; ++i) {
-		pos += readPos[1];
-		revPos -= readPos[1];
-		while (pos >= 2048.0f) { pos -= 2048.0f; }
-		while (revPos < 0.0f) { revPos += 2048.0f; }
+	// Harmonic h is below nyquist when h * inc < 1024: use the highest pitch reached during the block
+	const float maxInc = std::max(std::abs(smoothedInc.val), std::abs(smoothedInc.smoothed)) * (cfg.octaveChnB ? 0.5f : 1.0f);
+	const float nyquistHarmonic = 1024.0f / std::max(maxInc, 0.001f);
+
+	uint32_t active = 0;
+	for (uint32_t h = 0; h < harmonicCount; ++h) {
+		harmonicLevel[h] += harmonicDelta[h];							// Level reached at end of previous block
+		const float fade = std::clamp(nyquistHarmonic - (h + 1), 0.0f, 1.0f);
+		const float level = fade * std::lerp(additiveHarmonics[harmonicLow][h], additiveHarmonics[harmonicHigh][h], ratio);
+		harmonicDelta[h] = level - harmonicLevel[h];
+		if (level != 0.0f || harmonicLevel[h] != 0.0f) {
+			active = h + 1;
+		}
+	}
+	activeHarmonics = (active + additiveLanes - 1) & ~(additiveLanes - 1);
+
+	additiveRamp = 0.0f;
+	additiveRampInc = 1.0f / n;
+}
 
-		const float harmonicLevel = std::lerp(additiveHarmonics[harmonicLow][i], additiveHarmonics[harmonicLow + 1][i], ratio);
-		sample += harmonicLevel * sineLUT[(uint32_t)pos];
+
+inline float WaveTable::AdditiveWave(const float readPos)
+{
+	// Harmonics are generated from the sine and cosine of the read position with the Chebyshev recurrence:
+	// sin((h + 4)x) = 2cos(4x)sin(hx) - sin((h - 4)x), run as four independent lanes so the FPU is not stalled on one dependency chain.
+	// Sine and cosine are looked up and rotated by the fractional position so they stay on the unit circle for an accurate recurrence
+	const uint32_t index = (uint32_t)readPos;
+	const float delta = (readPos - index) * (2.0f * std::numbers::pi_v<float> / sinLUTSize);
+	const float sinDelta = delta - delta * delta * delta * (1.0f / 6.0f);
+	const float cosDelta = 1.0f - delta * delta * 0.5f;
+	const float sinA = sineLUT[index];
+	const float cosA = sineLUT[(index + sinLUTSize / 4) & (sinLUTSize - 1)];
+
+	const float sin1 = sinA * cosDelta + cosA * sinDelta;
+	const float cos1x2 = 2.0f * (cosA * cosDelta - sinA * sinDelta);	// 2cos(x)
+	const float sin2 = cos1x2 * sin1;
+	const float sin3 = cos1x2 * sin2 - sin1;
+	const float sin4 = cos1x2 * sin3 - sin2;
+	const float cos2x2 = cos1x2 * cos1x2 - 2.0f;						// 2cos(2x)
+	const float cos4x2 = cos2x2 * cos2x2 - 2.0f;						// 2cos(4x)
+
+	float sinH[additiveLanes] = {sin1, sin2, sin3, sin4};				// sin(hx) for the four harmonics in the current group
+	float sinPrev[additiveLanes] = {-sin3, -sin2, -sin1, 0.0f};			// sin((h - 4)x)
+	float sum[additiveLanes] = {};
+	float sumDelta[additiveLanes] = {};
+
+	for (uint32_t h = 0; h < activeHarmonics; h += additiveLanes) {
+		for (uint32_t l = 0; l < additiveLanes; ++l) {
+			sum[l] += harmonicLevel[h + l] * sinH[l];
+			sumDelta[l] += harmonicDelta[h + l] * sinH[l];
+			const float sinNext = cos4x2 * sinH[l] - sinPrev[l];
+			sinPrev[l] = sinH[l];
+			sinH[l] = sinNext;
+		}
 	}
-	outputSamples[1] = sample;
+
+	additiveRamp += additiveRampInc;
+	return (sum[0] + sum[1]) + (sum[2] + sum[3]) + additiveRamp * ((sumDelta[0] + sumDelta[1]) + (sumDelta[2] + sumDelta[3]));
 }
 
 
@@ -303,33 +804,14 @@ void WaveTable::CalcAdditive()
 void WaveTable::Init()
 {
 	CalcAdditive();
-	wavetable.UpdateWavetableList();	// Update list of samples on flash
-}
-
-
-void WaveTable::ChangeWaveTable(const int32_t index)
-{
-	// Called by UI when changing wavetable
-	strncpy(cfg.wavetable, wavList[index].name, 8);
-	crossfade = 1.0f;
-	activeWaveTable = index;
 
-	config.ScheduleSave();
-}
-
-
-void WaveTable::UpdateWavetableList()
-{
 	// Create a test wavetable with a couple of waveforms - also used in case of no file system
-	strncpy(wavList[0].name, "Default ", 8);
-	wavList[0].dataFormat = 3;
-	wavList[0].channels   = 1;
-	wavList[0].byteDepth  = 4;
-	wavList[0].tableCount = 3;
-	wavList[0].sampleCount = wavList[0].sampleCount * 2048;
-	wavList[0].startAddr = (uint8_t*)&defaultWavetable;
-	wavList[0].sampleType = SampleType::Float32;
-	wavList[0].invalid = Invalid::OK;
+	catalogue.Clear();
+	catalogue.Set(0, Wav {.startAddr = (uint8_t*)&defaultWavetable, .tableCount = 3, .frameSize = defaultFrameSize,
+		.sampleType = SampleType::Float32, .invalid = Invalid::OK});
+	memcpy(catalogue.name[0], "Default ", 8);
+	catalogue.lfn[0] = 0;
+	catalogue.dir[0] = 0;
 
 	// Generate test waves
 	for (uint32_t i = 0; i < 2048; ++i) {
@@ -338,109 +820,417 @@ void WaveTable::UpdateWavetableList()
 		defaultWavetable[i + 4096] = (i < 1024) ? 1.0f : -1.0f;				// Square
 	}
 
-	// Updates list of wavetables from FAT root directory
+	wavetable.UpdateWavetableList();	// Update list of samples on flash
+	bootListUpdate = listUpdate;
+	bootListTime = listUpdateTime;
+}
+
+
+void WaveTable::UpdateWavetableList(const bool rescan)
+{
+	// Updates list of wavetables from FAT: directories whose entries have changed since the previous scan are re-read, only parsing
+	// headers of added or modified files. A full scan is made the first time, or when folders are added, removed or renamed
+	// At boot the list is loaded from the flash index if the file system is unchanged since it was saved
+	const uint32_t updateStart = SysTickVal;
+	if (rescan) {
+		listUpdate = ListUpdate::rescan;
+	} else if (!listScanned) {
+		listUpdate = LoadIndex();
+	} else {
+		listUpdate = RefreshWavetableList();
+	}
+	if (listUpdate == ListUpdate::unchanged) {
+		listUpdateTime = SysTickVal - updateStart;
+		return;
+	}
+	if (listUpdate == ListUpdate::rescan) {
+		ScanWavetableList();
+	}
+	listScanned = true;
+	indexFatHash = FatHash();
+	if (listUpdate != ListUpdate::indexed) {
+		indexDirty = true;
+		indexSaveBooked = SysTickVal;
+	}
+	mipWaveTable = noMipMap;						// Wavetable data or indexes may have changed
+	mipRequest = noMipMap;
+
+	// Attempt to locate active wavetable
+	uint32_t newActive = activeWaveTable;
+	for (uint32_t i = 0; i < wavetableCount; ++i) {
+		if (catalogue.invalid[i] == Invalid::OK && !catalogue.IsDir(i) && strncmp(catalogue.name[i], cfg.wavetable, 8) == 0) {
+			newActive = i;
+			break;
+		}
+	}
+
+	// Keep playing the cached wavetable if its index has moved; the file may have been overwritten so it is decoded again
+	const uint32_t slot = cacheSlot;
+	cacheWaveTable[slot ^ 1] = noCache;
+	if (cacheWaveTable[slot] != noCache && strncmp(cacheName[slot], catalogue.name[newActive], 8) == 0) {
+		cacheWaveTable[slot] = newActive;
+	} else {
+		cacheWaveTable[slot] = noCache;
+	}
+	cacheRequest = noCache;
+	activeWaveTable = newActive;
+	ui.SetWavetable(activeWaveTable);
+	listUpdateTime = SysTickVal - updateStart;
+}
+
+
+void WaveTable::ScanWavetableList()
+{
+	// Reads all wavetables in file system and stores metadata in catalogue, storing a hash of each directory to detect later changes
+	catalogue.Clear();
 	wavetableCount = 1;
-	ReadDir(fatTools.rootDirectory, 0);				// Reads all wavetables in file system and stores metadata in wavList
-	std::sort(&wavList[1], &wavList[wavetableCount], &WavetableSorter);
+	wavetableCount += ReadDir(0, 0, true, 1, Catalogue::capacity - 1, 0, 0);
+	catalogue.Sort(1, wavetableCount);
+	rootDirHash = fatTools.noFileSystem ? 0 : DirHash(0);
 
 	for (uint32_t i = 0; i < wavetableCount; ++i) {
-		if (wavList[i].isDir && wavList[i].name[0] != '.') {
+		if (catalogue.IsDir(i) && catalogue.name[i][0] != '.') {
 
 			// Create dummy folder for back navigation
-			if (wavetableCount < maxWavetable) {
-				Wav& wav = wavList[wavetableCount++];
-				strncpy(wav.name, ".", 8);
-				strncpy(wav.lfn, "<< Back", lfnSize);
-				wav.firstWav = i;
-				wav.dir = i;
-				wav.isDir = true;
-				wav.invalid = Invalid::OK;
+			if (wavetableCount < Catalogue::capacity) {
+				const uint32_t back = wavetableCount++;
+				catalogue.Set(back, Wav {.isDir = true});
+				memcpy(catalogue.name[back], ".       ", 8);
+				catalogue.lfn[back] = catalogue.Intern("<< Back");
+				catalogue.firstWav[back] = i;
+				catalogue.dir[back] = i;
 			}
 
-			const uint32_t oldWavetableCount = wavetableCount;
-			ReadDir((FATFileInfo*)fatTools.GetClusterAddr(wavList[i].cluster), i);
-			std::sort(&wavList[oldWavetableCount], &wavList[wavetableCount], &WavetableSorter);
-			if (oldWavetableCount != wavetableCount) {		// Valid wav files found in directory
-				wavList[i].invalid = Invalid::OK;
+			const uint32_t start = wavetableCount;
+			wavetableCount += ReadDir(catalogue.cluster[i], i, true, start, Catalogue::capacity - start, 0, 0);
+			catalogue.Sort(start, wavetableCount);
+			if (start != wavetableCount) {					// Valid wav files found in directory
+				catalogue.firstWav[i] = start;
+				catalogue.invalid[i] = Invalid::OK;
 			}
+			catalogue.dirHash[i] = DirHash(catalogue.cluster[i]);
 		}
 	}
+}
 
-	// Blank next sample (if exists) to show end of list
-	Wav& wav = wavList[wavetableCount];
-	wav.name[0] = 0;
 
-	// Attempt to locate active wavetable
-	for (uint32_t i = 0; i < wavetableCount; ++i) {
-		if (wavList[i].invalid == Invalid::OK && !wavList[i].isDir && strncmp(wavList[i].name, cfg.wavetable, 8) == 0) {
-			activeWaveTable = i;
-			break;
+WaveTable::ListUpdate WaveTable::RefreshWavetableList()
+{
+	// Compare hash of each directory with the previous scan and re-read changed directories
+	if (fatTools.noFileSystem) {
+		return ListUpdate::rescan;
+	}
+
+	ListUpdate update = ListUpdate::unchanged;
+	catalogue.poolFull = false;
+	const uint32_t rootHash = DirHash(0);
+	if (rootHash != rootDirHash) {
+		if (!RefreshDir(0, 0, rootHash)) {
+			return ListUpdate::rescan;
 		}
+		update = ListUpdate::incremental;
 	}
-	ui.SetWavetable(activeWaveTable);
+
+	// Indexes after a refreshed directory are shifted so subfolders are checked in list order
+	for (uint32_t i = 1; i < wavetableCount; ++i) {
+		if (catalogue.IsDir(i) && catalogue.name[i][0] != '.') {
+			const uint32_t hash = DirHash(catalogue.cluster[i]);
+			if (hash != catalogue.dirHash[i]) {
+				if (!RefreshDir(i, catalogue.cluster[i], hash)) {
+					return ListUpdate::rescan;
+				}
+				update = ListUpdate::incremental;
+			}
+		}
+	}
+
+	// Names of removed entries are only reclaimed by a full scan
+	return catalogue.poolFull ? ListUpdate::rescan : update;
 }
 
 
-void WaveTable::ReadDir(const FATFileInfo* dirEntry, const uint32_t dirIndex)
+bool WaveTable::RefreshDir(const uint32_t dirIndex, const uint32_t dirCluster, const uint32_t hash)
 {
-	if (fatTools.noFileSystem) {
+	// Re-read a changed directory in place. The old entries are copied to the end of the catalogue so unchanged files can be reused
+	// rather than parsed; following entries are then shifted and any indexes pointing past the directory's entries adjusted.
+	// Returns false if a full scan is needed (subfolders added, removed or renamed, or not enough free entries)
+
+	// Root entries follow the default wavetable; subfolder entries follow their back navigation item
+	uint32_t start = 1;
+	if (dirIndex > 0) {
+		start = 0;
+		for (uint32_t i = 1; i < wavetableCount; ++i) {
+			if (catalogue.IsDir(i) && catalogue.name[i][0] == '.' && catalogue.firstWav[i] == dirIndex) {
+				start = i + 1;
+				break;
+			}
+		}
+		if (start == 0) {
+			return false;
+		}
+	}
+	uint32_t end = start;
+	while (end < wavetableCount && catalogue.dir[end] == dirIndex && catalogue.name[end][0] != '.') {
+		++end;
+	}
+
+	const uint32_t oldCount = end - start;
+	const uint32_t newCount = ReadDir(dirCluster, dirIndex, false, 0, Catalogue::capacity, 0, 0);
+	const int32_t delta = newCount - oldCount;
+	if (wavetableCount + std::max(delta, (int32_t)0) + newCount + oldCount > Catalogue::capacity) {
+		return false;
+	}
+
+	const uint32_t oldList = Catalogue::capacity - oldCount;
+	const uint32_t newList = oldList - newCount;
+	catalogue.Move(oldList, start, oldCount);
+	ReadDir(dirCluster, dirIndex, true, newList, newCount, oldList, oldCount);
+	catalogue.Sort(newList, newList + newCount);
+
+	// Subfolders are sorted first and must be unchanged as their own entries are stored after this directory's
+	uint32_t folders = 0;
+	while (folders < newCount && catalogue.IsDir(newList + folders)) {
+		++folders;
+	}
+	uint32_t oldFolders = 0;
+	while (oldFolders < oldCount && catalogue.IsDir(oldList + oldFolders)) {
+		++oldFolders;
+	}
+	if (folders != oldFolders) {
+		return false;
+	}
+	for (uint32_t f = 0; f < folders; ++f) {
+		if (strncmp(catalogue.name[newList + f], catalogue.name[oldList + f], 8) != 0 || catalogue.cluster[newList + f] != catalogue.cluster[oldList + f]) {
+			return false;
+		}
+	}
+
+	catalogue.Move(end + delta, end, wavetableCount - end);
+	wavetableCount += delta;
+	catalogue.Move(start, newList, newCount);
+	if (delta != 0) {
+		for (uint32_t i = 0; i < wavetableCount; ++i) {
+			if (catalogue.dir[i] >= end) {
+				catalogue.dir[i] += delta;
+			}
+			if (catalogue.IsDir(i) && catalogue.firstWav[i] >= end) {
+				catalogue.firstWav[i] += delta;
+			}
+		}
+	}
+
+	if (dirIndex > 0) {
+		catalogue.firstWav[dirIndex] = (newCount > 0) ? start : 0;
+		catalogue.invalid[dirIndex] = (newCount > 0) ? Invalid::OK : Invalid::EmptyFolder;
+		catalogue.dirHash[dirIndex] = hash;
+	} else {
+		rootDirHash = hash;
+	}
+	return true;
+}
+
+
+WaveTable::ListUpdate WaveTable::LoadIndex()
+{
+	// Load catalogue from flash index if valid and built from the current FAT; directories changed without altering the
+	// cluster chain (eg renamed files) are then refreshed. Returns rescan if the index is missing or stale
+	const IndexHeader* header = (const IndexHeader*)flashDevice->ReadMapped(indexAddress);
+	if (fatTools.noFileSystem || flashDevice->flashCorrupt || strncmp(header->magic, "KIDX", 4) != 0 || header->version != indexVersion ||
+			header->catalogueSize != sizeof(Catalogue) || header->count == 0 || header->count > Catalogue::capacity) {
+		return ListUpdate::rescan;
+	}
+	indexGeneration = header->generation;
+	const uint8_t* storedCatalogue = flashDevice->ReadMapped(indexCatalogueAddress);
+	if (header->fatHash != FatHash() ||
+			header->checksum != Hash(storedCatalogue, sizeof(Catalogue), Hash(header, offsetof(IndexHeader, checksum)))) {
+		return ListUpdate::rescan;
+	}
+
+	memcpy(&catalogue, storedCatalogue, sizeof(Catalogue));
+	catalogue.startAddr[0] = (uint8_t*)&defaultWavetable;		// Built-in wavetable is in RAM
+	wavetableCount = header->count;
+	rootDirHash = header->rootDirHash;
+
+	const ListUpdate update = RefreshWavetableList();
+	return (update == ListUpdate::unchanged) ? ListUpdate::indexed : update;
+}
+
+
+void WaveTable::SaveIndex()
+{
+	// Called from main loop: catalogue blocks are written first and header last so an interrupted save fails the checksum at next
+	// boot. Blocks are written from the flash queue so audio can still read wavetables from flash by suspending the write
+	if (fatTools.indexQueued) {
+		QueueIndex();
+		return;
+	}
+	if (!indexDirty || fatTools.noFileSystem || fatTools.Busy() || fatTools.updateWavetables || SysTickVal < indexSaveBooked + indexSaveDelay) {
+		return;
+	}
+
+	// Reads that cannot suspend the write are muted, so wait until a wavetable that fits the cache is playing from it; larger
+	// wavetables are always read from flash
+	const Wav wav = catalogue.Get(activeWaveTable);
+	if (cacheWaveTable[cacheSlot] != activeWaveTable && !wav.isDir && wav.invalid == Invalid::OK && wav.tableCount * wav.frameSize <= cacheSamples) {
 		return;
 	}
-	const uint8_t* endOfCluster = (uint8_t*)dirEntry + fatClusterSize;
+	indexDirty = false;
+
+	std::fill(std::begin(indexHeader), std::end(indexHeader), 0);
+	IndexHeader& header = *(IndexHeader*)indexHeader;
+	memcpy(header.magic, "KIDX", 4);
+	header.version = indexVersion;
+	header.catalogueSize = sizeof(Catalogue);
+	header.count = wavetableCount;
+	header.fatHash = indexFatHash;
+	header.rootDirHash = rootDirHash;
+	header.generation = ++indexGeneration;
+	header.checksum = Hash(&catalogue, sizeof(Catalogue), Hash(&header, offsetof(IndexHeader, checksum)));
+
+	// Busy flag stops the list and caches changing until the save completes; USB writes are held off with NAKs
+	usb.PauseEndpoint(usb.msc);
+	fatTools.indexQueued = true;
+	indexQueuedBlocks = 0;
+	indexSaveStart = SysTickVal;
+	QueueIndex();
+}
+
+
+void WaveTable::QueueIndex()
+{
+	// Queue as many catalogue blocks as fit in the flash queue, then the header; blocks that are unchanged are not rewritten
+	const uint8_t* data = (const uint8_t*)&catalogue;
+	while (indexQueuedBlocks < indexBlocks) {
+		const uint32_t offset = indexQueuedBlocks * fatClusterSize;
+		const uint32_t words = std::min(fatClusterSize, (uint32_t)sizeof(Catalogue) - offset) / 4;
+		if (!flashDevice->QueueWrite(indexCatalogueAddress + offset, (const uint32_t*)(data + offset), words)) {
+			return;
+		}
+		++indexQueuedBlocks;
+	}
+	if (indexQueuedBlocks == indexBlocks) {
+		if (!flashDevice->QueueWrite(indexAddress, indexHeader, std::size(indexHeader))) {
+			return;
+		}
+		++indexQueuedBlocks;
+	}
+
+	if (flashDevice->QueueIdle()) {
+		fatTools.indexQueued = false;
+		indexSaveTime = SysTickVal - indexSaveStart;
+		usb.ResumeEndpoint(usb.msc);
+	}
+}
+
+
+uint32_t WaveTable::DirHash(const uint32_t dirCluster)
+{
+	// Hash of the entries in a directory (cluster 0 for root) used to detect changes since the last scan
+	FatTools::DirReader reader(dirCluster);
+	uint32_t hash = Hash(nullptr, 0);
+	while (const FATFileInfo* dirEntry = reader.Next()) {
+		hash = Hash(dirEntry, sizeof(FATFileInfo), hash);
+	}
+	return hash;
+}
+
+
+uint32_t WaveTable::FatHash()
+{
+	// Hash of cluster chain: changes when any file is written, deleted or moved. Reserved entries hold the dirty volume flag and are skipped
+	if (fatTools.noFileSystem) {
+		return 0;
+	}
+	return Hash(&fatTools.clusterChain[2], (fatMaxCluster - 2) * sizeof(uint16_t));
+}
+
+
+uint32_t WaveTable::Hash(const void* data, const uint32_t bytes, uint32_t hash)
+{
+	// FNV-1a hash over 32 bit words (bytes must be a multiple of 4)
+	const uint32_t* words = (const uint32_t*)data;
+	for (uint32_t i = 0; i < bytes / 4; ++i) {
+		hash = (hash ^ words[i]) * 16777619;
+	}
+	return hash;
+}
+
 
-	// Store contents of a directory into the wavetable and directory lists
-	while (dirEntry->name[0] != 0 && dirEntry->name[0] != 255 && wavetableCount < maxWavetable && (uint8_t*)dirEntry < endOfCluster) {
+uint32_t WaveTable::ReadDir(const uint32_t dirCluster, const uint32_t dirIndex, const bool store, const uint32_t first, const uint32_t space, const uint32_t reuse, const uint32_t reuseCount)
+{
+	// Store contents of a directory (cluster 0 for root) into catalogue from index first, returning the number of entries (only counted if store is false)
+	// Entries matching an item in the reuse range (same short name, cluster, size and write time) are copied rather than parsed again
+	FatTools::DirReader reader(dirCluster);
+	const FATFileInfo* dirEntry;
+	uint32_t count = 0;
+
+	while (count < space && (dirEntry = reader.Next()) != nullptr) {
 		const bool isValidDir = dirEntry->name[0] != '.' &&	(dirEntry->attr & AM_DIR) && (dirEntry->attr & AM_HID) == 0 && (dirEntry->attr & AM_SYS) == 0;
 		const bool isValidWav = (dirEntry->attr & AM_DIR) == 0 && strncmp(&(dirEntry->name[8]), "WAV", 3) == 0 && dirEntry->firstClusterLow;
 
 		if (dirEntry->name[0] != FATFileInfo::fileDeleted && dirEntry->attr == FATFileInfo::LONG_NAME) {
-			// Store long file name in temporary buffer
-			const FATLongFilename* lfn = (FATLongFilename*)dirEntry;
-			const char tempFileName[13] {lfn->name1[0], lfn->name1[2], lfn->name1[4], lfn->name1[6], lfn->name1[8],
-				lfn->name2[0], lfn->name2[2], lfn->name2[4], lfn->name2[6], lfn->name2[8], lfn->name2[10],
-				lfn->name3[0], lfn->name3[2]};
-
-			const uint32_t pos = ((lfn->order & 0x3F) - 1) * 13;
-			if (pos + 13 < sizeof(longFileName)) {
-				memcpy(&longFileName[pos], tempFileName, 13);		// strip 0x40 marker from first LFN entry order field
+			if (store) {
+				// Store long file name in temporary buffer
+				const FATLongFilename* lfn = (FATLongFilename*)dirEntry;
+				const char tempFileName[13] {lfn->name1[0], lfn->name1[2], lfn->name1[4], lfn->name1[6], lfn->name1[8],
+					lfn->name2[0], lfn->name2[2], lfn->name2[4], lfn->name2[6], lfn->name2[8], lfn->name2[10],
+					lfn->name3[0], lfn->name3[2]};
+
+				const uint32_t pos = ((lfn->order & 0x3F) - 1) * 13;
+				if (pos + 13 < sizeof(longFileName)) {
+					memcpy(&longFileName[pos], tempFileName, 13);		// strip 0x40 marker from first LFN entry order field
+				}
+				lfnPosition += 13;
 			}
-			lfnPosition += 13;
 
 		// Valid wavetable: not LFN, not deleted, not directory, extension = WAV
 		} else if (dirEntry->name[0] != FATFileInfo::fileDeleted && (isValidWav || isValidDir)) {
-			Wav& wav = wavList[wavetableCount];
-			memset(&wav, 0, sizeof(wav));
-
-			strncpy(wav.name, dirEntry->name, 8);
-			if (lfnPosition > 0) {
-				CleanLFN(wav.lfn);
-			}
-			wav.dir = dirIndex;
-			wav.cluster = dirEntry->firstClusterLow;
-
-			if (isValidWav) {
-				wav.size = dirEntry->fileSize;
-				GetWavInfo(wav);
-			} else {
-				wav.isDir = true;
-				wav.invalid = Invalid::EmptyFolder;			// Will be set to OK if contains valid wavetables
-			}
+			if (store) {
+				const uint32_t index = first + count;
+				const uint32_t stamp = isValidDir ? 0 : FileStamp(dirEntry);
+				uint32_t match = reuse;
+				while (match < reuse + reuseCount && (strncmp(catalogue.name[match], dirEntry->name, 8) != 0 ||
+						catalogue.cluster[match] != dirEntry->firstClusterLow || catalogue.IsDir(match) != isValidDir ||
+						(!isValidDir && catalogue.stamp[match] != stamp))) {
+					++match;
+				}
 
-			// If storing the first file in a sub directory, store the index against the directory item
-			if (dirIndex > 0 && wavList[dirIndex].firstWav == 0) {
-				wavList[dirIndex].firstWav = wavetableCount;
+				if (match != reuse + reuseCount) {
+					catalogue.Move(index, match, 1);
+				} else {
+					if (isValidWav) {
+						WavInfo wav {};
+						wav.cluster = dirEntry->firstClusterLow;
+						wav.size = dirEntry->fileSize;
+						GetWavInfo(wav);
+						catalogue.Set(index, wav);
+					} else {
+						catalogue.Set(index, Wav {.cluster = dirEntry->firstClusterLow, .invalid = Invalid::EmptyFolder, .isDir = true});	// Set to OK if folder contains valid wavetables
+					}
+					memcpy(catalogue.name[index], dirEntry->name, 8);
+					catalogue.stamp[index] = stamp;
+				}
+				catalogue.lfn[index] = (lfnPosition > 0) ? catalogue.Intern(CleanLFN()) : 0;
+				catalogue.dir[index] = dirIndex;
 			}
-
-			wavetableCount++;
+			++count;
 		} else {
 			lfnPosition = 0;
 		}
-		dirEntry++;
 	}
+	return count;
+}
+
+
+uint32_t WaveTable::FileStamp(const FATFileInfo* dirEntry)
+{
+	// Hash of size and write date and time of a file used to detect modified files
+	const uint32_t stamp[2] = {dirEntry->fileSize, (uint32_t)(dirEntry->writeDate << 16) | dirEntry->writeTime};
+	return Hash(stamp, sizeof(stamp));
 }
 
 
-void WaveTable::GetWavInfo(Wav& wav)
+void WaveTable::GetWavInfo(WavInfo& wav)
 {
 	// populate the wavetable object with sample rate, number of channels etc
 	const uint8_t* wavHeader = fatTools.GetClusterAddr(wav.cluster, true);
@@ -465,10 +1255,16 @@ void WaveTable::GetWavInfo(Wav& wav)
 	wav.channels   = *(uint16_t*)&(wavHeader[pos + 10]);
 	wav.byteDepth  = *(uint16_t*)&(wavHeader[pos + 22]) / 8;
 
-	// Check if there is a clm chunk with Serum metadata
+	// Check if there is a clm chunk with Serum metadata: '<!>' followed by frame length, a space and 8 digits of flags
+	wav.frameSize = defaultFrameSize;
 	pos += (8 + *(uint32_t*)&(wavHeader[pos + 4]));
 	if (*(uint32_t*)&(wavHeader[pos]) == 0x206d6c63) {			// Look for string 'clm '
-		const char* metadata = (char*)&(wavHeader[pos + 16]);
+		char* metadata;
+		const uint32_t frameSize = std::strtoul((char*)&(wavHeader[pos + 11]), &metadata, 10);
+		if (frameSize != 0) {
+			wav.frameSize = std::min(frameSize, (uint32_t)UINT16_MAX);	// Validated once sample count is known
+		}
+		++metadata;
 		if (std::strspn(metadata, "0123456789") == 8) {
 			wav.metadata = std::stoi(metadata);
 		}
@@ -495,7 +1291,8 @@ void WaveTable::GetWavInfo(Wav& wav)
 
 	wav.sampleCount = wav.dataSize / (wav.channels * wav.byteDepth);
 	wav.startAddr = &(wavHeader[startOffset]);
-	wav.tableCount = wav.sampleCount / 2048;
+	const bool validFrameSize = std::has_single_bit((uint32_t)wav.frameSize) && wav.frameSize >= minFrameSize && wav.frameSize <= maxFrameSize;
+	wav.tableCount = validFrameSize ? wav.sampleCount / wav.frameSize : 0;
 
 	// Currently support 32 bit floats and 16 bit PCM integer formats
 	if (wav.byteDepth == 4 && wav.dataFormat == 3) {
@@ -524,37 +1321,45 @@ void WaveTable::GetWavInfo(Wav& wav)
 		wav.invalid = Invalid::ChannelCount;
 	} else if (wav.dataSize > wav.size) {
 		wav.invalid = Invalid::HeaderCorrupt;
-	} else if (wav.fragmented) {
-		wav.invalid = Invalid::Fragmented;
-	} else if ((uint32_t)wav.startAddr & 0b11) {
+	} else if (!validFrameSize || wav.tableCount == 0) {
+		wav.invalid = Invalid::FrameSize;
+	} else if (wav.fragmented && wav.tableCount * wav.frameSize > cacheSamples) {
+		wav.invalid = Invalid::Fragmented;				// Fragmented files are played from the RAM cache so must fit
+	} else if ((uintptr_t)wav.startAddr & 0b11) {
 		wav.invalid = Invalid::Unaligned;
 	}
 }
 
 
-bool WaveTable::WavetableSorter(Wav const& lhs, Wav const& rhs)
+bool WaveTable::GetEntryInfo(const uint32_t index, WavInfo& wav)
 {
-	// Sort wavetables with sub-folders first followed by short file name
-	if (lhs.isDir != rhs.isDir) {
-		return lhs.isDir;
+	// Find the directory entry of a catalogue file from its parent folder and starting cluster and parse the header again
+	if (fatTools.noFileSystem || index == 0 || index >= wavetableCount || catalogue.IsDir(index)) {
+		return false;
 	}
-	for (uint8_t i = 0; i < 8; ++i) {
-		if (lhs.name[i] != rhs.name[i]) {
-			return lhs.name[i] < rhs.name[i];
+	const uint32_t dirIndex = catalogue.dir[index];
+	FatTools::DirReader reader((dirIndex == 0) ? 0 : catalogue.cluster[dirIndex]);
+	while (const FATFileInfo* dirEntry = reader.Next()) {
+		if (dirEntry->name[0] != FATFileInfo::fileDeleted && dirEntry->attr != FATFileInfo::LONG_NAME &&
+				dirEntry->firstClusterLow == catalogue.cluster[index] && strncmp(dirEntry->name, catalogue.name[index], 8) == 0) {
+			wav = {};
+			wav.cluster = dirEntry->firstClusterLow;
+			wav.size = dirEntry->fileSize;
+			GetWavInfo(wav);
+			return true;
 		}
 	}
-	return true;
+	return false;
 }
 
 
-void WaveTable::CleanLFN(char* storeName)
+std::string_view WaveTable::CleanLFN()
 {
-	// Clean long file name and store in wavetable or directory list
+	// Return long file name without extension, truncated to the display width
 	longFileName[lfnPosition] = '\0';
 	std::string_view lfn {longFileName};
-	size_t copyLen = std::min(lfn.find(".wav"), lfnSize);
-	std::strncpy(storeName, longFileName, copyLen);
 	lfnPosition = 0;
+	return lfn.substr(0, std::min(lfn.find(".wav"), lfnSize));
 }
 
 
@@ -598,34 +1403,13 @@ void WaveTable::WarpButton(const bool change)
 }
 
 
-void WaveTable::FragChain()
-{
-	// Build lookup table of fragmented memory addresses (not currently supporting fragmented wavetable lookup)
-	Wav& wav = wavList[activeWaveTable];
-
-	if (wav.fragmented) {
-		fragChain[0].startAddr = wav.startAddr;
-		uint32_t cluster = wav.lastCluster;
-		uint32_t i = 1;
-		while (i < 16 && fatTools.clusterChain[cluster] != 0xFFFF) {
-			if (fatTools.clusterChain[cluster] != cluster + 1) {
-				fragChain[i - 1].endAddr = fatTools.GetClusterAddr(cluster, true);
-				fragChain[i].startAddr = fatTools.GetClusterAddr(fatTools.clusterChain[cluster], true);
-				++i;
-			}
-			cluster = fatTools.clusterChain[cluster];
-		}
-	}
-}
-
-
 void WaveTable::FixUnaligned()
 {
 	uint8_t buffer[fatSectorSize + 4];								// Create buffer that can contain a sector plus one extra word
 	bool refresh = false;
 	for (uint32_t i = 0; i < wavetableCount; ++i) {
-		auto& wav = wavList[i];
-		if (wav.invalid == Invalid::Unaligned) {
+		WavInfo wav;
+		if (catalogue.invalid[i] == Invalid::Unaligned && GetEntryInfo(i, wav)) {
 			const uint8_t* wavHeader = fatTools.GetClusterAddr(wav.cluster, true);
 
 			// Jump through chunks looking for 'fmt' chunk
@@ -641,7 +1425,7 @@ void WaveTable::FixUnaligned()
 			}
 
 			if ((chunkSize % 4) == 2) {
-				printf("Updating %8.8s...\r\n", wav.name);
+				printf("Updating %8.8s...\r\n", catalogue.name[i]);
 				DelayMS(2);
 
 				// Reconstruct the first sector of the file with a truncated fmt section
@@ -651,7 +1435,7 @@ void WaveTable::FixUnaligned()
 					buffer[b] = buffer[b + 2];						// shuffle up remaing data in sector
 				}
 
-				uint32_t sector = (uint32_t)(wavHeader - flashAddress) / fatSectorSize;		// Calculate sector from address
+				uint32_t sector = (uint32_t)(wavHeader - flashDevice->ReadMapped(0)) / fatSectorSize;		// Calculate sector from address
 				fatTools.Write(buffer, sector, 1);
 
 				// Shuffle data down 2 bytes for the remaining sectors
@@ -666,12 +1450,12 @@ void WaveTable::FixUnaligned()
 					}
 				}
 				refresh = true;
-				printf("Updated %8.8s\r\n", wav.name);
+				printf("Updated %8.8s\r\n", catalogue.name[i]);
 			}
 		}
 	}
 	if (refresh) {
-		wavetable.UpdateWavetableList();
+		wavetable.UpdateWavetableList(true);				// Files rewritten without changing directory entries
 	} else {
 		printf("No suitable unaligned wavetables found\r\n");
 	}
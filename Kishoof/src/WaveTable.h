@@ -1,25 +1,36 @@
 #pragma once
 
 #include <string_view>
+#include <utility>
+#include <bit>
 
 #include "initialisation.h"
 #include "Filter.h"
+#include "HalfBand.h"
 #include "FatTools.h"
+#include "Catalogue.h"
 #include "configManager.h"
-#include "UI.h"
+#include "ui.h"
 
 
 struct WaveTable {
 	friend class CDCHandler;					// Allow the serial handler access to private data for debug printing
 	friend class Config;						// Allow the config access to private data to save settings
 	friend class UI;
+	friend class Renderer;						// Offline renderer sets switch state directly
+	friend class HostTests;						// Host tests inspect cache and playback state
 public:
-	void CalcSample();							// Called by interrupt handler to generate next sample
+	void OutputBlock(int32_t* outBuffer);		// Called by DMA interrupt handler to fill half of the I2S buffer
+	void RenderBlock(float* outA, float* outB, const size_t n);	// Generate n (up to audioBlockSize) samples for each channel (hardware independent)
+	void ResetPlayback(const volatile ADCValues* source);	// Reset oscillator state and select source of control values
 	void Init();								// Initialise caches, buffers etc
 	void CalcAdditive();
 	bool LoadWaveTable(uint32_t* startAddr);
 	void Draw();
-	void UpdateWavetableList();
+	void UpdateWavetableList(const bool rescan = false);	// Rescan forces all wavetable headers to be parsed again
+	void SaveIndex();							// Write wavetable list index to flash once list has been stable for a period
+	void UpdateCache();							// Decode active wavetable into RAM when it changes
+	void UpdateMipMaps();						// Build band-limited mip levels when active wavetable changes
 	void ChangeWaveTable(const int32_t index);
 	void ChannelBOctave(bool change = false);	// Called when channel B octave button is pressed
 	void WarpButton(bool change);				// Called when warp button is pressed
@@ -42,7 +53,7 @@ public:
 
 	enum class Warp {none, squeeze, bend, mirror, tzfm, count} warpType = Warp::none;		//, reverse
 	static constexpr std::string_view warpNames[] = {"No Warp", "Squeeze", "Bend", "Mirror", "TZFM"};		// "Reverse",
-	static constexpr uint32_t harmonicCount = 10;
+	static constexpr uint32_t harmonicCount = 64;
 
 	enum class AdditiveType : uint8_t {none = 0, sine1 = 1, sine2 = 2, sine3 = 3, sine4 = 4, sine5 = 5, sine6 = 6, square = 7, saw = 8, triangle = 9};
 	uint32_t harmonicSets;
@@ -59,69 +70,183 @@ public:
 	}
 
 private:
-	static constexpr uint32_t maxWavetable = 1000;
 	static constexpr size_t lfnSize = 12;							// Widest string that can be displayed
 	static constexpr float scaleOutput = -std::pow(2.0f, 31.0f);	// Multiple to convert -1.0 - 1.0 float to 32 bit int and invert
 	static constexpr float scaleVCAOutput = scaleOutput / 65536.0f;	// To scale when VCA is used
-	enum Invalid : uint8_t {OK = 0, Fragmented, HeaderCorrupt, SampleFormat, ChannelCount, EmptyFolder, Unaligned, End};
-	const char* InvalidText[Invalid::End] {"OK", "Fragged", "Corrupt", "Format", "Channels", "Empty", "Unaligned"};
+	using Invalid = Catalogue::Invalid;
 
-	struct Wav {
-		char name[8];
-		char lfn[lfnSize];
-		uint32_t dir;						// Index into the wavList array to entry containing directory item
+	// Supported frame lengths: sample kernels are instantiated for each power of 2 in range
+	static constexpr uint32_t minFrameSize = 256;
+	static constexpr uint32_t maxFrameSize = 4096;
+	static constexpr uint32_t frameSizeCount = std::countr_zero(maxFrameSize) - std::countr_zero(minFrameSize) + 1;
+
+	using Wav = Catalogue::Wav;
+	struct WavInfo : Wav {					// Header details only needed while parsing or printing
 		uint32_t size;						// Size of file in bytes
-		uint32_t cluster;					// Starting cluster
-		uint32_t lastCluster;				// If file spans multiple clusters store last cluster before jump - if 0xFFFFFFFF then clusters are contiguous
-		const uint8_t* startAddr;			// Address of data section
-		union {
-			uint32_t dataSize;				// Size of data section in bytes
-			uint32_t firstWav;				// For directories holds the index of the first file
-		};
+		uint32_t dataSize;					// Size of data section in bytes
 		uint32_t sampleCount;				// Number of samples (stereo samples only counted once)
-		uint8_t byteDepth;					// 4 = 32 bit, 2 = 16 bit etc
+		uint32_t lastCluster;				// If file spans multiple clusters store last cluster before jump - if 0xFFFFFFFF then clusters are contiguous
+		uint32_t metadata;					// Serum metadata
 		uint16_t dataFormat;				// 1 = PCM; 3 = Float
+		uint8_t byteDepth;					// 4 = 32 bit, 2 = 16 bit etc
 		uint8_t channels;					// 1 = mono, 2 = stereo
-		uint16_t tableCount;				// Number of 2048 sample wavetables in file
-		uint32_t metadata;					// Serum metadata
-		SampleType sampleType;
-		Invalid invalid;					// Code indicating why wav is invalid
-		bool isDir;
-		bool fragmented;
-	} wavList[maxWavetable];
+	};
 
-	// In case file is fragmented store cluster chain on loading
-	struct clusterList {
-		const uint8_t* startAddr;			// Address of data section
-		const uint8_t* endAddr;				// End Address of data section
-	} fragChain[16];
+	// Block loops selected once per block: sample loops take read position and pitch increment per sample (or sub-sample, with the
+	// wavetable position ramped every step samples); warp loops output channel A's read position and pitch increment per sub-sample
+	using SampleLoop = void (WaveTable::*)(const Wav& wav, const uint8_t channel, const float* readPos, const float* inc, float* out, const size_t n, const uint32_t step);
+	using WarpLoop = void (WaveTable::*)(const float* readPos, const float* inc, const float* modulator, float* warpPos, float* warpInc, const size_t n);
+	template<SampleType sampleType, bool steppedMode, uint32_t frameSize> void OutputSamples(const Wav& wav, const uint8_t channel, const float* readPos, const float* inc, float* out, const size_t n, const uint32_t step);
+	void MuteSamples(const Wav&, const uint8_t, const float*, const float*, float* out, const size_t n, const uint32_t);	// Zeroes output of a corrupt wavetable
+	template<SampleType sampleType, bool steppedMode, uint32_t frameSize> void OutputSample(const Wav& wav, const uint8_t channel, const float readPos);
+	template<SampleType sampleType, uint32_t frameSize> float MipSample(const Wav& wav, const uint32_t frame, const float readPos, const float pitchInc);
+	template<SampleType sampleType, uint32_t frameSize> float SourceSample(const Wav& wav, const uint32_t frame, const float readPos);
+	float MipLevelSample(const uint32_t frame, const uint32_t level, const float readPos);
+	float FastTanh(const float x);
+	template<Warp warp> void WarpSamples(const float* readPos, const float* inc, const float* modulator, float* warpPos, float* warpInc, const size_t n);
+	template<Warp warp> float CalcWarp(const float pos, const float modulator);
+	void OutputChannelA(const Wav& wav, const SampleLoop sampleLoopA, const WarpLoop warpLoopA, const float* readPos, const float* inc, const float* modulator, float* out, const size_t n);
+	void UpdateOversampling();
+	void UpdateWarpType();
+	void UpdateControls(const size_t n);
+	void UpdateAdditive(const size_t n);
+	float AdditiveWave(const float readPos);
+	Wav PlaybackWav(const uint32_t index);
+	void BrokenChain(const uint32_t request);
+	void GetWavInfo(WavInfo& wav);
+	bool GetEntryInfo(const uint32_t index, WavInfo& wav);
+	enum class ListUpdate {unchanged, incremental, rescan, indexed};
+	ListUpdate RefreshWavetableList();
+	ListUpdate LoadIndex();
+	void QueueIndex();
+	bool RefreshDir(const uint32_t dirIndex, const uint32_t dirCluster, const uint32_t hash);
+	void ScanWavetableList();
+	uint32_t ReadDir(const uint32_t dirCluster, const uint32_t dirIndex, const bool store, const uint32_t first, const uint32_t space, const uint32_t reuse, const uint32_t reuseCount);
+	static uint32_t DirHash(const uint32_t dirCluster);
+	static uint32_t FileStamp(const FATFileInfo* dirEntry);
+	static uint32_t FatHash();
+	static uint32_t Hash(const void* data, const uint32_t bytes, uint32_t hash = 2166136261);
+	std::string_view CleanLFN();
 
+	float defaultWavetable[3 * defaultFrameSize];	// Built-in wavetables
 
-	void OutputSample(const uint8_t channel, const float ratio);
-	float FastTanh(const float x);
-	float CalcWarp();
-	void AdditiveWave();
-	void GetWavInfo(Wav& wav);
-	void ReadDir(const FATFileInfo* dirEntry, const uint32_t dirIndex);
-	void CleanLFN(char* storeName);
-	static bool WavetableSorter(Wav const& lhs, Wav const& rhs);
-	void FragChain();
-
-	float defaultWavetable[3 * 2048];			// Built-in wavetables
-	float outputSamples[2] = {0.0f, 0.0f};		// Preprepared samples sent to DAC on interrupt
+	// Band-limited mip levels: level n holds harmonics below 1024 / 2^n, 2x oversampled in a table of 4096 / 2^n samples
+	// Built for frame lengths up to 2048; longer frames are always played through the anti-aliasing filter
+	static constexpr uint32_t mipLevels = 7;						// Matches range of pitch increments covered by FIR filter LUT
+	static constexpr uint32_t mipFrameSize = 4096 - (4096 >> mipLevels);	// Samples used by all levels of one frame
+	static constexpr uint32_t mipMaxFrames = 32;					// Wavetables with more frames use the FIR filter
+	static constexpr float mipScale = 1.0f / 16384.0f;				// Mip data stored as Q14 to allow headroom for overshoot
+	static constexpr uint32_t noMipMap = 0xFFFFFFFF;
+	int16_t mipBuffer[mipMaxFrames * mipFrameSize];
+	std::complex<float> fftBuffer[defaultFrameSize];	// Working buffers for building mip levels
+	std::complex<float> mipFFTBuffer[defaultFrameSize];
+	volatile uint32_t mipWaveTable = noMipMap;	// Index of wavetable whose mip levels are ready for playback
+	volatile uint32_t mipRequest = noMipMap;	// Index of wavetable mip levels were last requested for
+
+	// Active wavetable decoded to Q15 in RAM so playback continues while the external flash is busy with USB transfers or cache flushes
+	// Double-buffered: a new wavetable is decoded into the slot not being played and then swapped in
+	static constexpr uint32_t cacheSamples = mipMaxFrames * defaultFrameSize;	// Larger wavetables are played from flash
+	static constexpr uint32_t noCache = 0xFFFFFFFF;
+	int16_t cacheBuffer[2][cacheSamples];
+	Wav cacheWav[2];							// Copy of catalogue entry for each slot with data address pointing to cache buffer
+	char cacheName[2][8];						// Short name of wavetable in each slot
+	uint32_t cacheWaveTable[2] = {noCache, noCache};	// Index of wavetable held in each slot
+	volatile uint32_t cacheSlot = 0;			// Slot used for playback
+	uint32_t cacheRequest = noCache;			// Index of wavetable cache was last requested for
+	uint32_t cacheLoadTime = 0;					// Time in ms to load most recent wavetable into cache
+	float outputSamples[2] = {0.0f, 0.0f};		// Most recently calculated samples for each channel
 	float oldOutputSamples[2] = {0.0f, 0.0f};	// Previous output samples used for cross-fading
 	float crossfade = 0.0f;						// Amount of cross-fade
 
-	uint32_t activeWaveTable;					// Index of active wavetable in wavList
+	// Channel A is oversampled when the mirror folds or TZFM modulation would alias, with the warp and sample kernel run at 2x or 4x
+	static constexpr uint32_t maxOversample = 4;
+	static constexpr float mirrorAliasInc = 24.0f;	// Fastest read speed through mirror folds at 1x (aliasing around -60dB)
+	static constexpr float tzfmAliasRatio = 0.5f;	// Largest TZFM deviation per sample at 1x as a multiple of the pitch increment
+	HalfBandDecimator<63, 7.0f> decimator2x;	// 2x to 1x: flat to 20kHz, rejects 80dB from 28kHz
+	HalfBandDecimator<19, 8.0f> decimator4x;	// 4x to 2x: only has to reject content which would fold below 28kHz
+	uint32_t oversample = 1;					// Current oversampling factor for channel A
+	uint32_t oversampleMode = 0;				// 0 = automatic; otherwise forced oversampling factor (set over serial)
+	float prevModulator = 0.0f;					// Channel B output of previous sample: interpolated for TZFM sub-samples
+	float modulatorSlope = 0.0f;				// Peak sample to sample change in channel B, held over recent blocks
+	static constexpr float modulatorSlopeRelease = 0.99f;	// Per block decay of the held slope (half-life 46ms) so the factor does not toggle within a cycle
+
+	uint32_t activeWaveTable;					// Index of active wavetable in catalogue
 	uint32_t wavetableCount;					// number of wavetables and directories found in file system
+	uint32_t rootDirHash = 0;					// Hash of root directory entries at last scan
+	bool listScanned = false;					// Set after first full scan: later updates only re-read changed directories
+	ListUpdate listUpdate = ListUpdate::rescan;	// Type and duration of most recent wavetable list update for diagnostics
+	uint32_t listUpdateTime = 0;
+	static constexpr std::string_view listUpdateNames[] = {"Unchanged", "Incremental", "Full scan", "Index"};
+	ListUpdate bootListUpdate = ListUpdate::rescan;	// Type and duration of wavetable list build at boot
+	uint32_t bootListTime = 0;
+
+	// Wavetable list index: stored after the file system in the unused end of the external flash (not visible over USB).
+	// Header is in the first block and the catalogue follows. The FAT hash identifies the
+	// file system the list was built from: if it matches at boot the list is loaded and only directories with changed hashes re-read
+	struct IndexHeader {
+		char magic[4];
+		uint32_t version;						// Increase when Wav struct or header parsing changes
+		uint32_t catalogueSize;
+		uint32_t count;							// Number of catalogue entries in use
+		uint32_t fatHash;						// Hash of FAT cluster chain when list was built
+		uint32_t rootDirHash;
+		uint32_t generation;					// Incremented on each save
+		uint32_t checksum;						// Hash of header fields above and entries
+	};
+	static constexpr uint32_t indexVersion = 3;
+	static constexpr uint32_t indexAddress = fatSectorCount * fatSectorSize;	// Relative to start of flash; 4096 byte aligned
+	static constexpr uint32_t indexCatalogueAddress = indexAddress + fatClusterSize;
+	static constexpr uint32_t indexSaveDelay = 5000;	// Wait for list to be stable for X ms before saving
+	static_assert(indexCatalogueAddress + Catalogue::budget <= 64 * 1024 * 1024, "Wavetable index does not fit in flash");
+	uint32_t indexFatHash = 0;					// FAT hash when list was last updated
+	uint32_t indexGeneration = 0;
+	uint32_t indexSaveBooked = 0;				// Time of list update that scheduled a save
+	bool indexDirty = false;					// List has changed since index was saved or loaded
+	static constexpr uint32_t indexBlocks = (sizeof(Catalogue) + fatClusterSize - 1) / fatClusterSize;
+	static constexpr uint32_t maxIndexSaveMicros = (indexBlocks + 1) * BlockDevice::typicalBlockMicros;	// MSC pause with typical flash times
+	uint32_t indexHeader[64];					// Header of save in progress: flash is written in 256 byte pages
+	uint32_t indexQueuedBlocks = 0;				// Catalogue blocks queued by save in progress; header is queued last
+	uint32_t indexSaveStart = 0;
+	uint32_t indexSaveTime = 0;					// Duration of last save in ms
+
+	// Control rate smoothing: the one pole filter is run once per block with the per sample time constant, and its output ramped linearly across the block
+	static constexpr float controlSmoothing = 0.99f;				// Per sample smoothing coefficient of control values
+	struct ControlRamp {
+		float smoothed = 0.0f;					// Filter output at end of block
+		float val = 0.0f;						// Ramped value for current sample
+		float inc = 0.0f;						// Per sample ramp increment
+
+		void Update(const float target, const float blockCoeff, const size_t n) {
+			val = smoothed;
+			smoothed = target + blockCoeff * (smoothed - target);
+			inc = (smoothed - val) / n;
+		}
+		float Next() {
+			val += inc;
+			return val;
+		}
+	};
 
-	float smoothedInc = 0.0f;					// For smoothing pitch CV
+	ControlRamp smoothedInc;					// For smoothing pitch CV
+
+	// Additive engine: harmonic levels are calculated at block rate and ramped per sample; harmonics are generated in lanes of four
+	static constexpr uint32_t additiveLanes = 4;
+	float harmonicLevel[harmonicCount] = {};	// Harmonic levels at start of block
+	float harmonicDelta[harmonicCount] = {};	// Change in harmonic levels over block
+	uint32_t activeHarmonics = 0;				// Harmonics with non-zero level below nyquist, rounded up to a multiple of lanes
+	float additiveRamp = 0.0f;					// Position in block from 0.0 to 1.0 for ramping harmonic levels
+	float additiveRampInc = 0.0f;
 	float pitchInc[2] = {0.0f, 0.0f};			// Pitch increment - reciprocal used in anti-aliasing filter calculations
 	float readPos[2] = {0.0f, 0.0f};			// Wavetable read position for each channel
 
+	const volatile ADCValues* controls = &adc;	// Control values: ADC DMA buffer or offline render script
 	bool stepped = false;						// Store Stepped/Smooth switch position
+	float octave = 1.0f;						// Pitch multiplier from octave switch
+	bool mixChnB = false;						// Channel B mix switch position
+	bool ringModChnB = false;					// Channel B ring mod switch position
+	SampleLoop sampleLoop = nullptr;			// Channel A sample loop used in previous block
 	int32_t warpTypeVal = 0;					// Used for setting hysteresis on warp type
-	float warpAmt = 0.0f;						// Used for smoothing control values
+	ControlRamp warpAmt;						// Used for smoothing control values
 
 	char longFileName[100];						// Holds long file name as it is made from multiple fat entries
 	uint8_t lfnPosition = 0;
@@ -131,20 +256,19 @@ private:
 	static constexpr float drawHeightMult = (float)(UI::waveDrawHeight - 4) / 2.0f;		// Scale to height of the LCD draw area
 
 	struct {
-		volatile uint16_t& adcPot;
-		volatile uint16_t& adcCV;
-		volatile uint16_t* adcTrimmer;
-		float pos;		// Smoothed ADC value
-
-		float Val() {
-			constexpr float scaleOutput = 0.01f / 65536.0f;			// scale constant for two 16 bit values and filter
-			const float trimmer = (adcTrimmer == nullptr) ? 1.0f : NormaliseADC(*adcTrimmer);
-			const float cv = std::max(61300.0f - adcCV, 0.0f);		// Reduce to ensure can hit zero with noise
-			pos = (0.99f * pos) + std::clamp((adcPot + trimmer * cv), 0.0f, 65535.0f) * scaleOutput;
-			return pos;
+		uint16_t ADCValues::* adcPot;
+		uint16_t ADCValues::* adcCV;
+		uint16_t ADCValues::* adcTrimmer;
+		ControlRamp pos;						// Smoothed ADC value
+
+		float Target(const volatile ADCValues& controls) {
+			constexpr float scaleOutput = 1.0f / 65536.0f;			// scale constant for two 16 bit values
+			const float trimmer = (adcTrimmer == nullptr) ? 1.0f : NormaliseADC(controls.*adcTrimmer);
+			const float cv = std::max(61300.0f - controls.*adcCV, 0.0f);		// Reduce to ensure can hit zero with noise
+			return std::clamp((controls.*adcPot + trimmer * cv), 0.0f, 65535.0f) * scaleOutput;
 		}
-	} wavetablePos[2] = {{adc.Wavetable_Pos_A_Pot, adc.WavetablePosA_CV, &adc.Wavetable_Pos_A_Trm, 0.0f},
-						 {adc.Wavetable_Pos_B_Pot, adc.WavetablePosB_CV, nullptr, 0.0f}};
+	} wavetablePos[2] = {{&ADCValues::Wavetable_Pos_A_Pot, &ADCValues::WavetablePosA_CV, &ADCValues::Wavetable_Pos_A_Trm},
+						 {&ADCValues::Wavetable_Pos_B_Pot, &ADCValues::WavetablePosB_CV, nullptr}};
 
 
 	static inline float NormaliseADC(uint16_t adcVal)
@@ -103,6 +103,8 @@ void InitHardware()
 
 void InitCache()
 {
+	RCC->AHB2ENR |= RCC_AHB2ENR_AHBSRAM1EN | RCC_AHB2ENR_AHBSRAM2EN;	// Enable AHB SRAM clocks (used for wavetable catalogue)
+
 	// Use the Memory Protection Unit (MPU) to set up a region of memory with data caching disabled for use with DMA buffers
 	MPU->RNR = 0;									// Memory region number
 	extern uint32_t _dma_addr;						// Get the start of the dma buffer from the linker
@@ -395,7 +397,7 @@ void InitI2S()
 
 	SPI2->CFG1 |= SPI_CFG1_UDRCFG_1;				// In the event of underrun resend last transmitted data frame
 	SPI2->CFG1 |= 0x1f << SPI_CFG1_DSIZE_Pos;		// Data size to 32 bits (FIFO holds 16 bytes = 4 x 32 bit words)
-	SPI2->CFG1 |= 1 << SPI_CFG1_FTHLV_Pos;			// FIFO threshold level. 0001: 2-data; 0010: 3 data; 0011: 4 data
+	SPI2->CFG1 |= SPI_CFG1_TXDMAEN;					// Tx DMA request enable (FIFO threshold left at 1 data to match single DMA transfers)
 
 	/* I2S Clock
 		PLL2: ((8MHz / 5) * 192 / 5) = 61.44 MHz
@@ -405,17 +407,35 @@ void InitI2S()
 	RCC->CDCCIP1R |= RCC_CDCCIP1R_SPI123SEL_0;		// 001: pll2_p_ck clock selected as SPI/I2S1,2 and 3 kernel clock
 	SPI2->I2SCFGR |= (10 << SPI_I2SCFGR_I2SDIV_Pos);	// Set I2SDIV to 10
 
-	SPI2->IER |= (SPI_IER_TXPIE | SPI_IER_UDRIE);	// Enable interrupt when FIFO has free slot or underrun occurs
+	SPI2->IER |= SPI_IER_UDRIE;						// Enable interrupt when underrun occurs (samples are supplied by DMA)
 	NVIC_SetPriority(SPI2_IRQn, 2);					// Lower is higher priority
 	NVIC_EnableIRQ(SPI2_IRQn);
 
-	SPI2->CR1 |= SPI_CR1_SPE;						// Enable I2S
+	// Configure circular DMA to stream the audio buffer to the I2S FIFO: half and full transfer interrupts trigger block rendering
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+	DMA1_Stream3->CR &= ~DMA_SxCR_EN;
+	DMA1_Stream3->CR |= DMA_SxCR_CIRC;				// Circular mode to keep refilling FIFO
+	DMA1_Stream3->CR |= DMA_SxCR_MINC;				// Memory in increment mode
+	DMA1_Stream3->CR |= DMA_SxCR_PSIZE_1;			// Peripheral size: 8 bit; 01 = 16 bit; 10 = 32 bit
+	DMA1_Stream3->CR |= DMA_SxCR_MSIZE_1;			// Memory size: 8 bit; 01 = 16 bit; 10 = 32 bit
+	DMA1_Stream3->CR |= DMA_SxCR_DIR_0;				// data transfer direction: 00: peripheral-to-memory; 01: memory-to-peripheral; 10: memory-to-memory
+	DMA1_Stream3->CR |= DMA_SxCR_PL_1;				// Priority: 00 = low; 01 = Medium; 10 = High; 11 = Very High
+	DMA1_Stream3->CR |= DMA_SxCR_HTIE | DMA_SxCR_TCIE;	// Half transfer and transfer complete interrupts
+	DMA1->LIFCR = 0x3F << DMA_LIFCR_CFEIF3_Pos;		// clear all five interrupts for this stream
+
+	DMAMUX1_Channel3->CCR |= 40; 					// DMA request MUX input 40 = SPI2_TX (See p.653)
+	DMAMUX1_ChannelStatus->CFR |= DMAMUX_CFR_CSOF3; // Channel 3 Clear synchronization overrun event flag
 
-	SPI2->TXDR = (int32_t)0;						// Preload the FIFO
-	SPI2->TXDR = (int32_t)0;
-	SPI2->TXDR = (int32_t)0;
-	SPI2->TXDR = (int32_t)0;
+	DMA1_Stream3->NDTR = audioBufferLength;			// Number of data items to transfer (ie size of audio buffer)
+	DMA1_Stream3->PAR = reinterpret_cast<uint32_t>(&(SPI2->TXDR));	// Configure the peripheral data register address
+	DMA1_Stream3->M0AR = reinterpret_cast<uint32_t>(audioBuffer);	// Configure the memory address
 
+	NVIC_SetPriority(DMA1_Stream3_IRQn, 2);			// Lower is higher priority
+	NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+
+	DMA1_Stream3->CR |= DMA_SxCR_EN;				// Enable DMA before I2S so FIFO is filled on start
+
+	SPI2->CR1 |= SPI_CR1_SPE;						// Enable I2S
 	SPI2->CR1 |= SPI_CR1_CSTART;					// Start I2S
 }
 
@@ -427,6 +447,12 @@ void InitDebugTimer()
 	RCC->APB1LENR |= RCC_APB1LENR_TIM3EN;
 	TIM3->ARR = 65535;
 	TIM3->PSC = 2;
+
+	// Enable DWT cycle counter used by audio profiler
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55;							// Unlock DWT registers (Cortex-M7)
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 }
 
 
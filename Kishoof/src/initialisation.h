@@ -11,7 +11,10 @@ extern bool SafeMode;
 
 static constexpr uint32_t sysTickInterval = 1000;					// Set in uS so 1000uS = 1ms
 constexpr uint32_t sampleRate = 48000;
-enum class SampleType {Unsupported, Float32, PCM16};
+static constexpr uint32_t audioBlockSize = 32;							// Number of samples per channel rendered on each DMA half transfer
+static constexpr uint32_t audioBufferLength = audioBlockSize * 2 * 2;	// Circular I2S DMA buffer: two halves of interleaved stereo samples
+enum class SampleType : uint8_t {Unsupported, Float32, PCM16};
+static constexpr uint32_t defaultFrameSize = 2048;					// Samples per wavetable frame if not set in metadata; also range of read position
 
 static constexpr uint32_t ADC1_BUFFER_LENGTH = 6;
 static constexpr uint32_t ADC2_BUFFER_LENGTH = 6;
@@ -32,6 +35,7 @@ struct ADCValues {
 };
 
 extern volatile ADCValues adc;
+extern int32_t audioBuffer[audioBufferLength];
 extern GpioPin debugPin1;			// PD5: Debug
 extern GpioPin debugPin2;			// PD6: Debug
 
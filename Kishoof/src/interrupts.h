@@ -11,8 +11,28 @@ void SPI2_IRQHandler()
 		SPI2->IFCR |= SPI_IFCR_UDRC;					// Clear underrun condition
 		++underrun;
 	}
+}
+
+
+void DMA1_Stream3_IRQHandler()
+{
+	// I2S DMA half/full transfer: render the next block into the half of the circular buffer not currently being read
+	const uint32_t status = DMA1->LISR;
+	DMA1->LIFCR = DMA_LIFCR_CHTIF3 | DMA_LIFCR_CTCIF3;
+	if ((status & DMA_LISR_HTIF3) && (status & DMA_LISR_TCIF3)) {		// Rendering has fallen a whole block behind
+		++underrun;
+	}
+
+	// NDTR counts down: whilst the DMA is reading the second half of the buffer the first half can be rendered
+	const bool firstHalf = DMA1_Stream3->NDTR <= audioBufferLength / 2;
+	wavetable.OutputBlock(&audioBuffer[firstHalf ? 0 : audioBufferLength / 2]);
+}
 
-	wavetable.CalcSample();
+
+void OCTOSPI1_IRQHandler()
+{
+	// Status match when a queued flash program or erase has completed
+	extFlash.StatusMatch();
 }
 
 
@@ -7,7 +7,7 @@
 #include "Filter.h"
 #include "lcd.h"
 #include "ExtFlash.h"
-#include "UI.h"
+#include "ui.h"
 #include "uartHandler.h"
 
 volatile uint32_t SysTickVal;
@@ -15,6 +15,7 @@ extern uint32_t SystemCoreClock;
 bool SafeMode = false;				// Disables file system mounting, USB MSC drive is disabled, don't load config
 
 volatile ADCValues __attribute__((section (".dma_buffer"))) adc;	// Store adc buffer in non-cached memory area
+int32_t __attribute__((section (".dma_buffer"))) audioBuffer[audioBufferLength];	// I2S circular DMA buffer
 
 Config config{&wavetable.configSaver, &calib.configSaver, &ui.configSaver};		// Construct config handler with list of configSavers
 
@@ -42,13 +43,17 @@ int main(void) {
 	}
 	wavetable.Init();
 	usb.Init(false);
-	InitI2S();						// Initialise I2S which will start main sample interrupts
+	InitI2S();						// Initialise I2S and circular DMA which will start block rendering interrupts
 
 	while (1) {
 		usb.cdc.ProcessCommand();	// Check for incoming USB serial commands
 		ui.Update();
+		usb.msc.ProcessDeferredWrite();	// Write USB data that needed a write cache block written to Flash
 		fatTools.CheckCache();		// Check if any outstanding cache changes need to be written to Flash
+		wavetable.UpdateCache();	// Decode active wavetable into RAM if it has changed
+		wavetable.UpdateMipMaps();	// Build band-limited mip levels if the active wavetable has changed
 		config.SaveConfig();		// Save any scheduled changes
+		wavetable.SaveIndex();		// Save wavetable list index once list has stopped changing
 		CheckVCA();					// Bodge to check if VCA is normalled to 3.3v
 		calib.Calibrate();
 #if (USB_DEBUG)
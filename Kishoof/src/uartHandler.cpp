@@ -1,5 +1,5 @@
 #include "uartHandler.h"
-#include "usb.h"
+#include "USB.h"
 #include "FatTools.h"
 
 UART uart;
@@ -19,10 +19,10 @@ void UI::DrawWaveTable()
 		timedInfo = TimedInfo::none;
 
 		const char* buff;
-		if (wavetable.wavList[activeWaveTable].invalid) {
-			buff = wavetable.InvalidText[wavetable.wavList[activeWaveTable].invalid];
+		if (catalogue.invalid[activeWaveTable]) {
+			buff = Catalogue::InvalidText[catalogue.invalid[activeWaveTable]];
 		} else {
-			snprintf(charBuff, 13, "Frames %d", wavetable.wavList[activeWaveTable].tableCount);
+			snprintf(charBuff, 13, "Frames %d", catalogue.tableCount[activeWaveTable]);
 			buff = charBuff;
 		}
 
@@ -47,15 +47,13 @@ void UI::DrawWaveTable()
 	} else if (activeWaveTable != oldWavetable) {
 		oldWavetable = activeWaveTable;
 
-		std::string_view s;
-		if (wavetable.wavList[activeWaveTable].lfn[0]) {
-			s = std::string_view(wavetable.wavList[activeWaveTable].lfn);
-		} else {
-			uint32_t space = (std::string_view(wavetable.wavList[activeWaveTable].name)).find(" ");
-			s = std::string_view(wavetable.wavList[activeWaveTable].name, std::min(8UL, space));		// Replace spaces with 0 for length finding
+		std::string_view s = catalogue.LongName(activeWaveTable);
+		if (s.empty()) {
+			s = std::string_view(catalogue.name[activeWaveTable], 8);
+			s = s.substr(0, s.find(" "));						// Short names are padded with spaces
 		}
 
-		const uint16_t colour = pickerDir ? RGBColour::Yellow : wavetable.wavList[activeWaveTable].invalid ? RGBColour::LightGrey : RGBColour::White;
+		const uint16_t colour = pickerDir ? RGBColour::Yellow : catalogue.invalid[activeWaveTable] ? RGBColour::LightGrey : RGBColour::White;
 		lcd.DrawStringMemCenter(0, 0, wideTextWidth, lcd.drawBuffer[activeDrawBuffer], s, lcd.Font_Large, colour, RGBColour::Black);
 		lcd.PatternFill(wideTextLeft, uppertextTop, wideTextLeft - 1 + wideTextWidth, uppertextTop - 1 + lcd.Font_Large.Height, lcd.drawBuffer[activeDrawBuffer]);
 
@@ -68,7 +66,7 @@ void UI::DrawWaveTable()
 	} else {
 
 		// Set up positions for drawing markers representing the quantised wavetable position and warp amount
-		const float warpPos = (float)wavetable.warpAmt * (1.0f / 65535.0f);
+		const float warpPos = wavetable.warpAmt.val * (1.0f / 65535.0f);
 		const uint32_t bottomLine = (waveDrawHeight - 1);		// Pixel order is across then down
 		const uint32_t middleLine = ((waveDrawHeight / 2) - 1);
 		DrawPositionMarker(bottomLine, true, warpPos, RGBColour::LightGrey);
@@ -168,7 +166,7 @@ void UI::SetWavetable(const int32_t index)
 	// Allows wavetable class to set current wavetable at Init
 	oldWavetable = 0xFFFFFFFF;
 	activeWaveTable = index;
-	pickerDir = wavetable.wavList[index].isDir;
+	pickerDir = catalogue.IsDir(index);
 
 }
 
@@ -177,13 +175,10 @@ uint32_t UI::WavetablePicker(const int32_t upDown)
 {
 	// Selects next/previous wavetable, unless directory in which case it can be opened
 	const int32_t nextWavetable = (int32_t)activeWaveTable + upDown;
-	auto& currentWT = wavetable.wavList[activeWaveTable];
-	auto& nextWT = wavetable.wavList[nextWavetable];
-
-	if (nextWavetable >= 0 && nextWavetable < (int32_t)wavetable.wavetableCount && nextWT.dir == currentWT.dir) {
+	if (nextWavetable >= 0 && nextWavetable < (int32_t)wavetable.wavetableCount && catalogue.dir[nextWavetable] == catalogue.dir[activeWaveTable]) {
 		activeWaveTable = nextWavetable;
-		pickerDir = nextWT.isDir;
-		if (!pickerDir && !nextWT.invalid) {
+		pickerDir = catalogue.IsDir(nextWavetable);
+		if (!pickerDir && !catalogue.invalid[nextWavetable]) {
 			wavetable.ChangeWaveTable(nextWavetable);
 		}
 	}
@@ -210,7 +205,7 @@ void UI::Update()
 	if (buttons.encoder.Pressed()) {
 		// If directory selected by picker, click opens folder
 		if (pickerDir) {
-			activeWaveTable = wavetable.wavList[activeWaveTable].firstWav;
+			activeWaveTable = catalogue.firstWav[activeWaveTable];
 			WavetablePicker(0);
 		} else {
 			switch (cfg.displayWave) {
@@ -4,6 +4,8 @@
 #include "WaveTable.h"
 #include "ExtFlash.h"
 #include "Calib.h"
+#include "Renderer.h"
+#include "Profiler.h"
 #include <stdio.h>
 #include <charconv>
 
@@ -12,7 +14,9 @@ uint32_t flashBuff[8192];
 // Check if a command has been received from USB, parse and action as required
 void CDCHandler::ProcessCommand()
 {
-	if (!cmdPending) {
+	// Commands may read flash or change the list: wait for queued writes (a cache flush or index save takes at most
+	// FatTools::maxFlushMicros or WaveTable::maxIndexSaveMicros with typical flash times)
+	if (!cmdPending || !flashDevice->QueueIdle() || fatTools.indexQueued) {
 		return;
 	}
 
@@ -67,6 +71,13 @@ void CDCHandler::ProcessCommand()
 				"Config sector: %lu; address: %p\r\n"
 				"Sample buffer underrun: %lu\r\n"
 				"Flash busy: %lu\r\n"
+				"Interpolation: %s\r\n"
+				"Playback: %s (cache load %lu ms)\r\n"
+				"Polyphase filter bank: %lu bytes (built in %lu ms)\r\n"
+				"Channel A oversampling: %lux (%s)\r\n"
+				"Wavetable list: %lu of %lu entries; name pool %lu of %lu bytes; last update: %s in %lu ms\r\n"
+				"Wavetable index: generation %lu%s, saved in %lu ms; boot: %s in %lu ms\r\n"
+				"Last flash flush: %lu blocks in %lu ms; write cache evictions: %lu (%lu writes deferred)\r\n"
 				"\r\n"
 				, __DATE__, __TIME__,
 				calib.cfg.pitchBase,
@@ -76,7 +87,29 @@ void CDCHandler::ProcessCommand()
 				config.currentSector,
 				config.flashConfigAddr + config.currentSettingsOffset / 4,
 				underrun,
-				flashBusy
+				flashBusy,
+				wavetable.mipWaveTable == wavetable.activeWaveTable ? "Mip levels" : Filter::tierNames[(uint8_t)filter.tier].data(),
+				wavetable.cacheWaveTable[wavetable.cacheSlot] == wavetable.activeWaveTable ? "RAM cache" : "Flash",
+				wavetable.cacheLoadTime,
+				Filter::polyphaseBytes,
+				filter.lutBuildTime,
+				wavetable.oversample,
+				wavetable.oversampleMode == 0 ? "auto" : "fixed",
+				wavetable.wavetableCount,
+				Catalogue::capacity,
+				catalogue.poolUsed * 4,
+				Catalogue::poolWords * 4,
+				WaveTable::listUpdateNames[(uint32_t)wavetable.listUpdate].data(),
+				wavetable.listUpdateTime,
+				wavetable.indexGeneration,
+				wavetable.indexDirty ? " (save pending)" : "",
+				wavetable.indexSaveTime,
+				WaveTable::listUpdateNames[(uint32_t)wavetable.bootListUpdate].data(),
+				wavetable.bootListTime,
+				fatTools.flushBlocks,
+				fatTools.lastFlushTime,
+				fatTools.writeCacheEvictions,
+				fatTools.writesDeferred
 				);
 
 
@@ -91,6 +124,7 @@ void CDCHandler::ProcessCommand()
 				"dirdetails  -  Print detailed FAT directory info\r\n"
 				"add:XXXXXXXX   Channel B additive waves. Type 'help add' for details\r\n"
 				"dispmark:X  -  CV markers in display. N - none, L - line, P - pointer\r\n"
+				"oversample:X - Channel A warp oversampling. A - auto, 1, 2 or 4 - fixed\r\n"
 				"clearconfig -  Erase configuration and restart\r\n"
 				"saveconfig  -  Immediately save config\r\n"
 				"fatinfo     -  Print fat file system details\r\n"
@@ -101,12 +135,15 @@ void CDCHandler::ProcessCommand()
 				"eraseflash  -  Erase all sample storage flash data\r\n"
 				"format      -  Format sample storage flash\r\n"
 				"fixunaligned   Attempt to fix any wavetables with Unaligned errors\r\n"
+				"rebuildindex   Rescan all wavetables and rewrite list index\r\n"
 				"sreg        -  Print flash status register\r\n"
 				"flashid     -  Print flash manufacturer and device IDs\r\n"
 				"mem:A       -  Print 1024 bytes of flash (A = decimal address)\r\n"
 				"printcluster:A Print 2048 bytes of cluster address A (>=2)\r\n"
 				"clusterchain   List chain of FAT clusters\r\n"
-				"cacheinfo   -  Summary of unwritten changes in header cache\r\n"
+				"render      -  Render RENDER.TXT control script to RENDER.WAV\r\n"
+				"regress     -  Compare test renders with GOLDEN.BIN. Type 'help regress' for details\r\n"
+				"cacheinfo   -  Summary of unwritten changes in header and write caches\r\n"
 				"cachechanges   Show all bytes changed in header cache\r\n"
 				"flushcache  -  Flush any changed data in cache to flash\r\n"
 				"eraseblock:A   Erase block of memory (4096 bytes)\r\n"
@@ -115,9 +152,22 @@ void CDCHandler::ProcessCommand()
 				"\r\n"
 				"usbdebug    -  Start USB debugging\r\n"
 				"\r\n"
+#endif
+#if (PROFILE)
+				"\r\n"
+				"perf        -  Print and reset audio interrupt cycle counts\r\n"
 #endif
 		);
 
+	} else if (cmd.compare("help regress") == 0) {
+
+		usb->SendString("Audio regression suite: renders every warp type in smooth and stepped mode using the default\r\n"
+				"wavetable and up to three wavetables in the REGRESS folder, each played directly and from the PCM16 cache\r\n"
+				"regress          -  Compare with GOLDEN.BIN using default thresholds (SNR 100 dB, max error 1e-4)\r\n"
+				"regress:S,E      -  Compare with minimum SNR S dB and maximum sample error E\r\n"
+				"regress:record   -  Record GOLDEN.BIN from current firmware\r\n"
+				"\r\n");
+
 	} else if (cmd.compare("help add") == 0) {
 
 		usb->SendString("Configure channel B additive waves\r\n"
@@ -167,21 +217,26 @@ void CDCHandler::ProcessCommand()
 
 
 	} else if (cmd.compare("wavetables") == 0) {				// Prints wavetable list
-		printf("Num Name       Bytes    Data Bits Channels Invalid   Address    Metadata Frames\r\n");
+		printf("Num Name       Bytes    Data Bits Channels Invalid   Address    Metadata Frames Length\r\n");
 
 		for (uint32_t i = 0; i < wavetable.wavetableCount; ++i) {
-			printf("%3lu %8.8s %7lu %7lu %3u%1s %8u %9s %10p %08lu %6d\r\n",
+			WaveTable::WavInfo wav {};								// Catalogue only holds playback details: file header is parsed again
+			if (!wavetable.GetEntryInfo(i, wav)) {
+				static_cast<WaveTable::Wav&>(wav) = catalogue.Get(i);
+			}
+			printf("%3lu %8.8s %7lu %7lu %3u%1s %8u %9s %10p %08lu %6d %6d\r\n",
 					i,
-					wavetable.wavList[i].name,
-					wavetable.wavList[i].size,
-					wavetable.wavList[i].dataSize,
-					wavetable.wavList[i].byteDepth * 8,
-					wavetable.wavList[i].dataFormat == 3 ? "f" : " ",	// floating point format
-					wavetable.wavList[i].channels,
-					wavetable.InvalidText[wavetable.wavList[i].invalid],
-					wavetable.wavList[i].startAddr,
-					wavetable.wavList[i].metadata,
-					wavetable.wavList[i].tableCount
+					catalogue.name[i],
+					wav.size,
+					wav.dataSize,
+					wav.byteDepth * 8,
+					wav.dataFormat == 3 ? "f" : " ",	// floating point format
+					wav.channels,
+					Catalogue::InvalidText[catalogue.invalid[i]],
+					catalogue.startAddr[i],
+					wav.metadata,
+					catalogue.tableCount[i],
+					catalogue.FrameLength(i)
 					);
 		}
 		printf("\r\n");
@@ -210,6 +265,16 @@ void CDCHandler::ProcessCommand()
 		}
 
 
+	} else if (cmd.compare(0, 11, "oversample:") == 0) {		// Channel A warp oversampling. A - auto, 1, 2, 4 - fixed factor
+		char option = cmd[11];
+		if (option == 'A' || option == '1' || option == '2' || option == '4') {
+			wavetable.oversampleMode = (option == 'A') ? 0 : option - '0';
+			usb->SendString("Updated\r\n");
+		} else {
+			usb->SendString("Invalid data\r\n");
+		}
+
+
 	} else if (cmd.compare(0, 9, "dispmark:") == 0) {			// CV markers in display. N - none, L - line, P - pointer
 		char option = cmd[9];
 		if (option == 'N' || option == 'L' || option == 'P') {
@@ -225,7 +290,7 @@ void CDCHandler::ProcessCommand()
 		uint32_t addr;
 		auto res = std::from_chars(cmd.data() + cmd.find(":") + 1, cmd.data() + cmd.size(), addr, 16);
 		if (res.ec == std::errc()) {
-			extFlash.BlockErase(addr);
+			extFlash.EraseBlock(addr);
 			printf("Flash Sector Erase Address: %#010lx\r\n", addr);
 		} else {
 			usb->SendString("Invalid address\r\n");
@@ -234,6 +299,13 @@ void CDCHandler::ProcessCommand()
 	} else if (cmd.compare("fixunaligned") == 0) {				// Attempt to fix unaligned wavetable headers
 		wavetable.FixUnaligned();
 
+	} else if (cmd.compare("rebuildindex") == 0) {				// Full wavetable scan: index is saved once list is stable
+		fatTools.flushCacheBusy = true;							// Block wavetable output whilst list is changed
+		wavetable.UpdateWavetableList(true);
+		fatTools.flushCacheBusy = false;
+		printf("Scanned %lu entries in %lu ms; index will be saved in %lu seconds\r\n",
+				wavetable.wavetableCount, wavetable.listUpdateTime, WaveTable::indexSaveDelay / 1000);
+
 	} else if (cmd.compare("octo") == 0) {						// Switch Flash to octal mode
 		extFlash.SetOctoMode();
 		printf("Changed to octal mode\r\n");
@@ -308,7 +380,7 @@ void CDCHandler::ProcessCommand()
 
 	//--------------------------------------------------------------------------------------------------
 	// All flash commands that rely on memory mapped data to follow this guard
-	} else if (extFlash.flashCorrupt) {
+	} else if (flashDevice->flashCorrupt) {
 		printf("** Flash Corrupt **\r\n");
 
 	} else if (cmd.compare("fatinfo") == 0) {					// Get basic FAT directory list
@@ -325,6 +397,31 @@ void CDCHandler::ProcessCommand()
 			fatTools.PrintFiles(workBuff);
 		}
 
+#if (PROFILE)
+	} else if (cmd.compare("perf") == 0) {						// Print and reset audio profiler statistics
+		printf("Warp: %s; oversampling: %lux; mode: %s\r\n", WaveTable::warpNames[(uint32_t)wavetable.warpType].data(),
+				wavetable.oversample, wavetable.stepped ? "stepped" : "smooth");
+		profiler.Print();
+#endif
+
+	} else if (cmd.compare("render") == 0) {					// Render control script to wav file and report timing
+		renderer.Render();
+
+	} else if (cmd.compare("regress:record") == 0) {			// Record golden renders for regression suite
+		renderer.Regress(true, 0.0f, 0.0f);
+
+	} else if (cmd.compare("regress") == 0 || cmd.compare(0, 8, "regress:") == 0) {	// Compare renders with golden file: optional SNR and max error thresholds
+		float minSNR = Renderer::defaultMinSNR;
+		float maxError = Renderer::defaultMaxError;
+		if (cmd.size() > 8) {
+			char* pos;
+			minSNR = std::strtof(cmd.data() + 8, &pos);
+			if (*pos == ',') {
+				maxError = std::strtof(pos + 1, &pos);
+			}
+		}
+		renderer.Regress(false, minSNR, maxError);
+
 	} else if (cmd.compare("dirdetails") == 0) {				// Get detailed FAT directory info
 		fatTools.PrintDirInfo();
 
@@ -360,11 +457,14 @@ void CDCHandler::ProcessCommand()
 		}
 
 		// the write cache holds any blocks currently being written to to avoid multiple block erasing when writing large data
-		if (fatTools.writeCacheDirty) {
+		for (auto& wcb : fatTools.writeCache) {
+			if (wcb.dirtySectors == 0) {
+				continue;
+			}
 			uint32_t dirtyBytes = 0, firstDirtyByte = 0, lastDirtyByte = 0;
 			for (uint32_t byte = 0; byte < (fatEraseSectors * fatSectorSize); ++byte) {
-				uint32_t offset = (fatTools.writeBlock * fatEraseSectors * fatSectorSize) + byte;
-				if (fatTools.writeBlockCache[byte] != flashAddress[offset]) {
+				uint32_t offset = (wcb.block * fatEraseSectors * fatSectorSize) + byte;
+				if ((wcb.dirtySectors & (1 << (byte / fatSectorSize))) && wcb.data[byte] != flashAddress[offset]) {
 					++dirtyBytes;
 					if (firstDirtyByte == 0) {
 						firstDirtyByte = offset;
@@ -373,9 +473,8 @@ void CDCHandler::ProcessCommand()
 				}
 			}
 
-			printf("Block %2lu: %s  Dirty bytes: %lu from %lu to %lu\r\n",
-					fatTools.writeBlock, (fatTools.writeCacheDirty ? "dirty" : "     "), dirtyBytes, firstDirtyByte, lastDirtyByte);
-
+			printf("Block %2li: dirty  Sectors: 0x%02x  Dirty bytes: %lu from %lu to %lu\r\n",
+					wcb.block, wcb.dirtySectors, dirtyBytes, firstDirtyByte, lastDirtyByte);
 		}
 
 
@@ -452,7 +551,7 @@ void CDCHandler::ProcessCommand()
 			const uint32_t* p = (uint32_t*)(fatTools.GetClusterAddr(cluster, true));
 
 			for (uint32_t a = 0; a < 1024; a += 4) {
-				printf("0x%08lx: %#010lx %#010lx %#010lx %#010lx\r\n", (a * 4) + (uint32_t)p, p[a], p[a + 1], p[a + 2], p[a + 3]);
+				printf("0x%08lx: %#010lx %#010lx %#010lx %#010lx\r\n", (a * 4) + (uint32_t)(uintptr_t)p, p[a], p[a + 1], p[a + 2], p[a + 3]);
 			}
 		}
 
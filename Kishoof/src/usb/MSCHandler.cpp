@@ -78,6 +78,7 @@ void MSCHandler::ActivateEP()
 	EndPointActivate(USB::MSC_In,   Direction::in,  EndPointType::Bulk);
 	EndPointActivate(USB::MSC_Out,  Direction::out, EndPointType::Bulk);
 
+	writeDeferred = false;
 	EndPointTransfer(Direction::out, outEP, USB::ep_maxPacket);
 }
 
@@ -325,7 +326,7 @@ int8_t MSCHandler::SCSI_Inquiry()
 		bot_data_length = std::min((uint8_t)sizeof(STORAGE_Inquirydata_FS), cbw.CB[4]);
 
 		// If device not working disable through peripheral qualifier and peripheral device type fields
-		if (extFlash.flashCorrupt || fatTools.noFileSystem) {
+		if (flashDevice->flashCorrupt || fatTools.noFileSystem) {
 			STORAGE_Inquirydata_FS[0] = 0x3F;
 		}
 		botBuff = STORAGE_Inquirydata_FS;
@@ -529,7 +530,7 @@ int8_t MSCHandler::SCSI_Write()
 
 		uint32_t len = scsi_blk_len * fatSectorSize;
 
-		if (extFlash.flashCorrupt) {
+		if (flashDevice->flashCorrupt) {
 			SCSI_SenseCode(NOT_READY, WRITE_PROTECTED);
 			return -1;
 		}
@@ -551,25 +552,15 @@ int8_t MSCHandler::SCSI_Write()
 
 	} else {
 
-		// Write Process ongoing
-		uint32_t len = std::min(scsi_blk_len * fatSectorSize, MediaPacket);
+		// Write Process ongoing: if the write cache would have to write a block to flash the packet is left for the main loop,
+		// with the endpoint not prepared for the next packet so the host is NAKed until then
+		const uint32_t len = std::min(scsi_blk_len * fatSectorSize, MediaPacket);
 
-		fatTools.Write((uint8_t*)(outBuff), scsi_blk_addr, (len / fatSectorSize));
-
-#if (USB_DEBUG)
-	scsiDebug[scsiDebugCnt & scsiDebugMask].blk_addr = scsi_blk_addr;
-#endif
-
-		scsi_blk_addr += (len / fatSectorSize);
-		scsi_blk_len -= (len / fatSectorSize);
-		csw.dDataResidue -= len;			// case 12 : Ho = Do
-
-		if (scsi_blk_len == 0)	{
-			MSC_BOT_SendCSW(CSWCmdPassed);
-		} else {
-			len = std::min((scsi_blk_len * fatSectorSize), MediaPacket);
-			EndPointTransfer(Direction::out, outEP, len);				// Prepare EP to Receive next packet
+		if (!fatTools.Write((uint8_t*)(outBuff), scsi_blk_addr, (len / fatSectorSize), false)) {
+			writeDeferred = true;
+			return 0;
 		}
+		SCSI_WriteNext(len);
 	}
 
 #if (USB_DEBUG)
@@ -581,6 +572,38 @@ int8_t MSCHandler::SCSI_Write()
 }
 
 
+void MSCHandler::SCSI_WriteNext(uint32_t len)
+{
+	// Packet written to cache: send status if all blocks received or prepare endpoint to receive the next packet
+#if (USB_DEBUG)
+	scsiDebug[scsiDebugCnt & scsiDebugMask].blk_addr = scsi_blk_addr;
+#endif
+
+	scsi_blk_addr += (len / fatSectorSize);
+	scsi_blk_len -= (len / fatSectorSize);
+	csw.dDataResidue -= len;			// case 12 : Ho = Do
+
+	if (scsi_blk_len == 0)	{
+		MSC_BOT_SendCSW(CSWCmdPassed);
+	} else {
+		len = std::min((scsi_blk_len * fatSectorSize), MediaPacket);
+		EndPointTransfer(Direction::out, outEP, len);				// Prepare EP to Receive next packet
+	}
+}
+
+
+void MSCHandler::ProcessDeferredWrite()
+{
+	// Called from the main loop to write a packet that needed a write cache block evicted to flash, once any queued flush is done
+	if (writeDeferred && !fatTools.flushQueued) {
+		const uint32_t len = std::min(scsi_blk_len * fatSectorSize, MediaPacket);
+		fatTools.Write((uint8_t*)(outBuff), scsi_blk_addr, (len / fatSectorSize));
+		writeDeferred = false;
+		SCSI_WriteNext(len);
+	}
+}
+
+
 int8_t MSCHandler::SCSI_TestUnitReady()
 {
 	// Tests if the storage device is ready to receive commands; called continuously in Windows every second or so
@@ -79,6 +79,7 @@
 class USB;
 
 class MSCHandler : public USBHandler {
+	friend class HostTests;
 public:
 	MSCHandler(USB* usb, uint8_t inEP, uint8_t outEP, int8_t interface) : USBHandler(usb, inEP, outEP, interface) {
 		outBuff = xfer_buff;
@@ -92,6 +93,7 @@ public:
 	void ClassSetupData(usbRequest& req, const uint8_t* data) override;
 	uint32_t GetInterfaceDescriptor(const uint8_t** buffer) override;
 	void PrintDebug();
+	void ProcessDeferredWrite();
 
 	static const uint8_t Descriptor[];
 
@@ -113,6 +115,7 @@ private:
 	int8_t SCSI_ModeSense6();
 	int8_t SCSI_Read();
 	int8_t SCSI_Write();
+	void SCSI_WriteNext(uint32_t len);
 	int8_t SCSI_CheckAddressRange(uint32_t blk_offset, uint32_t blk_nbr);
 	int8_t SCSI_TestUnitReady();
 	int8_t SCSI_AllowPreventRemovable();
@@ -130,6 +133,7 @@ private:
 	uint32_t scsi_blk_addr;
 	uint32_t scsi_blk_len;
 	uint32_t scsi_medium_state = 0;
+	bool writeDeferred = false;				// Data packet held until the main loop can evict a write cache block (host is NAKed)
 
 
 